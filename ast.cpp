@@ -38,8 +38,10 @@
  */
 
 #include "ast.h"
+#include "builtins.h"
 #include "expr.h"
 #include "func.h"
+#include "module.h"
 #include "stmt.h"
 #include "sym.h"
 #include "util.h"
@@ -64,8 +66,41 @@ AST::AddFunction(Symbol *sym, Stmt *code) {
 
 void
 AST::GenerateIR() {
-    for (unsigned int i = 0; i < functions.size(); ++i)
-        functions[i]->GenerateIR();
+    // Generate code for everything other than the internal standard
+    // library functions first.  Then emit the stdlib functions that have
+    // been referenced so far; since they may call each other, keep going
+    // until no more are pulled in.  The definitions of most of the stdlib
+    // functions aren't even parsed until something refers to them, at
+    // which point they're added to 'functions'.
+    std::vector<Function *> stdlibFunctions;
+    unsigned int numFunctions = 0;
+    bool progress = true;
+    while (progress) {
+        for (; numFunctions < functions.size(); ++numFunctions) {
+            if (functions[numFunctions]->IsStdlibFunction())
+                stdlibFunctions.push_back(functions[numFunctions]);
+            else
+                functions[numFunctions]->GenerateIR();
+        }
+
+        progress = false;
+        for (unsigned int i = 0; i < stdlibFunctions.size(); ++i) {
+            if (stdlibFunctions[i] != NULL &&
+                stdlibFunctions[i]->IsReferenced()) {
+                stdlibFunctions[i]->GenerateIR();
+                stdlibFunctions[i] = NULL;
+                progress = true;
+            }
+        }
+
+        if (ParseReferencedStdlibFunctions(m->symbolTable))
+            progress = true;
+    }
+
+    for (unsigned int i = 0; i < stdlibFunctions.size(); ++i)
+        if (stdlibFunctions[i] != NULL)
+            stdlibFunctions[i]->DiscardDeclaration();
+    DiscardUnparsedStdlibFunctions(m->symbolTable);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -47,6 +47,8 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <map>
+#include <set>
 #if ISPC_LLVM_VERSION == ISPC_LLVM_3_2
   #include <llvm/Attributes.h>
   #include <llvm/LLVMContext.h>
@@ -81,6 +83,12 @@
 extern int yyparse();
 struct yy_buffer_state;
 extern yy_buffer_state *yy_scan_string(const char *);
+extern void yy_delete_buffer(yy_buffer_state *);
+
+/** Source code for the definitions of the stdlib.ispc functions that
+    haven't been parsed yet, indexed by function name.  Each entry has the
+    definitions of all of the overloads with that name. */
+static std::map<std::string, const char *> lUnparsedStdlibFunctions;
 
 
 /** Given an LLVM type, try to find the equivalent ispc type.  Note that
@@ -809,6 +817,230 @@ lSetInternalFunctions(llvm::Module *module) {
 }
 
 
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_4_0 // LLVM 4.0+
+/** Builtins bitcode whose definitions are only linked into a module once
+    something in the module uses them; see LinkNeededBuiltins(). */
+struct LazyBitcode {
+    const unsigned char *bitcode;
+    int length;
+    /** Names of the functions and global variables defined in the
+        bitcode. */
+    std::set<std::string> definitions;
+};
+
+static std::map<llvm::Module *, std::vector<LazyBitcode> > lLazyBitcode;
+
+
+/** Adds declarations of the functions and global variables in the given
+    lazily-loaded bitcode module to the given module and records the
+    bitcode so that the needed definitions can be linked in later. */
+static void
+lDeclareLazyBitcode(const unsigned char *bitcode, int length,
+                    llvm::Module *bcModule, llvm::Module *module) {
+    LazyBitcode lazy;
+    lazy.bitcode = bitcode;
+    lazy.length = length;
+
+    for (llvm::Function &f : *bcModule) {
+        if (f.isIntrinsic())
+            continue;
+        // (Functions that haven't been materialized yet aren't
+        // declarations.)
+        if (!f.isDeclaration())
+            lazy.definitions.insert(f.getName().str());
+        if (f.hasLocalLinkage() || module->getNamedValue(f.getName()) != NULL)
+            continue;
+
+        llvm::Function *decl =
+            llvm::Function::Create(f.getFunctionType(),
+                                   llvm::GlobalValue::ExternalLinkage,
+                                   f.getName(), module);
+        decl->setAttributes(f.getAttributes());
+        decl->setCallingConv(f.getCallingConv());
+    }
+
+    for (llvm::GlobalVariable &gv : bcModule->globals()) {
+        if (!gv.isDeclaration())
+            lazy.definitions.insert(gv.getName().str());
+        if (gv.hasLocalLinkage() || gv.hasAppendingLinkage() ||
+            module->getNamedValue(gv.getName()) != NULL)
+            continue;
+
+        new llvm::GlobalVariable(*module, gv.getValueType(), gv.isConstant(),
+                                 llvm::GlobalValue::ExternalLinkage, NULL,
+                                 gv.getName(), NULL, gv.getThreadLocalMode(),
+                                 gv.getType()->getAddressSpace());
+    }
+
+    lLazyBitcode[module].push_back(lazy);
+}
+
+
+/** Adds the global values that the given value refers to (directly or
+    through constant expressions) to refs. */
+static void
+lFindReferencedGlobals(llvm::Value *value, std::vector<llvm::GlobalValue *> &refs,
+                       std::set<llvm::Constant *> &visited) {
+    if (llvm::GlobalValue *gv = llvm::dyn_cast<llvm::GlobalValue>(value))
+        refs.push_back(gv);
+    else if (llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(value)) {
+        if (visited.insert(c).second == false)
+            return;
+        for (unsigned int i = 0; i < c->getNumOperands(); ++i)
+            lFindReferencedGlobals(c->getOperand(i), refs, visited);
+    }
+}
+
+
+/** Links the definitions from the given builtins bitcode that the module
+    currently needs: those of declarations in the module that have uses,
+    along with everything that they in turn refer to.  Returns true if
+    anything was linked. */
+static bool
+lLinkNeededBitcode(const LazyBitcode &lazy, llvm::Module *module) {
+    std::vector<std::string> roots;
+    for (std::set<std::string>::const_iterator iter = lazy.definitions.begin();
+         iter != lazy.definitions.end(); ++iter) {
+        // __keep_funcs_live calls all of the builtins that the
+        // optimization passes may introduce calls to, so it's always
+        // needed.
+        llvm::GlobalValue *gv = module->getNamedValue(*iter);
+        if (gv != NULL && gv->isDeclaration() &&
+            (!gv->use_empty() || *iter == "__keep_funcs_live"))
+            roots.push_back(*iter);
+    }
+    if (roots.empty())
+        return false;
+
+    llvm::StringRef sb = llvm::StringRef((const char *)lazy.bitcode, lazy.length);
+    llvm::Expected<std::unique_ptr<llvm::Module>> ModuleOrErr =
+        llvm::getLazyBitcodeModule(llvm::MemoryBufferRef(sb, "builtins"), *g->ctx);
+    if (!ModuleOrErr) {
+        Error(SourcePos(), "Error parsing stdlib bitcode: %s",
+              toString(ModuleOrErr.takeError()).c_str());
+        return false;
+    }
+    std::unique_ptr<llvm::Module> bcModule = std::move(ModuleOrErr.get());
+    bcModule->setTargetTriple(module->getTargetTriple());
+    bcModule->setDataLayout(module->getDataLayout());
+
+    // Find everything that the roots need from the bitcode, materializing
+    // function bodies along the way.  Things that the module already has
+    // definitions for are left alone.
+    std::set<llvm::GlobalValue *> needed;
+    std::vector<llvm::GlobalValue *> worklist;
+    for (unsigned int i = 0; i < roots.size(); ++i) {
+        llvm::GlobalValue *gv = bcModule->getNamedValue(roots[i]);
+        if (gv != NULL && needed.insert(gv).second)
+            worklist.push_back(gv);
+    }
+    std::set<llvm::Constant *> visited;
+    while (!worklist.empty()) {
+        llvm::GlobalValue *gv = worklist.back();
+        worklist.pop_back();
+
+        std::vector<llvm::GlobalValue *> refs;
+        if (llvm::Function *func = llvm::dyn_cast<llvm::Function>(gv)) {
+            if (llvm::Error err = func->materialize()) {
+                Error(SourcePos(), "Error loading stdlib bitcode: %s",
+                      toString(std::move(err)).c_str());
+                return false;
+            }
+            for (llvm::BasicBlock &bb : *func)
+                for (llvm::Instruction &inst : bb)
+                    for (unsigned int i = 0; i < inst.getNumOperands(); ++i)
+                        lFindReferencedGlobals(inst.getOperand(i), refs, visited);
+        }
+        else if (llvm::GlobalVariable *var = llvm::dyn_cast<llvm::GlobalVariable>(gv)) {
+            if (var->hasInitializer())
+                lFindReferencedGlobals(var->getInitializer(), refs, visited);
+        }
+        else if (llvm::GlobalAlias *alias = llvm::dyn_cast<llvm::GlobalAlias>(gv))
+            lFindReferencedGlobals(alias->getAliasee(), refs, visited);
+
+        for (unsigned int i = 0; i < refs.size(); ++i) {
+            if (refs[i]->isDeclaration())
+                continue;
+            if (!refs[i]->hasLocalLinkage()) {
+                llvm::GlobalValue *existing = module->getNamedValue(refs[i]->getName());
+                if (existing != NULL && !existing->isDeclaration())
+                    continue;
+            }
+            if (needed.insert(refs[i]).second)
+                worklist.push_back(refs[i]);
+        }
+    }
+
+    // Turn everything else into declarations, so that the linker doesn't
+    // bring it in for the unused declarations in the module.
+    for (llvm::Function &func : *bcModule) {
+        if (!func.isDeclaration() && needed.find(&func) == needed.end()) {
+            func.deleteBody();
+            func.setComdat(NULL);
+        }
+    }
+    for (llvm::GlobalVariable &var : bcModule->globals()) {
+        if (var.hasInitializer() && needed.find(&var) == needed.end()) {
+            var.setInitializer(NULL);
+            var.setLinkage(llvm::GlobalValue::ExternalLinkage);
+            var.setComdat(NULL);
+        }
+    }
+
+    if (g->forceAlignment != -1) {
+        llvm::GlobalVariable *alignment =
+            bcModule->getGlobalVariable("memory_alignment", true);
+        if (alignment != NULL && alignment->hasInitializer())
+            alignment->setInitializer(LLVMInt32(g->forceAlignment));
+    }
+
+    if (llvm::Linker::linkModules(*module, std::move(bcModule),
+                                  llvm::Linker::Flags::LinkOnlyNeeded)) {
+        Error(SourcePos(), "Error linking stdlib bitcode.");
+        return false;
+    }
+    lSetInternalFunctions(module);
+
+    bool linkedAny = false;
+    for (unsigned int i = 0; i < roots.size(); ++i) {
+        llvm::GlobalValue *gv = module->getNamedValue(roots[i]);
+        if (gv != NULL && !gv->isDeclaration())
+            linkedAny = true;
+    }
+    return linkedAny;
+}
+#endif // LLVM 4.0+
+
+
+void
+LinkNeededBuiltins(llvm::Module *module) {
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_4_0 // LLVM 4.0+
+    std::map<llvm::Module *, std::vector<LazyBitcode> >::iterator iter =
+        lLazyBitcode.find(module);
+    if (iter == lLazyBitcode.end())
+        return;
+
+    // Definitions linked from one bitcode module may use declarations
+    // that another one defines, so keep going until nothing changes.
+    bool linkedAny;
+    do {
+        linkedAny = false;
+        for (unsigned int i = 0; i < iter->second.size(); ++i)
+            if (lLinkNeededBitcode(iter->second[i], module))
+                linkedAny = true;
+    } while (linkedAny);
+#endif // LLVM 4.0+
+}
+
+
+void
+DiscardLazyBuiltins(llvm::Module *module) {
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_4_0 // LLVM 4.0+
+    lLazyBitcode.erase(module);
+#endif // LLVM 4.0+
+}
+
+
 /** This utility function takes serialized binary LLVM bitcode and adds its
     definitions to the given module.  Functions in the bitcode that can be
     mapped to ispc functions are also added to the symbol table.
@@ -817,10 +1049,14 @@ lSetInternalFunctions(llvm::Module *module) {
     @param length      Length of the bitcode buffer
     @param module      Module to link the bitcode into
     @param symbolTable Symbol table to add definitions to
+    @param lazy        If true (and supported by the LLVM version), only
+                       declarations are added for now and definitions are
+                       linked in by LinkNeededBuiltins() once they're used
  */
 void
 AddBitcodeToModule(const unsigned char *bitcode, int length,
-                   llvm::Module *module, SymbolTable *symbolTable, bool warn) {
+                   llvm::Module *module, SymbolTable *symbolTable, bool warn,
+                   bool lazy) {
     llvm::StringRef sb = llvm::StringRef((char *)bitcode, length);
 #if ISPC_LLVM_VERSION <= ISPC_LLVM_3_5
     llvm::MemoryBuffer *bcBuf = llvm::MemoryBuffer::getMemBuffer(sb);
@@ -829,7 +1065,9 @@ AddBitcodeToModule(const unsigned char *bitcode, int length,
 #endif
 
 #if ISPC_LLVM_VERSION >= ISPC_LLVM_4_0 // LLVM 4.0+
-    llvm::Expected<std::unique_ptr<llvm::Module>> ModuleOrErr = llvm::parseBitcodeFile(bcBuf, *g->ctx);
+    llvm::Expected<std::unique_ptr<llvm::Module>> ModuleOrErr = lazy ?
+        llvm::getLazyBitcodeModule(bcBuf, *g->ctx) :
+        llvm::parseBitcodeFile(bcBuf, *g->ctx);
     if (!ModuleOrErr) {
         Error(SourcePos(), "Error parsing stdlib bitcode: %s", toString(ModuleOrErr.takeError()).c_str());
     } else {
@@ -938,23 +1176,33 @@ AddBitcodeToModule(const unsigned char *bitcode, int length,
 #elif ISPC_LLVM_VERSION <= ISPC_LLVM_3_7 // 3.6-3.7
         llvm::Linker::LinkModules(module, bcModule);
 #else // LLVM 3.8+
-        // A hack to move over declaration, which have no definition.
-        // New linker is kind of smart and think it knows better what to do, so
-        // it removes unused declarations without definitions.
-        // This trick should be legal, as both modules use the same LLVMContext.
-        for (llvm::Function& f : *bcModule) {
-          if (f.isDeclaration()) {
-            // Declarations with uses will be moved by Linker.
-            if (f.getNumUses() > 0)
-              continue;
-            module->getOrInsertFunction(f.getName(), f.getFunctionType(),
-                f.getAttributes());
-          }
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_4_0 // LLVM 4.0+
+        if (lazy) {
+            lCheckModuleIntrinsics(bcModule);
+            lDeclareLazyBitcode(bitcode, length, bcModule, module);
+            delete bcModule;
         }
+        else
+#endif // LLVM 4.0+
+        {
+            // A hack to move over declaration, which have no definition.
+            // New linker is kind of smart and think it knows better what to do, so
+            // it removes unused declarations without definitions.
+            // This trick should be legal, as both modules use the same LLVMContext.
+            for (llvm::Function& f : *bcModule) {
+              if (f.isDeclaration()) {
+                // Declarations with uses will be moved by Linker.
+                if (f.getNumUses() > 0)
+                  continue;
+                module->getOrInsertFunction(f.getName(), f.getFunctionType(),
+                    f.getAttributes());
+              }
+            }
 
-        std::unique_ptr<llvm::Module> M(bcModule);
-        if (llvm::Linker::linkModules(*module, std::move(M))) {
-            Error(SourcePos(), "Error linking stdlib bitcode.");
+            std::unique_ptr<llvm::Module> M(bcModule);
+            if (llvm::Linker::linkModules(*module, std::move(M))) {
+                Error(SourcePos(), "Error linking stdlib bitcode.");
+            }
         }
 #endif
 
@@ -1207,17 +1455,28 @@ DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *mod
     bool runtime32 = g->target->is32Bit();
     bool warn = g->target->getISA() != Target::GENERIC;
 
+    // The builtins are only declared for now; the definitions that the
+    // program ends up using are linked in by LinkNeededBuiltins().
+#ifdef ISPC_NVPTX_ENABLED
+    bool lazy = g->target->getISA() != Target::NVPTX;
+#else
+    bool lazy = true;
+#endif /* ISPC_NVPTX_ENABLED */
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_4_0 // LLVM 4.0+
+    lLazyBitcode.erase(module);
+#endif
+
 #define EXPORT_MODULE_COND_WARN(export_module, warnings)        \
     extern unsigned char export_module[];                       \
     extern int export_module##_length;                          \
     AddBitcodeToModule(export_module, export_module##_length,   \
-                       module, symbolTable, warnings);
+                       module, symbolTable, warnings, lazy);
 
 #define EXPORT_MODULE(export_module)                            \
     extern unsigned char export_module[];                       \
     extern int export_module##_length;                          \
     AddBitcodeToModule(export_module, export_module##_length,   \
-                       module, symbolTable, true);
+                       module, symbolTable, true, lazy);
 
     // Add the definitions from the compiled builtins.c file.
     // When compiling for "generic" target family, data layout warnings for
@@ -1602,8 +1861,11 @@ DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *mod
 #endif /* ISPC_NVPTX_ENABLED */
 
     if (g->forceAlignment != -1) {
+        // (If the builtins are linked lazily, this is taken care of when
+        // they are.)
         llvm::GlobalVariable *alignment = module->getGlobalVariable("memory_alignment", true);
-        alignment->setInitializer(LLVMInt32(g->forceAlignment));
+        if (alignment != NULL)
+            alignment->setInitializer(LLVMInt32(g->forceAlignment));
     }
 
     // LLVM 3.6 is only because it was not tested with earlier versions.
@@ -1613,37 +1875,115 @@ DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *mod
     }
 #endif
 
+    lUnparsedStdlibFunctions.clear();
+
     if (includeStdlibISPC) {
         // If the user wants the standard library to be included, parse the
         // serialized version of the stdlib.ispc file to get its
-        // definitions added.
+        // definitions added.  This only has the declarations of most of
+        // the functions (see stdlib2cpp.py); their definitions are parsed
+        // by ParseReferencedStdlibFunctions() once they're used.
         extern char stdlib_mask1_code[], stdlib_mask8_code[];
         extern char stdlib_mask16_code[], stdlib_mask32_code[], stdlib_mask64_code[];
+        extern const char *stdlib_mask1_functions[], *stdlib_mask8_functions[];
+        extern const char *stdlib_mask16_functions[], *stdlib_mask32_functions[];
+        extern const char *stdlib_mask64_functions[];
+        const char *code = NULL;
+        const char **functions = NULL;
         if (g->target->getISA() == Target::GENERIC &&
             g->target->getVectorWidth() == 1) { // 1 wide uses 32 stdlib
-            yy_scan_string(stdlib_mask32_code);
+            code = stdlib_mask32_code;
+            functions = stdlib_mask32_functions;
         }
         else {
             switch (g->target->getMaskBitCount()) {
             case 1:
-                yy_scan_string(stdlib_mask1_code);
+                code = stdlib_mask1_code;
+                functions = stdlib_mask1_functions;
                 break;
             case 8:
-                yy_scan_string(stdlib_mask8_code);
+                code = stdlib_mask8_code;
+                functions = stdlib_mask8_functions;
                 break;
             case 16:
-                yy_scan_string(stdlib_mask16_code);
+                code = stdlib_mask16_code;
+                functions = stdlib_mask16_functions;
                 break;
             case 32:
-                yy_scan_string(stdlib_mask32_code);
+                code = stdlib_mask32_code;
+                functions = stdlib_mask32_functions;
                 break;
             case 64:
-                yy_scan_string(stdlib_mask64_code);
+                code = stdlib_mask64_code;
+                functions = stdlib_mask64_functions;
                 break;
             default:
                 FATAL("Unhandled mask bit size for stdlib.ispc");
             }
         }
+
+        // The table is terminated by a pair of NULLs.
+        for (int i = 0; functions[i] != NULL; i += 2)
+            lUnparsedStdlibFunctions[functions[i]] = functions[i + 1];
+
+        yy_buffer_state *strbuf = yy_scan_string(code);
+        yyparse();
+        yy_delete_buffer(strbuf);
+    }
+}
+
+
+bool
+ParseReferencedStdlibFunctions(SymbolTable *symbolTable) {
+    std::vector<const char *> code;
+    std::map<std::string, const char *>::iterator iter =
+        lUnparsedStdlibFunctions.begin();
+    while (iter != lUnparsedStdlibFunctions.end()) {
+        std::vector<Symbol *> overloads;
+        symbolTable->LookupFunction(iter->first.c_str(), &overloads);
+
+        bool referenced = false;
+        for (unsigned int i = 0; i < overloads.size(); ++i)
+            if (overloads[i]->function != NULL &&
+                overloads[i]->function->use_empty() == false)
+                referenced = true;
+
+        if (referenced) {
+            code.push_back(iter->second);
+            lUnparsedStdlibFunctions.erase(iter++);
+        }
+        else
+            ++iter;
+    }
+
+    for (unsigned int i = 0; i < code.size(); ++i) {
+        yy_buffer_state *strbuf = yy_scan_string(code[i]);
         yyparse();
+        yy_delete_buffer(strbuf);
+    }
+
+    return (code.empty() == false);
+}
+
+
+void
+DiscardUnparsedStdlibFunctions(SymbolTable *symbolTable) {
+    std::map<std::string, const char *>::iterator iter;
+    for (iter = lUnparsedStdlibFunctions.begin();
+         iter != lUnparsedStdlibFunctions.end(); ++iter) {
+        std::vector<Symbol *> overloads;
+        symbolTable->LookupFunction(iter->first.c_str(), &overloads);
+
+        // These functions are all static, and an internal function must
+        // have a definition, so their declarations have to go.
+        for (unsigned int i = 0; i < overloads.size(); ++i) {
+            llvm::Function *function = overloads[i]->function;
+            if (function != NULL && function->empty()) {
+                Assert(function->use_empty());
+                function->eraseFromParent();
+                overloads[i]->function = NULL;
+            }
+        }
     }
+    lUnparsedStdlibFunctions.clear();
 }
@@ -55,8 +55,31 @@
 void DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *module,
                   bool includeStdlib);
 
+/** DefineStdlib() only parses the declarations of the static functions in
+    stdlib.ispc.  This parses the definitions of the ones that the module
+    refers to, which adds them to the AST, and returns true if there were
+    any.  Since those definitions may refer to further stdlib functions,
+    this should be called again after code has been generated for them. */
+bool ParseReferencedStdlibFunctions(SymbolTable *symbolTable);
+
+/** Removes the declarations of the stdlib.ispc functions whose definitions
+    were never needed from the module. */
+void DiscardUnparsedStdlibFunctions(SymbolTable *symbolTable);
+
 void AddBitcodeToModule(const unsigned char *bitcode, int length,
                         llvm::Module *module, SymbolTable *symbolTable = NULL,
-                        bool warn = true);
+                        bool warn = true, bool lazy = false);
+
+/** Links the definitions of the target's builtins that the given module
+    uses, if DefineStdlib() only declared them.  Linking replaces the
+    declarations that the builtins' symbols refer to, so this must only
+    be called once IR generation for the module is complete.  It may be
+    called again later, e.g. after optimizations have introduced calls to
+    further builtins. */
+void LinkNeededBuiltins(llvm::Module *module);
+
+/** Forgets the builtins bitcode that DefineStdlib() recorded for the given
+    module, once LinkNeededBuiltins() won't be called for it anymore. */
+void DiscardLazyBuiltins(llvm::Module *module);
 
 #endif // ISPC_STDLIB_H
@@ -0,0 +1,105 @@
+/*
+  Copyright (c) 2018, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.  
+*/
+
+/* Compiles ispc programs into the running process with the JIT class from
+   libispc.a and runs them.  Two JITs with different options are used, to
+   check that each one compiles with its own options regardless of the
+   order in which they're used. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "jit.h"
+
+static const char *source =
+    "export void scale(uniform float vin[], uniform float vout[],\n"
+    "                  uniform int count) {\n"
+    "    foreach (index = 0 ... count)\n"
+    "        vout[index] = SCALE * vin[index] + OFFSET;\n"
+    "}\n";
+
+typedef void (*ScaleFunc)(float vin[], float vout[], int count);
+
+
+/* Compiles the program (with the given offset, so that the source code
+   differs between calls) and checks that it scales by the given factor. */
+static bool
+lCheck(JIT *jit, int offset, float scale) {
+    char define[64];
+    snprintf(define, sizeof(define), "#define OFFSET %d\n", offset);
+    ScaleFunc func = (ScaleFunc)jit->GetFunction(std::string(define) + source,
+                                                 "scale");
+    if (func == NULL) {
+        fprintf(stderr, "Unable to compile the program.\n");
+        return false;
+    }
+
+    float vin[17], vout[17];
+    for (int i = 0; i < 17; ++i)
+        vin[i] = (float)i;
+    func(vin, vout, 17);
+
+    for (int i = 0; i < 17; ++i) {
+        if (vout[i] != scale * vin[i] + offset) {
+            fprintf(stderr, "scale(%f) = %f, expected %f.\n", vin[i], vout[i],
+                    scale * vin[i] + offset);
+            return false;
+        }
+    }
+    printf("scale by %g, offset %d: ok\n", scale, offset);
+    return true;
+}
+
+
+int main() {
+    const char *twoArgs[] = { "-O2", "-DSCALE=2" };
+    JIT *two = JIT::Create(2, twoArgs);
+    if (two == NULL)
+        return 1;
+    bool ok = lCheck(two, 0, 2.f);
+
+    // Creating another JIT must not change the options of the first one.
+    const char *threeArgs[] = { "-O0", "-DSCALE=3" };
+    JIT *three = JIT::Create(2, threeArgs);
+    if (three == NULL)
+        return 1;
+    ok = lCheck(three, 0, 3.f) && ok;
+    ok = lCheck(two, 1, 2.f) && ok;
+    ok = lCheck(three, 1, 3.f) && ok;
+
+    // Programs that were compiled before are taken from the cache.
+    ok = lCheck(two, 0, 2.f) && ok;
+
+    delete two;
+    delete three;
+    return ok ? 0 : 1;
+}
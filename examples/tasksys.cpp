@@ -64,10 +64,31 @@
 #define ISPC_USE_TBB_TASK_GROUP
 #define ISPC_USE_TBB_PARALLEL_FOR
 
+  The ISPC_USE_PTHREADS model starts one worker thread per core (less one
+  for the main thread) and schedules tasks with per-thread work-stealing
+  deques, splitting the tasks of each launch into ranges as they are run.
+  On Linux, setting the ISPC_TASKSYS_PIN_THREADS environment variable to 1
+  pins each worker thread to a core and makes the scheduler NUMA-aware:
+  the tasks launched from the main thread are divided into contiguous
+  chunks, one per NUMA node, and workers prefer the work of their own node.
+  Applications can also create additional pools of worker threads and
+  give launches priorities; see ISPCCreateTaskPool() below.
+
   The ISPC_USE_PTHREADS_FULLY_SUBSCRIBED model essentially takes over the machine
   by assigning one pthread to each hyper-thread, and then uses spinlocks and atomics
   for task management.  This model is useful for KNC where tasks can take over 
   the machine, but less so when there are other tasks that need running on the machine.
+  Idle workers and threads waiting in ISPCSync() spin for a while and then
+  sleep, though, so the model costs little when there's no work.
+
+  Setting the ISPC_TASKSYS_TRACE environment variable to the name of a
+  file makes the task system record what it's doing: when each task ran,
+  on which thread and how long it waited to start, as well as launches,
+  syncs and, for the ISPC_USE_PTHREADS model, steals, queue depths and the
+  time workers spent sleeping.  The most recent events of each thread are
+  written to the file at exit, in the Chrome trace event format (which
+  can be viewed in chrome://tracing, for example).  (Tasks run by the
+  HPX model aren't recorded.)
 
 #define ISPC_USE_CREW
 #define ISPC_USE_HPX
@@ -137,6 +158,10 @@
   #include <sys/sysctl.h>
   #include <vector>
   #include <algorithm>
+  #ifdef ISPC_IS_LINUX
+    #include <sched.h>
+    #include <dirent.h>
+  #endif // ISPC_IS_LINUX
 #endif // ISPC_USE_PTHREADS
 #ifdef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 #include <pthread.h>
@@ -152,12 +177,14 @@
 #include <algorithm>
 //#include <stdexcept>
 #include <stack>
+#include <immintrin.h>
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 #ifdef ISPC_USE_TBB_PARALLEL_FOR
   #include <tbb/parallel_for.h>
 #endif // ISPC_USE_TBB_PARALLEL_FOR
 #ifdef ISPC_USE_TBB_TASK_GROUP
   #include <tbb/task_group.h>
+  #include <tbb/parallel_for.h>
 #endif // ISPC_USE_TBB_TASK_GROUP
 #ifdef ISPC_USE_CILK
   #include <cilk/cilk.h>
@@ -172,13 +199,23 @@
 #ifdef ISPC_IS_LINUX
   #include <malloc.h>
 #endif // ISPC_IS_LINUX
+#ifndef ISPC_IS_WINDOWS
+  #include <pthread.h>
+#endif // !ISPC_IS_WINDOWS
+
+#ifdef ISPC_IS_APPLE
+  #include <sys/time.h>
+#endif // ISPC_IS_APPLE
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <algorithm>
+#include <vector>
 
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
@@ -186,34 +223,65 @@ typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
                              int taskIndex0, int taskIndex1, int taskIndex2,
                              int taskCount0, int taskCount1, int taskCount2);
 
-// Small structure used to hold the data for each task
+// Tracing (see lTraceTask() and friends below) is enabled if this is set.
+static volatile bool traceEnabled = false;
+
+struct TaskInfo;
+static int64_t lTimestamp();
+static void lTraceTask(const TaskInfo *ti, int taskIndex, int threadIndex,
+                       int64_t start, int64_t end);
+
+// Small structure used to hold the data for each launch; the tasks of a
+// launch are identified by their index in [0, taskCount()), from which
+// their 3D indices are computed as they're run.
 #ifdef _MSC_VER
 __declspec(align(16))
 #endif
 struct TaskInfo {
     TaskFuncType func;
     void *data;
-    int taskIndex;
     int taskCount3d[3];
+    // Only set if tracing is enabled.
+    int32_t launchId;
+    int64_t launchTime;
+#if defined(  ISPC_USE_PTHREADS)
+    // Running average of the time its tasks take, in nanoseconds, or 0 if
+    // that isn't known yet.
+    volatile int64_t avgTaskTime;
+#endif
 #if defined(  ISPC_USE_CONCRT)
+    volatile int32_t nextTaskIndex;
+    volatile int32_t numUnfinishedTasks;
     event taskEvent;
 #endif
-    int taskCount() const { return taskCount3d[0]*taskCount3d[1]*taskCount3d[2]; }
-    int taskIndex0() const 
+    // ISPCLaunch() makes sure that the product fits in an int.
+    int taskCount() const {
+        return (int)((int64_t)taskCount3d[0] * taskCount3d[1] * taskCount3d[2]);
+    }
+    int taskIndex0(int taskIndex) const 
     {
       return taskIndex % taskCount3d[0];
     }
-    int taskIndex1() const 
+    int taskIndex1(int taskIndex) const 
     {
       return ( taskIndex / taskCount3d[0] ) % taskCount3d[1];
     }
-    int taskIndex2() const 
+    int taskIndex2(int taskIndex) const 
     {
       return taskIndex / ( taskCount3d[0]*taskCount3d[1] );
     }
     int taskCount0() const { return taskCount3d[0]; }
     int taskCount1() const { return taskCount3d[1]; }
     int taskCount2() const { return taskCount3d[2]; }
+    // Runs the task with the given index
+    void Run(int taskIndex, int threadIndex, int threadCount) const {
+        int64_t start = traceEnabled ? lTimestamp() : 0;
+        func(data, threadIndex, threadCount, taskIndex, taskCount(),
+             taskIndex0(taskIndex), taskIndex1(taskIndex), taskIndex2(taskIndex),
+             taskCount0(), taskCount1(), taskCount2());
+        if (traceEnabled)
+            lTraceTask(this, taskIndex, threadIndex, start, lTimestamp());
+    }
     TaskInfo() { assert(sizeof(TaskInfo) % 32 == 0); }
 }
 #ifndef _MSC_VER
@@ -221,23 +289,190 @@ __attribute__((aligned(32)));
 #endif
 ;
 
+/** Returns the number of tasks in a launch with the given number of tasks
+    in each dimension, or 0 if any of those isn't positive.  Tasks are
+    identified by their index in [0, count), which is passed to them as an
+    int, so it's an error if the count doesn't fit in one. */
+static int
+lLaunchTaskCount(int count0, int count1, int count2) {
+    if (count0 <= 0 || count1 <= 0 || count2 <= 0)
+        return 0;
+    int64_t count = (int64_t)count0 * count1;
+    if (count <= INT32_MAX)
+        count *= count2;
+    if (count > INT32_MAX) {
+        fprintf(stderr, "Unable to launch %d x %d x %d tasks: at most %d tasks "
+                "can be launched at once.\n", count0, count1, count2, INT32_MAX);
+        exit(1);
+    }
+    return (int)count;
+}
+
 // ispc expects these functions to have C linkage / not be mangled
 extern "C" { 
     void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
     void ISPCSync(void *handle);
+
+    /* Not used by ispc-generated code: returns statistics about the
+       memory allocated with ISPCAlloc() so far, over all threads. */
+    void ISPCGetAllocStats(int64_t *bytesServed, int64_t *peakBytesInUse,
+                           int64_t *bytesReserved);
+
+    /* Not used by ispc-generated code either: ISPCCreateTaskPool() starts
+       a new pool of worker threads, which runs the launches of the
+       threads that select it with ISPCSetTaskPool() (NULL selects the
+       default pool).  ISPCSetTaskPriority() sets the priority of the
+       calling thread's launches, from 0 to ISPC_NUM_TASK_PRIORITIES-1;
+       tasks of higher priority run first.  Tasks launched by tasks go to
+       the same pool, with the same priority.  Only the ISPC_USE_PTHREADS
+       model supports pools and priorities; the others ignore them. */
+    void *ISPCCreateTaskPool(int numThreads);
+    void ISPCSetTaskPool(void *pool);
+    void ISPCSetTaskPriority(int priority);
 }
 
+#define ISPC_NUM_TASK_PRIORITIES 3
+#define ISPC_DEFAULT_TASK_PRIORITY 1
+
 ///////////////////////////////////////////////////////////////////////////
-// TaskGroupBase
+// MemoryArena
+
+#define LOG_MIN_ARENA_BLOCK_SIZE 12
+#define LOG_MAX_ARENA_BLOCK_SIZE 24
+
+/** Each thread that calls ISPCAlloc() gets a MemoryArena, which serves
+    the allocations of all of the task groups it creates.  The function
+    that creates a task group also syncs it before returning, so on any
+    one thread task groups are freed in the reverse order of their
+    creation, and the arena can be a simple stack: a task group records
+    the arena's position when it first allocates memory and resets the
+    arena to it when it's freed.
+
+    The memory comes from blocks whose sizes are powers of two, growing
+    from 4kB to 16MB (or to the size of a larger allocation).  Blocks
+    aren't freed when the arena is reset, and the arenas of threads that
+    exit are reused by new threads, so once a program has warmed up,
+    ISPCAlloc() doesn't call the system allocator at all.
+ */
+class MemoryArena {
+public:
+    struct Mark {
+        int block;
+        int64_t offset, blockBase;
+    };
+
+    MemoryArena();
+
+    void *Alloc(int64_t size, int32_t alignment);
+    Mark GetMark() const;
+    void Reset(const Mark &mark);
+
+    // Statistics, for ISPCGetAllocStats().
+    int64_t bytesServed, peakBytesInUse, bytesReserved;
+
+    // All arenas are kept on a list so that their statistics can be
+    // summed up, and those of threads that have exited on another one.
+    MemoryArena *next, *nextFree;
+
+private:
+    struct Block {
+        char *mem;
+        int64_t size;
+    };
+
+    void NextBlock(int64_t minSize);
+
+    /* blocks[curBlock] is the one being allocated from; the ones after it
+       are free.  blockBase is the total size of the blocks before it. */
+    std::vector<Block> blocks;
+    int curBlock;
+    int64_t curOffset, blockBase;
+};
+
+
+inline MemoryArena::MemoryArena() {
+    bytesServed = peakBytesInUse = bytesReserved = 0;
+    next = nextFree = NULL;
+    curBlock = 0;
+    curOffset = blockBase = 0;
+}
+
+
+inline void *
+MemoryArena::Alloc(int64_t size, int32_t alignment) {
+    if (curBlock == (int)blocks.size() ||
+        curOffset + size + alignment > blocks[curBlock].size)
+        NextBlock(size + alignment);
+
+    char *basePtr = blocks[curBlock].mem;
+    intptr_t iptr = (intptr_t)(basePtr + curOffset);
+    iptr = (iptr + (alignment-1)) & ~(intptr_t)(alignment-1);
+    curOffset = (int64_t)(iptr - (intptr_t)basePtr) + size;
+
+    bytesServed += size;
+    peakBytesInUse = std::max(peakBytesInUse, blockBase + curOffset);
+    return (char *)iptr;
+}
+
+
+/** Moves on to the next block, making sure that it's at least minSize
+    bytes large.  The rest of the current block is left unused until the
+    arena is reset. */
+inline void
+MemoryArena::NextBlock(int64_t minSize) {
+    if (curBlock < (int)blocks.size()) {
+        blockBase += blocks[curBlock].size;
+        ++curBlock;
+    }
+    curOffset = 0;
+
+    // The free blocks are all alike, so take the first one that's large
+    // enough.
+    for (int i = curBlock; i < (int)blocks.size(); ++i) {
+        if (blocks[i].size >= minSize) {
+            std::swap(blocks[i], blocks[curBlock]);
+            return;
+        }
+    }
+
+    int logSize = std::min(LOG_MIN_ARENA_BLOCK_SIZE + (int)blocks.size(),
+                           LOG_MAX_ARENA_BLOCK_SIZE);
+    while (((int64_t)1 << logSize) < minSize)
+        ++logSize;
+    Block block;
+    block.size = (int64_t)1 << logSize;
+    block.mem = new char[block.size];
+    blocks.insert(blocks.begin() + curBlock, block);
+    bytesReserved += block.size;
+}
 
-#define LOG_TASK_QUEUE_CHUNK_SIZE 14
-#define MAX_TASK_QUEUE_CHUNKS 8
-#define TASK_QUEUE_CHUNK_SIZE (1<<LOG_TASK_QUEUE_CHUNK_SIZE)
 
-#define MAX_LAUNCHED_TASKS (MAX_TASK_QUEUE_CHUNKS * TASK_QUEUE_CHUNK_SIZE)
+inline MemoryArena::Mark
+MemoryArena::GetMark() const {
+    Mark mark;
+    mark.block = curBlock;
+    mark.offset = curOffset;
+    mark.blockBase = blockBase;
+    return mark;
+}
+
+
+inline void
+MemoryArena::Reset(const Mark &mark) {
+    curBlock = mark.block;
+    curOffset = mark.offset;
+    blockBase = mark.blockBase;
+}
+
+
+static MemoryArena *lGetArena();
+
+///////////////////////////////////////////////////////////////////////////
+// TaskGroupBase
 
-#define NUM_MEM_BUFFERS 16
+#define LOG_TASK_INFO_CHUNK_SIZE 6
+#define TASK_INFO_CHUNK_SIZE (1<<LOG_TASK_INFO_CHUNK_SIZE)
 
 class TaskGroup;
 
@@ -250,11 +485,16 @@ class TaskGroupBase {
 public:
     void Reset();
 
-    int AllocTaskInfo(int count);
+    TaskInfo *AllocTaskInfo();
     TaskInfo *GetTaskInfo(int index);
 
     void *AllocMemory(int64_t size, int32_t alignment);
 
+    /* Used by AllocTaskGroup() and FreeTaskGroup(): the group's index in
+       the table of all task groups, and that of the next group on the
+       free list (plus one, so that 0 ends the list). */
+    int32_t groupIndex, nextFreeGroup;
+
 protected:
     TaskGroupBase();
     ~TaskGroupBase();
@@ -262,108 +502,69 @@ protected:
     int nextTaskInfoIndex;
 
 private:
-    /* We allocate blocks of TASK_QUEUE_CHUNK_SIZE TaskInfo structures as
-       needed by the calling function.  We hold up to MAX_TASK_QUEUE_CHUNKS
-       of these (and then exit at runtime if more than this many tasks are
-       launched.)
+    /* We allocate blocks of TASK_INFO_CHUNK_SIZE TaskInfo structures, one
+       per launch, as needed by the calling function.  Blocks are never
+       moved, so the TaskInfo pointers handed out stay valid until the
+       task group is reset.
      */
-    TaskInfo *taskInfo[MAX_TASK_QUEUE_CHUNKS];
+    std::vector<TaskInfo *> taskInfo;
 
-    /* We also allocate chunks of memory to service ISPCAlloc() calls.  The
-       memBuffers[] array holds pointers to this memory.  The first element
-       of this array is initialized to point to mem and then any subsequent
-       elements required are initialized with dynamic allocation.
+    /* ISPCAlloc() calls are served by the calling thread's arena, which
+       is reset to arenaMark when the task group is reset; arena is NULL
+       if the task group hasn't allocated any memory yet.
      */
-    int curMemBuffer, curMemBufferOffset;
-    int memBufferSize[NUM_MEM_BUFFERS];
-    char *memBuffers[NUM_MEM_BUFFERS];
-    char mem[256];
+    MemoryArena *arena;
+    MemoryArena::Mark arenaMark;
 };
 
 
 inline TaskGroupBase::TaskGroupBase() { 
     nextTaskInfoIndex = 0; 
-
-    curMemBuffer = 0; 
-    curMemBufferOffset = 0;
-    memBuffers[0] = mem;
-    memBufferSize[0] = sizeof(mem) / sizeof(mem[0]);
-    for (int i = 1; i < NUM_MEM_BUFFERS; ++i) {
-        memBuffers[i] = NULL;
-        memBufferSize[i] = 0;
-    }
-
-    for (int i = 0; i < MAX_TASK_QUEUE_CHUNKS; ++i)
-        taskInfo[i] = NULL;
+    arena = NULL;
 }
 
 
 inline TaskGroupBase::~TaskGroupBase() {
-    // Note: don't delete memBuffers[0], since it points to the start of
-    // the "mem" member!
-    for (int i = 1; i < NUM_MEM_BUFFERS; ++i)
-        delete[](memBuffers[i]);
+    for (size_t i = 0; i < taskInfo.size(); ++i)
+        delete[](taskInfo[i]);
 }
 
 
 inline void
 TaskGroupBase::Reset() {
     nextTaskInfoIndex = 0; 
-    curMemBuffer = 0; 
-    curMemBufferOffset = 0;
+    if (arena != NULL) {
+        arena->Reset(arenaMark);
+        arena = NULL;
+    }
 }
 
 
-inline int
-TaskGroupBase::AllocTaskInfo(int count) {
-    int ret = nextTaskInfoIndex;
-    nextTaskInfoIndex += count;
-    return ret;
+inline TaskInfo *
+TaskGroupBase::AllocTaskInfo() {
+    int index = nextTaskInfoIndex++;
+    int chunk = (index >> LOG_TASK_INFO_CHUNK_SIZE);
+    if (chunk == (int)taskInfo.size())
+        taskInfo.push_back(new TaskInfo[TASK_INFO_CHUNK_SIZE]);
+    return GetTaskInfo(index);
 }
 
 
 inline TaskInfo *
 TaskGroupBase::GetTaskInfo(int index) {
-    int chunk = (index >> LOG_TASK_QUEUE_CHUNK_SIZE);
-    int offset = index & (TASK_QUEUE_CHUNK_SIZE-1);
-
-    if (chunk == MAX_TASK_QUEUE_CHUNKS) {
-        fprintf(stderr, "A total of %d tasks have been launched from the "
-                "current function--the simple built-in task system can handle "
-                "no more. You can increase the values of TASK_QUEUE_CHUNK_SIZE "
-                "and LOG_TASK_QUEUE_CHUNK_SIZE to work around this limitation.  "
-                "Sorry!  Exiting.\n", index);
-        exit(1);
-    }
-
-    if (taskInfo[chunk] == NULL)
-        taskInfo[chunk] = new TaskInfo[TASK_QUEUE_CHUNK_SIZE];
+    int chunk = (index >> LOG_TASK_INFO_CHUNK_SIZE);
+    int offset = index & (TASK_INFO_CHUNK_SIZE-1);
     return &taskInfo[chunk][offset];
 }
 
 
 inline void *
 TaskGroupBase::AllocMemory(int64_t size, int32_t alignment) {
-    char *basePtr = memBuffers[curMemBuffer];
-    intptr_t iptr = (intptr_t)(basePtr + curMemBufferOffset);
-    iptr = (iptr + (alignment-1)) & ~(alignment-1);
-
-    int newOffset = int(iptr - (intptr_t)basePtr + size);
-    if (newOffset < memBufferSize[curMemBuffer]) {
-        curMemBufferOffset = newOffset;
-        return (char *)iptr;
+    if (arena == NULL) {
+        arena = lGetArena();
+        arenaMark = arena->GetMark();
     }
-
-    ++curMemBuffer;
-    curMemBufferOffset = 0;
-    assert(curMemBuffer < NUM_MEM_BUFFERS);
-
-    int allocSize = 1 << (12 + curMemBuffer);
-    allocSize = std::max(int(size+alignment), allocSize);
-    char *newBuf = new char[allocSize];
-    memBufferSize[curMemBuffer] = allocSize;
-    memBuffers[curMemBuffer] = newBuf;
-    return AllocMemory(size, alignment);
+    return arena->Alloc(size, alignment);
 }
 
 
@@ -390,6 +591,20 @@ lAtomicCompareAndSwapPointer(void **v, void *newValue, void *oldValue) {
 #endif // ISPC_IS_WINDOWS
 }
 
+#ifndef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+// Only used by the task group pool (see AllocTaskGroup()).
+static int64_t 
+lAtomicCompareAndSwap64(volatile int64_t *v, int64_t newValue, int64_t oldValue) {
+#ifdef ISPC_IS_WINDOWS
+    return InterlockedCompareExchange64((volatile LONGLONG *)v, newValue, oldValue);
+#else
+    int64_t result = __sync_val_compare_and_swap(v, oldValue, newValue);
+    lMemFence();
+    return result;
+#endif // ISPC_IS_WINDOWS
+}
+#endif // !ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
 static int32_t 
 lAtomicCompareAndSwap32(volatile int32_t *v, int32_t newValue, int32_t oldValue) {
 #ifdef ISPC_IS_WINDOWS
@@ -401,22 +616,386 @@ lAtomicCompareAndSwap32(volatile int32_t *v, int32_t newValue, int32_t oldValue)
 #endif // ISPC_IS_WINDOWS
 }
 
+// Returns the value *v had before the addition
 static inline int32_t 
 lAtomicAdd(volatile int32_t *v, int32_t delta) {
 #ifdef ISPC_IS_WINDOWS
-    return InterlockedExchangeAdd((volatile LONG *)v, delta)+delta;
+    return InterlockedExchangeAdd((volatile LONG *)v, delta);
 #else
     return __sync_fetch_and_add(v, delta);
 #endif
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Thread indices
+
+/* Tasks may use threadIndex to index per-thread data (e.g. scratch
+   buffers with threadCount entries), so the threadIndex of each running
+   task must be different from that of every other task running at the
+   same time, including tasks launched by running tasks.  Task systems
+   that don't number their threads themselves give each thread that runs
+   tasks an index the first time it runs one; threadCount is the number of
+   indices handed out so far, so it never decreases and is always greater
+   than the index of any running task.  The indices of threads that exit
+   are reused (except on Windows, where the thread pools are of bounded
+   size anyway), so threadCount is bounded by the largest number of
+   threads that have run tasks at the same time.  (Note that a task
+   waiting in a sync may run other tasks on its thread in the meantime,
+   which then have the same threadIndex as it.)
+ */
+#ifdef ISPC_IS_WINDOWS
+#define ISPC_THREAD_LOCAL __declspec(thread)
+#else
+#define ISPC_THREAD_LOCAL __thread
+#endif
+
+static volatile int32_t lNumThreadIndices = 0;
+static ISPC_THREAD_LOCAL int lThreadIndex = -1;
+
+static inline void
+lSpinLock(volatile int32_t *lock) {
+    while (lAtomicCompareAndSwap32(lock, 1, 0) != 0)
+        ;
+}
+
+static inline void
+lSpinUnlock(volatile int32_t *lock) {
+    lMemFence();
+    *lock = 0;
+}
+
+#ifndef ISPC_IS_WINDOWS
+// Indices of threads that have exited, protected by freeThreadIndicesLock.
+static volatile int32_t freeThreadIndicesLock = 0;
+static std::vector<int> freeThreadIndices;
+static pthread_key_t threadIndexKey;
+static pthread_once_t threadIndexKeyOnce = PTHREAD_ONCE_INIT;
+
+static void
+lFreeThreadIndex(void *index) {
+    lSpinLock(&freeThreadIndicesLock);
+    freeThreadIndices.push_back((int)(intptr_t)index - 1);
+    lSpinUnlock(&freeThreadIndicesLock);
+}
+
+static void
+lCreateThreadIndexKey() {
+    pthread_key_create(&threadIndexKey, lFreeThreadIndex);
+}
+#endif // !ISPC_IS_WINDOWS
+
+static int
+lAllocThreadIndex() {
+#ifdef ISPC_IS_WINDOWS
+    return lAtomicAdd(&lNumThreadIndices, 1);
+#else
+    int index = -1;
+    lSpinLock(&freeThreadIndicesLock);
+    if (freeThreadIndices.size() > 0) {
+        index = freeThreadIndices.back();
+        freeThreadIndices.pop_back();
+    }
+    lSpinUnlock(&freeThreadIndicesLock);
+    if (index < 0)
+        index = lAtomicAdd(&lNumThreadIndices, 1);
+
+    // Have the index returned to the free list when the thread exits.
+    // (The key's value is offset by one, since the destructor isn't
+    // called for NULL values.)
+    pthread_once(&threadIndexKeyOnce, lCreateThreadIndexKey);
+    pthread_setspecific(threadIndexKey, (void *)(intptr_t)(index + 1));
+    return index;
+#endif // ISPC_IS_WINDOWS
+}
+
+static inline int
+lGetThreadIndex() {
+    if (lThreadIndex < 0)
+        lThreadIndex = lAllocThreadIndex();
+    return lThreadIndex;
+}
+
+static inline int
+lGetThreadCount() {
+    return lNumThreadIndices;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Per-thread memory arenas
+
+static ISPC_THREAD_LOCAL MemoryArena *lArena = NULL;
+static MemoryArena *volatile allArenas = NULL;
+
+#ifndef ISPC_IS_WINDOWS
+// Arenas of threads that have exited, protected by freeArenasLock.
+static volatile int32_t freeArenasLock = 0;
+static MemoryArena *freeArenas = NULL;
+static pthread_key_t arenaKey;
+static pthread_once_t arenaKeyOnce = PTHREAD_ONCE_INIT;
+
+static void
+lFreeArena(void *arena) {
+    lSpinLock(&freeArenasLock);
+    ((MemoryArena *)arena)->nextFree = freeArenas;
+    freeArenas = (MemoryArena *)arena;
+    lSpinUnlock(&freeArenasLock);
+}
+
+static void
+lCreateArenaKey() {
+    pthread_key_create(&arenaKey, lFreeArena);
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+static MemoryArena *
+lGetArena() {
+    if (lArena != NULL)
+        return lArena;
+
+    MemoryArena *arena = NULL;
+#ifndef ISPC_IS_WINDOWS
+    lSpinLock(&freeArenasLock);
+    if (freeArenas != NULL) {
+        arena = freeArenas;
+        freeArenas = arena->nextFree;
+    }
+    lSpinUnlock(&freeArenasLock);
+#endif // !ISPC_IS_WINDOWS
+
+    if (arena == NULL) {
+        arena = new MemoryArena;
+        while (1) {
+            arena->next = allArenas;
+            if (lAtomicCompareAndSwapPointer((void **)&allArenas, arena,
+                                             arena->next) == arena->next)
+                break;
+        }
+    }
+
+#ifndef ISPC_IS_WINDOWS
+    // Hand the arena on to another thread when this one exits.
+    pthread_once(&arenaKeyOnce, lCreateArenaKey);
+    pthread_setspecific(arenaKey, arena);
+#endif // !ISPC_IS_WINDOWS
+    lArena = arena;
+    return arena;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Tracing
+
+/* When tracing is enabled, each thread records events in its own ring
+   buffer of TRACE_BUFFER_SIZE events, so recording doesn't need any
+   synchronization; once a buffer is full, the oldest events are
+   overwritten.  The buffers are written out at exit, while worker threads
+   may still be running; see lWriteTrace(). */
+#define LOG_TRACE_BUFFER_SIZE 16
+#define TRACE_BUFFER_SIZE (1<<LOG_TRACE_BUFFER_SIZE)
+
+enum TraceEventType {
+    TRACE_TASK,         // args: launch id, task index, thread index
+    TRACE_LAUNCH,       // args: launch id, task count
+    TRACE_SYNC,
+    TRACE_STEAL,        // args: victim thread index
+    TRACE_QUEUE_DEPTH,  // args: number of queued ranges
+    TRACE_IDLE
+};
+
+struct TraceEvent {
+    int64_t start, end;
+    // For tasks, the time their launch was queued.
+    int64_t launchTime;
+    int32_t type;
+    int32_t args[3];
+};
+
+struct TraceBuffer {
+    TraceBuffer(int id) {
+        this->id = id;
+        numEvents = 0;
+        next = NULL;
+    }
+
+    int id;
+    // Total number of events recorded, including overwritten ones.
+    volatile int64_t numEvents;
+    TraceBuffer *next;
+    TraceEvent events[TRACE_BUFFER_SIZE];
+};
+
+static const char *traceFileName = NULL;
+static volatile int32_t traceInitialized = 0;
+static volatile int32_t nextLaunchId = 0;
+static volatile int32_t nextTraceBufferId = 0;
+static TraceBuffer *volatile allTraceBuffers = NULL;
+static ISPC_THREAD_LOCAL TraceBuffer *lTraceBuffer = NULL;
+
+
+/** Returns the time in nanoseconds, relative to some arbitrary point. */
+static int64_t
+lTimestamp() {
+#if defined(ISPC_IS_WINDOWS)
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (int64_t)(count.QuadPart * (1e9 / frequency.QuadPart));
+#elif defined(ISPC_IS_APPLE)
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000000 + (int64_t)tv.tv_usec * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+static void
+lTraceEvent(TraceEventType type, int64_t start, int64_t end,
+            int32_t arg0 = 0, int32_t arg1 = 0, int32_t arg2 = 0,
+            int64_t launchTime = 0) {
+    TraceBuffer *buffer = lTraceBuffer;
+    if (buffer == NULL) {
+        buffer = new TraceBuffer(lAtomicAdd(&nextTraceBufferId, 1));
+        while (1) {
+            buffer->next = allTraceBuffers;
+            if (lAtomicCompareAndSwapPointer((void **)&allTraceBuffers, buffer,
+                                             buffer->next) == buffer->next)
+                break;
+        }
+        lTraceBuffer = buffer;
+    }
+
+    TraceEvent &event = buffer->events[buffer->numEvents & (TRACE_BUFFER_SIZE-1)];
+    event.type = type;
+    event.start = start;
+    event.end = end;
+    event.launchTime = launchTime;
+    event.args[0] = arg0;
+    event.args[1] = arg1;
+    event.args[2] = arg2;
+    // lWriteTrace() may read the buffer while other threads are still
+    // running, so make sure the event is complete before it's counted.
+    lMemFence();
+    ++buffer->numEvents;
+}
+
+
+static void
+lTraceTask(const TaskInfo *ti, int taskIndex, int threadIndex,
+           int64_t start, int64_t end) {
+    lTraceEvent(TRACE_TASK, start, end, ti->launchId, taskIndex, threadIndex,
+                ti->launchTime);
+}
+
+
+/** Writes the events in all of the trace buffers to the trace file.  This
+    runs at exit, when the worker threads may still be running tasks, so
+    it stops the recording of new events first; a thread that already
+    started to record one may still write it to the slot after the last
+    counted event, which, once the buffer has wrapped around, holds the
+    oldest one.  So each buffer's count is read once, after the fence, and
+    that slot is skipped. */
+static void
+lWriteTrace() {
+    traceEnabled = false;
+    lMemFence();
+
+    std::vector<TraceBuffer *> buffers;
+    std::vector<int64_t> firstEvents, numEvents;
+    for (TraceBuffer *b = allTraceBuffers; b != NULL; b = b->next) {
+        int64_t n = b->numEvents;
+        buffers.push_back(b);
+        firstEvents.push_back(std::max(n - TRACE_BUFFER_SIZE + 1, (int64_t)0));
+        numEvents.push_back(n);
+    }
+    lMemFence();
+
+    FILE *f = fopen(traceFileName, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open trace file \"%s\": %s\n", traceFileName,
+                strerror(errno));
+        return;
+    }
+
+    // Timestamps are written in microseconds, relative to the first event.
+    int64_t base = INT64_MAX;
+    for (unsigned int j = 0; j < buffers.size(); ++j)
+        for (int64_t i = firstEvents[j]; i < numEvents[j]; ++i)
+            base = std::min(base, buffers[j]->events[i & (TRACE_BUFFER_SIZE-1)].start);
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    const char *sep = "";
+    for (unsigned int j = 0; j < buffers.size(); ++j) {
+        const TraceBuffer *b = buffers[j];
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}", sep, b->id, b->id);
+        sep = ",\n";
+
+        for (int64_t i = firstEvents[j]; i < numEvents[j]; ++i) {
+            const TraceEvent &e = b->events[i & (TRACE_BUFFER_SIZE-1)];
+            double ts = (e.start - base) * 1e-3, dur = (e.end - e.start) * 1e-3;
+            fprintf(f, "%s{\"pid\":0,\"tid\":%d,\"ts\":%.3f,", sep, b->id, ts);
+            switch (e.type) {
+            case TRACE_TASK:
+                fprintf(f, "\"name\":\"task\",\"ph\":\"X\",\"dur\":%.3f,"
+                        "\"args\":{\"launch\":%d,\"taskIndex\":%d,\"threadIndex\":%d,"
+                        "\"queueWait\":%.3f}}", dur, e.args[0], e.args[1], e.args[2],
+                        (e.start - e.launchTime) * 1e-3);
+                break;
+            case TRACE_LAUNCH:
+                fprintf(f, "\"name\":\"launch\",\"ph\":\"i\",\"s\":\"t\","
+                        "\"args\":{\"launch\":%d,\"taskCount\":%d}}",
+                        e.args[0], e.args[1]);
+                break;
+            case TRACE_SYNC:
+                fprintf(f, "\"name\":\"sync\",\"ph\":\"X\",\"dur\":%.3f}", dur);
+                break;
+            case TRACE_STEAL:
+                fprintf(f, "\"name\":\"steal\",\"ph\":\"i\",\"s\":\"t\","
+                        "\"args\":{\"victim\":%d}}", e.args[0]);
+                break;
+            case TRACE_QUEUE_DEPTH:
+                fprintf(f, "\"name\":\"queued ranges\",\"ph\":\"C\","
+                        "\"args\":{\"thread %d\":%d}}", b->id, e.args[0]);
+                break;
+            case TRACE_IDLE:
+                fprintf(f, "\"name\":\"idle\",\"ph\":\"X\",\"dur\":%.3f}", dur);
+                break;
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+
+/** Enables tracing if the ISPC_TASKSYS_TRACE environment variable is set;
+    only the first call does anything. */
+static void
+lInitTrace() {
+    if (traceInitialized)
+        return;
+    if (lAtomicCompareAndSwap32(&traceInitialized, 1, 0) != 0)
+        return;
+
+    traceFileName = getenv("ISPC_TASKSYS_TRACE");
+    if (traceFileName != NULL && traceFileName[0] != '\0') {
+        atexit(lWriteTrace);
+        lMemFence();
+        traceEnabled = true;
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////
 
 #ifdef ISPC_USE_CONCRT
 // With ConcRT, we don't need to extend TaskGroupBase at all.
 class TaskGroup : public TaskGroupBase {
 public:
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 };
 #endif // ISPC_USE_CONCRT
@@ -432,7 +1011,7 @@ public:
         gcdGroup = dispatch_group_create();
     }
 
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 
 private:
@@ -441,33 +1020,49 @@ private:
 #endif // ISPC_USE_GCD
 
 #ifdef ISPC_USE_PTHREADS
-static void *lTaskEntry(void *arg);
+struct TaskRange;
+struct TaskPool;
 
 class TaskGroup : public TaskGroupBase {
 public:
     TaskGroup() {
+        pool = NULL;
         numUnfinishedTasks = 0;
-        waitingTasks.reserve(128);
-        inActiveList = false;
+        syncWaiting = 0;
+        pthread_mutex_init(&syncMutex, NULL);
+        pthread_cond_init(&syncCond, NULL);
+    }
+
+    ~TaskGroup() {
+        pthread_cond_destroy(&syncCond);
+        pthread_mutex_destroy(&syncMutex);
     }
 
     void Reset() {
         TaskGroupBase::Reset();
+        pool = NULL;
         numUnfinishedTasks = 0;
-        assert(inActiveList == false);
         lMemFence();
     }
 
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 
-private:
-    friend void *lTaskEntry(void *arg);
+    /* Runs the tasks in the given range, first handing off as much of it
+       as possible to other threads, and then marks them as finished. */
+    void RunRange(const TaskRange &range);
 
-    int32_t numUnfinishedTasks;
+private:
+    // The pool the group's tasks run in.
+    TaskPool *pool;
+    volatile int32_t numUnfinishedTasks;
     int32_t pad[3];
-    std::vector<int> waitingTasks;
-    bool inActiveList;
+
+    /* A thread in Sync() that has run out of work to help with sleeps on
+       syncCond (setting syncWaiting) until the last task finishes. */
+    volatile int32_t syncWaiting;
+    pthread_mutex_t syncMutex;
+    pthread_cond_t syncCond;
 };
 
 #endif // ISPC_USE_PTHREADS
@@ -476,7 +1071,7 @@ private:
 
 class TaskGroup : public TaskGroupBase {
 public:
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 
 };
@@ -487,7 +1082,7 @@ public:
 
 class TaskGroup : public TaskGroupBase {
 public:
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 
 };
@@ -498,7 +1093,7 @@ public:
 
 class TaskGroup : public TaskGroupBase {
 public:
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 
 };
@@ -509,7 +1104,7 @@ public:
 
 class TaskGroup : public TaskGroupBase {
 public:
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 private:
     tbb::task_group tbbTaskGroup;
@@ -521,7 +1116,7 @@ private:
 
 class TaskGroup : public TaskGroupBase {
 public:
-    void Launch(int baseIndex, int count);
+    void Launch(TaskInfo *ti);
     void Sync();
 private:
     std::vector<hpx::future<void>> futures;
@@ -562,27 +1157,27 @@ InitTaskSystem() {
 
 
 static void
-lRunTask(void *ti) {
+lRunTask(void *ti, size_t taskIndex) {
     TaskInfo *taskInfo = (TaskInfo *)ti;
-    // FIXME: these are bogus values; may cause bugs in code that depends
-    // on them having unique values in different threads.
-    int threadIndex = 0;
-    int threadCount = 1;
+    int threadIndex = lGetThreadIndex();
+    int threadCount = lGetThreadCount();
 
     // Actually run the task
-    taskInfo->func(taskInfo->data, threadIndex, threadCount, 
-                   taskInfo->taskIndex, taskInfo->taskCount(),
-            taskInfo->taskIndex0(), taskInfo->taskIndex1(), taskInfo->taskIndex2(),
-            taskInfo->taskCount0(), taskInfo->taskCount1(), taskInfo->taskCount2());
+    taskInfo->Run((int)taskIndex, threadIndex, threadCount);
+}
+
+
+static void
+lRunLaunch(void *ti) {
+    // Run all of the launch's tasks concurrently; this returns once
+    // they've all finished, which is when the group's work is done.
+    dispatch_apply_f(((TaskInfo *)ti)->taskCount(), gcdQueue, ti, lRunTask);
 }
 
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    for (int i = 0; i < count; ++i) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-        dispatch_group_async_f(gcdGroup, gcdQueue, ti, lRunTask);
-    }
+TaskGroup::Launch(TaskInfo *ti) {
+    dispatch_group_async_f(gcdGroup, gcdQueue, ti, lRunLaunch);
 }
 
 
@@ -604,29 +1199,54 @@ InitTaskSystem() {
 }
 
 
+/** Returns the index of the next task of the launch that hasn't been
+    started yet, or -1 if they all have.  (The index is only advanced while
+    it's less than the task count, so it can't overflow.) */
+static inline int
+lNextTaskIndex(TaskInfo *ti, int count) {
+    while (1) {
+        int32_t index = ti->nextTaskIndex;
+        if (index >= count)
+            return -1;
+        if (lAtomicCompareAndSwap32(&ti->nextTaskIndex, index + 1, index) == index)
+            return index;
+    }
+}
+
+
 static void __cdecl
-lRunTask(LPVOID param) {
+lRunTasks(LPVOID param) {
     TaskInfo *ti = (TaskInfo *)param;
-    
-    // Actually run the task. 
-    // FIXME: like the GCD implementation for OS X, this is passing bogus
-    // values for the threadIndex and threadCount builtins, which in turn
-    // will cause bugs in code that uses those.
-    int threadIndex = 0;
-    int threadCount = 1;
-    ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
 
-    // Signal the event that this task is done
-    ti->taskEvent.set();
+    // Each scheduled call keeps running the launch's tasks that haven't
+    // been started yet, until there are none left.
+    int count = ti->taskCount();
+    int threadIndex = lGetThreadIndex();
+    int numRun = 0;
+    int taskIndex;
+    while ((taskIndex = lNextTaskIndex(ti, count)) >= 0) {
+        ti->Run(taskIndex, threadIndex, lGetThreadCount());
+        ++numRun;
+    }
+
+    // Signal the event once all of the launch's tasks are done
+    if (numRun > 0 && lAtomicAdd(&ti->numUnfinishedTasks, -numRun) == numRun)
+        ti->taskEvent.set();
 }
 
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    for (int i = 0; i < count; ++i)
-        CurrentScheduler::ScheduleTask(lRunTask, GetTaskInfo(baseIndex + i));
+TaskGroup::Launch(TaskInfo *ti) {
+    int count = ti->taskCount();
+    ti->nextTaskIndex = 0;
+    ti->numUnfinishedTasks = count;
+    lMemFence();
+    // Rather than scheduling each task separately, schedule one call per
+    // worker thread (or per task, if there are fewer of them), which
+    // then pull tasks from the launch.
+    int numRunners = std::min(count, (int)GetProcessorCount());
+    for (int i = 0; i < numRunners; ++i)
+        CurrentScheduler::ScheduleTask(lRunTasks, ti);
 }
 
 
@@ -644,303 +1264,946 @@ TaskGroup::Sync() {
 ///////////////////////////////////////////////////////////////////////////
 // pthreads
 
-#ifdef ISPC_USE_PTHREADS
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_FULLY_SUBSCRIBED)
+/* Threads that run out of work spin for a while, looking for more, before
+   going to sleep: this keeps the wake-up latency low when work arrives
+   shortly.  The number of spins adapts to how often spinning pays off:
+   it's doubled when work turns up while spinning and halved when it
+   doesn't, so idle threads quickly settle into sleeping. */
+#define MIN_SPIN_COUNT 16
+#define MAX_SPIN_COUNT 4096
+static __thread int lSpinCount = MAX_SPIN_COUNT / 4;
 
-static volatile int32_t lock = 0;
 
-static int nThreads;
-static pthread_t *threads = NULL;
+static inline void
+lPause() {
+#if defined(ISPC_IS_KNC)
+    _mm_delay_32(8);
+#elif defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
 
-static pthread_mutex_t taskSysMutex;
-static std::vector<TaskGroup *> activeTaskGroups;
-static sem_t *workerSemaphore;
 
-static void *
-lTaskEntry(void *arg) {
-    int threadIndex = (int)((int64_t)arg);
-    int threadCount = nThreads;
+static inline void
+lUpdateSpinCount(bool spinningPaidOff) {
+    if (spinningPaidOff)
+        lSpinCount = std::min(2 * lSpinCount, MAX_SPIN_COUNT);
+    else
+        lSpinCount = std::max(lSpinCount / 2, MIN_SPIN_COUNT);
+}
+#endif // ISPC_USE_PTHREADS || ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 
-    while (1) {
-        int err;
-        //
-        // Wait on the semaphore until we're woken up due to the arrival of
-        // more work.
-        //
-        if ((err = sem_wait(workerSemaphore)) != 0) {
-            fprintf(stderr, "Error from sem_wait: %s\n", strerror(err));
-            exit(1);
-        }
+#ifdef ISPC_USE_PTHREADS
 
-        //
-        // Acquire the mutex
-        //
-        if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
-            exit(1);
-        }
+/* Each worker thread has a Chase-Lev work-stealing deque of ranges of
+   tasks.  When a range is run, it's repeatedly split in half, with the
+   upper half pushed onto the bottom of the running thread's deque, until
+   a single task is left; idle threads steal from the top of the other
+   threads' deques, where the largest ranges are, and split those in
+   turn.  Launching and syncing thus don't contend on any shared state,
+   and a launch of N tasks is spread across the machine in O(log N)
+   steps.  Threads that aren't workers (e.g. the application's main
+   thread) put the ranges they launch in a shared, mutex-protected
+   queue instead.
+
+   When the workers are pinned to cores, there's one such queue per NUMA
+   node and each range carries the node it should preferably run on:
+   launches from non-workers are divided into one contiguous range per
+   node, and idle workers look at their own node's queue and steal from
+   workers on the same node before going further afield.
+
+   All of this is per TaskPool and per priority; see below.
+ */
+struct TaskRange {
+    TaskGroup *taskGroup;
+    TaskInfo *taskInfo;
+    int begin, end;
+    // NUMA node this range has affinity for.
+    int node;
+    TaskPool *pool;
+    int priority;
+};
 
-        if (activeTaskGroups.size() == 0) {
-            //
-            // Task queue is empty, go back and wait on the semaphore
-            //
-            if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                exit(1);
-            }
-            continue;
-        }
+#define LOG_TASK_DEQUE_SIZE 12
+#define TASK_DEQUE_SIZE (1<<LOG_TASK_DEQUE_SIZE)
 
-        //
-        // Get the last task group on the active list and the last task
-        // from its waiting tasks list.
-        //
-        TaskGroup *tg = activeTaskGroups.back();
-        assert(tg->waitingTasks.size() > 0);
-        int taskNumber = tg->waitingTasks.back();
-        tg->waitingTasks.pop_back();
-
-        if (tg->waitingTasks.size() == 0) {
-            // We just took the last task from this task group, so remove
-            // it from the active list.
-            activeTaskGroups.pop_back();
-            tg->inActiveList = false;
-        }
-    
-        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-            exit(1);
-        }
+/* Only the thread that owns a TaskDeque may call Push() and Pop(); any
+   thread may call Steal().  The deque has a fixed size; Push() returns
+   false if it is full, in which case the caller just runs the range
+   itself. */
+class TaskDeque {
+public:
+    TaskDeque() {
+        top = bottom = 0;
+    }
 
-        //
-        // And now actually run the task
-        //
-        DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
-        TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
-        myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
-                     myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+    bool Push(const TaskRange &range);
+    bool Pop(TaskRange *range);
+    bool Steal(TaskRange *range);
+    // Approximate when called by a thread other than the owner.
+    int Size() const { return (int)(bottom - top); }
 
-        //
-        // Decrement the "number of unfinished tasks" counter in the task
-        // group.
-        //
-        lMemFence();
-        lAtomicAdd(&tg->numUnfinishedTasks, -1);
-    }
+private:
+    // top and bottom are kept on separate cache lines, since thieves
+    // only update the former and the owner mostly updates the latter.
+    volatile int64_t top;
+    char pad0[64 - sizeof(int64_t)];
+    volatile int64_t bottom;
+    char pad1[64 - sizeof(int64_t)];
+    TaskRange ranges[TASK_DEQUE_SIZE];
+};
 
-    pthread_exit(NULL);
-    return 0;
-}
 
+inline bool
+TaskDeque::Push(const TaskRange &range) {
+    int64_t b = bottom, t = top;
+    if (b - t >= TASK_DEQUE_SIZE)
+        return false;
 
-static void
-InitTaskSystem() {
-    if (threads == NULL) {
-        while (1) {
-            if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
-                if (threads == NULL) {
-                    // We launch one fewer thread than there are cores,
-                    // since the main thread here will also grab jobs from
-                    // the task queue itself.
-                    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    ranges[b & (TASK_DEQUE_SIZE-1)] = range;
+    // Make sure the range is visible before the new bottom is.
+    lMemFence();
+    bottom = b + 1;
+    return true;
+}
 
-                    int err;
-                    if ((err = pthread_mutex_init(&taskSysMutex, NULL)) != 0) {
-                        fprintf(stderr, "Error creating mutex: %s\n", strerror(err));
-                        exit(1);
-                    }
 
-                    char name[32];
-                    bool success = false;
-                    srand(time(NULL));
-                    for (int i = 0; i < 10; i++) {
-                        sprintf(name, "ispc_task.%d.%d", (int)getpid(), (int)rand());
-                        workerSemaphore = sem_open(name, O_CREAT, S_IRUSR|S_IWUSR, 0);
-                        if (workerSemaphore != SEM_FAILED) {
-                            success = true;
-                            break;
-                        }
-                        fprintf(stderr, "Failed to create %s\n", name);
-                    }
+inline bool
+TaskDeque::Pop(TaskRange *range) {
+    int64_t b = bottom - 1;
+    bottom = b;
+    // The new bottom has to be visible to thieves before we read top;
+    // this needs a full fence even on x86.
+    __sync_synchronize();
+    int64_t t = top;
 
-                    if (!success) {
-                        fprintf(stderr, "Error creating semaphore (%s): %s\n", name, strerror(errno));
-                        exit(1);
-                    }
+    if (t > b) {
+        // Empty
+        bottom = b + 1;
+        return false;
+    }
 
-                    threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
-                    for (int i = 0; i < nThreads; ++i) {
-                      err = pthread_create(&threads[i], NULL, &lTaskEntry, (void *)((long long)i));
-                        if (err != 0) {
-                            fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
-                            exit(1);
-                        }
-                    }
+    *range = ranges[b & (TASK_DEQUE_SIZE-1)];
+    if (t < b)
+        return true;
 
-                    activeTaskGroups.reserve(64);
-                }
+    // This is the last range in the deque, so we may be racing with a
+    // thief for it; whoever advances top gets it.
+    bool won = __sync_bool_compare_and_swap(&top, t, t + 1);
+    bottom = b + 1;
+    return won;
+}
 
-                // Make sure all of the above goes to memory before we
-                // clear the lock.
-                lMemFence();
-                lock = 0;
-                break;
-            }
+
+inline bool
+TaskDeque::Steal(TaskRange *range) {
+    int64_t t = top;
+    __sync_synchronize();
+    int64_t b = bottom;
+    if (t >= b)
+        return false;
+
+    // The slot can only be reused by the owner once top has moved past
+    // it, in which case the compare-and-swap below fails and the copy is
+    // discarded.
+    TaskRange r = ranges[t & (TASK_DEQUE_SIZE-1)];
+    if (!__sync_bool_compare_and_swap(&top, t, t + 1))
+        return false;
+    *range = r;
+    return true;
+}
+
+
+static volatile int32_t lock = 0;
+
+// Ranges launched by threads that aren't workers.  Each NUMA node has
+// NUM_NODE_QUEUE_SHARDS such queues, and each thread uses the one given by
+// a hash of its thread ID, so that many threads can launch tasks at once
+// without contending for a single lock.
+#define NUM_NODE_QUEUE_SHARDS 8
+
+struct NodeQueue {
+    NodeQueue() {
+        int err;
+        if ((err = pthread_mutex_init(&mutex, NULL)) != 0) {
+            fprintf(stderr, "Error creating mutex: %s\n", strerror(err));
+            exit(1);
+        }
+        ranges.reserve(64);
+        numRanges = 0;
+    }
+
+    pthread_mutex_t mutex;
+    std::vector<TaskRange> ranges;
+    volatile int32_t numRanges;
+    // Keep each queue on its own cache lines.
+    char pad[64];
+};
+
+/* The machine's topology, as given by lGetTopology(): the CPUs that
+   workers are pinned to (if pinThreads is set), the NUMA node of each of
+   them and the share of the cores on each node.  nextCpu is the index in
+   cpus of the CPU the next worker to be created is pinned to. */
+static bool pinThreads = false;
+static std::vector<int> cpus, cpuNodes;
+static int nNodes = 1;
+static std::vector<int> nodeCores;
+static int nextCpu = 1;
+
+/* A TaskPool is a set of worker threads along with the queues that they
+   take work from.  The default pool has a worker for each core but one;
+   the application may create others with ISPCCreateTaskPool(), so that
+   e.g. latency-critical launches don't queue up behind background ones.
+   Pools are never destroyed.
+
+   Each launch also has a priority.  The queues are replicated for each
+   priority, and threads look for work at higher priorities first, so a
+   launch preempts those of lower priority as soon as their running tasks
+   finish. */
+struct TaskPool {
+    int nThreads;
+    pthread_t *threads;
+    // Thread index of the pool's first worker.
+    int firstThreadIndex;
+
+    TaskDeque *taskDeques[ISPC_NUM_TASK_PRIORITIES];
+    NodeQueue *nodeQueues[ISPC_NUM_TASK_PRIORITIES];
+    // Number of tasks at each priority that haven't finished yet; this
+    // lets threads skip the priorities that have no work at all.
+    volatile int32_t numUnfinishedTasks[ISPC_NUM_TASK_PRIORITIES];
+    // The NUMA node of each worker thread.
+    int *workerNode;
+
+    // Idle workers sleep on workerSemaphore; it's only posted to if
+    // numSleepingWorkers shows that someone may be waiting.
+    sem_t *workerSemaphore;
+    volatile int32_t numSleepingWorkers;
+};
+
+static TaskPool *defaultPool = NULL;
+
+/* The pool the calling thread is a worker of, and the index of its deques
+   in it, or NULL and -1 if it isn't a worker thread. */
+static __thread TaskPool *lWorkerPool = NULL;
+static __thread int lWorkerIndex = -1;
+static __thread unsigned int lStealSeed = 0;
+static __thread unsigned int lThreadHash = 0;
+
+/* The pool and priority of the calling thread's launches.  While a range
+   of tasks runs, they're those of the range (see RunRange()), whether
+   it's running on one of its pool's workers or on a thread helping out in
+   Sync(). */
+static __thread TaskPool *lCurrentPool = NULL;
+static __thread int lCurrentPriority = ISPC_DEFAULT_TASK_PRIORITY;
+
+static void
+lWakeWorker(TaskPool *pool) {
+    // Pairs with the atomic increment of numSleepingWorkers in
+    // lTaskEntry(): either the worker sees the range we just queued or we
+    // see that it's going to sleep.
+    __sync_synchronize();
+    if (pool->numSleepingWorkers > 0) {
+        if (sem_post(pool->workerSemaphore) != 0) {
+            fprintf(stderr, "Error from sem_post: %s\n", strerror(errno));
+            exit(1);
         }
     }
 }
 
 
-inline void
-TaskGroup::Launch(int baseCoord, int count) {
-    //
-    // Acquire mutex, add task
-    //
+/** Returns a hash of the calling thread's ID, which picks its node queue
+    shard and its first steal victim.  (lGetThreadIndex() isn't used for
+    this, since only threads that run tasks should take a thread index.) */
+static inline unsigned int
+lGetThreadHash() {
+    if (lThreadHash == 0) {
+        // Thread IDs are often aligned addresses, so mix all of their bits.
+        uint64_t h = (uint64_t)(uintptr_t)pthread_self();
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        lThreadHash = (unsigned int)h | 1;
+    }
+    return lThreadHash;
+}
+
+
+/** Queues the given range so that other threads can run it; returns false
+    if it couldn't be queued. */
+static bool
+lQueueRange(const TaskRange &range) {
+    TaskPool *pool = range.pool;
+    int depth;
+    if (lWorkerPool == pool) {
+        TaskDeque &deque = pool->taskDeques[range.priority][lWorkerIndex];
+        if (!deque.Push(range))
+            return false;
+        depth = deque.Size();
+    }
+    else {
+        int shard = lGetThreadHash() % NUM_NODE_QUEUE_SHARDS;
+        NodeQueue &queue =
+            pool->nodeQueues[range.priority][range.node * NUM_NODE_QUEUE_SHARDS + shard];
+        int err;
+        if ((err = pthread_mutex_lock(&queue.mutex)) != 0) {
+            fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
+            exit(1);
+        }
+        queue.ranges.push_back(range);
+        depth = lAtomicAdd(&queue.numRanges, 1) + 1;
+        if ((err = pthread_mutex_unlock(&queue.mutex)) != 0) {
+            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    if (traceEnabled) {
+        int64_t now = lTimestamp();
+        lTraceEvent(TRACE_QUEUE_DEPTH, now, now, depth);
+    }
+
+    lWakeWorker(pool);
+    return true;
+}
+
+
+static inline void
+lTraceSteal(int victim) {
+    if (traceEnabled) {
+        int64_t now = lTimestamp();
+        lTraceEvent(TRACE_STEAL, now, now, victim);
+    }
+}
+
+
+/** Takes the most recently queued range from the given queue of ranges
+    launched by non-worker threads. */
+static bool
+lPopNodeQueue(NodeQueue &queue, TaskRange *range) {
+    if (queue.numRanges == 0)
+        return false;
+
+    bool found = false;
     int err;
-    if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
+    if ((err = pthread_mutex_lock(&queue.mutex)) != 0) {
         fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
         exit(1);
     }
+    if (queue.ranges.size() > 0) {
+        *range = queue.ranges.back();
+        queue.ranges.pop_back();
+        lAtomicAdd(&queue.numRanges, -1);
+        found = true;
+    }
+    if ((err = pthread_mutex_unlock(&queue.mutex)) != 0) {
+        fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+        exit(1);
+    }
+    return found;
+}
 
-    // Add the corresponding set of tasks to the waiting-to-be-run list for
-    // this task group.
-    //
-    // FIXME: it's a little ugly to hold a global mutex for this when we
-    // only need to make sure no one else is accessing this task group's
-    // waitingTasks list.  (But a small experiment in switching to a
-    // per-TaskGroup mutex showed worse performance!)
-    for (int i = 0; i < count; ++i)
-        waitingTasks.push_back(baseCoord + i);
 
-    // Add the task group to the global active list if it isn't there
-    // already.
-    if (inActiveList == false) {
-        activeTaskGroups.push_back(this);
-        inActiveList = true;
+/** Takes a range from one of the given node's queues, starting with the
+    calling thread's own shard. */
+static bool
+lPopNodeQueues(NodeQueue *nodeQueues, int node, TaskRange *range) {
+    int shard = lGetThreadHash() % NUM_NODE_QUEUE_SHARDS;
+    for (int i = 0; i < NUM_NODE_QUEUE_SHARDS; ++i) {
+        int index = node * NUM_NODE_QUEUE_SHARDS + (shard + i) % NUM_NODE_QUEUE_SHARDS;
+        if (lPopNodeQueue(nodeQueues[index], range))
+            return true;
     }
+    return false;
+}
 
-    if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-        fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-        exit(1);
+
+/** Finds a range of tasks with the given priority in the given pool for
+    the calling thread to run: the most recently queued range from its own
+    deque if it's one of the pool's workers, then a range launched by a
+    non-worker thread, and then one stolen from another worker.  Work on
+    the calling thread's NUMA node is preferred over work on other nodes
+    at each step. */
+static bool
+lFindRange(TaskPool *pool, int priority, TaskRange *range) {
+    int self = (lWorkerPool == pool) ? lWorkerIndex : -1;
+    TaskDeque *taskDeques = pool->taskDeques[priority];
+    NodeQueue *nodeQueues = pool->nodeQueues[priority];
+    int nThreads = pool->nThreads;
+
+    if (self >= 0 && taskDeques[self].Pop(range))
+        return true;
+
+    // Non-workers aren't pinned, so they're treated as being on node 0.
+    int node = self >= 0 ? pool->workerNode[self] : 0;
+    if (lPopNodeQueues(nodeQueues, node, range))
+        return true;
+
+    if (nThreads == 0) {
+        for (int i = 1; i < nNodes; ++i)
+            if (lPopNodeQueues(nodeQueues, (node + i) % nNodes, range))
+                return true;
+        return false;
     }
 
-    //
-    // Update the count of the number of tasks left to run in this task
-    // group.
-    //
-    lMemFence();
-    lAtomicAdd(&numUnfinishedTasks, count);
+    // Start at a random victim so that thieves spread out.
+    if (lStealSeed == 0)
+        lStealSeed = lGetThreadHash();
+    lStealSeed ^= lStealSeed << 13;
+    lStealSeed ^= lStealSeed >> 17;
+    lStealSeed ^= lStealSeed << 5;
+    int start = (int)(lStealSeed % (unsigned int)nThreads);
+
+    if (nNodes > 1) {
+        // Before looking at other nodes' queues, try stealing from the
+        // workers on our own node.
+        for (int i = 0; i < nThreads; ++i) {
+            int victim = (start + i) % nThreads;
+            if (victim != self && pool->workerNode[victim] == node &&
+                taskDeques[victim].Steal(range)) {
+                lTraceSteal(victim);
+                return true;
+            }
+        }
+        for (int i = 1; i < nNodes; ++i)
+            if (lPopNodeQueues(nodeQueues, (node + i) % nNodes, range))
+                return true;
+    }
+
+    for (int i = 0; i < nThreads; ++i) {
+        int victim = (start + i) % nThreads;
+        if (victim != self && taskDeques[victim].Steal(range)) {
+            lTraceSteal(victim);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** Finds a range of tasks in the given pool for the calling thread to
+    run, looking at the highest priorities first.  Returns false if
+    there's no work available. */
+static bool
+lFindRange(TaskPool *pool, TaskRange *range) {
+    for (int priority = ISPC_NUM_TASK_PRIORITIES - 1; priority >= 0; --priority)
+        if (pool->numUnfinishedTasks[priority] > 0 &&
+            lFindRange(pool, priority, range))
+            return true;
+    return false;
+}
+
+
+/* Splitting ranges all the way down to single tasks costs far more than
+   running tiny tasks does, so ranges are only split as long as running
+   the halves takes more than about TARGET_CHUNK_TIME nanoseconds, given
+   the measured average time of the launch's tasks (as long as there are
+   enough chunks to keep all of the threads busy).  The averages are also
+   kept in a small cache, indexed by task function, so that they're known
+   from the start of later launches of the same function. */
+#define TARGET_CHUNK_TIME 10000
+#define LOG_TASK_TIME_CACHE_SIZE 8
+#define TASK_TIME_CACHE_SIZE (1<<LOG_TASK_TIME_CACHE_SIZE)
+
+static volatile int64_t taskTimeCache[TASK_TIME_CACHE_SIZE];
+
+static inline volatile int64_t &
+lCachedTaskTime(TaskFuncType func) {
+    return taskTimeCache[((uintptr_t)func >> 4) & (TASK_TIME_CACHE_SIZE-1)];
+}
+
+
+/** Returns the number of tasks of the given launch below which ranges
+    aren't split any further.  Ranges in pools without workers are never
+    split: the halves could be left in a queue that only a thread already
+    asleep in Sync() would have looked at. */
+static inline int
+lGrainSize(const TaskInfo *ti, const TaskPool *pool) {
+    if (pool->nThreads == 0)
+        return ti->taskCount();
+    int64_t avg = ti->avgTaskTime;
+    if (avg <= 0)
+        return 1;
+    int64_t grain = TARGET_CHUNK_TIME / avg;
+    grain = std::min(grain, (int64_t)ti->taskCount() / (8 * (pool->nThreads + 1)));
+    return (int)std::max(grain, (int64_t)1);
+}
+
+
+/** Updates the launch's average task time with the time that running
+    numTasks of its tasks took.  Races between threads doing this at the
+    same time only lose a sample. */
+static inline void
+lUpdateTaskTime(TaskInfo *ti, int64_t elapsed, int numTasks) {
+    int64_t sample = std::max(elapsed / numTasks, (int64_t)1);
+    int64_t avg = ti->avgTaskTime;
+    avg = (avg == 0) ? sample : avg + (sample - avg) / 4;
+    ti->avgTaskTime = avg;
+    lCachedTaskTime(ti->func) = avg;
+}
+
+
+inline void
+TaskGroup::RunRange(const TaskRange &range) {
+    TaskInfo *ti = range.taskInfo;
+    int begin = range.begin;
+
+    // Split off the upper half of the range for other threads until it's
+    // small enough (or our deque is full).  The halves keep the range's
+    // pool, priority and node affinity.
+    int grain = lGrainSize(ti, range.pool);
+    int last = range.end;
+    while (last - begin > grain) {
+        TaskRange upper = range;
+        upper.begin = begin + (last - begin) / 2;
+        upper.end = last;
+        if (!lQueueRange(upper))
+            break;
+        last = upper.begin;
+    }
+
+    // Tasks launched by these tasks go to the same pool, with the same
+    // priority.
+    TaskPool *savedPool = lCurrentPool;
+    int savedPriority = lCurrentPriority;
+    lCurrentPool = range.pool;
+    lCurrentPriority = range.priority;
+
+    // Workers' thread indices are assigned when their pool is created;
+    // other threads that run tasks (in Sync()) are numbered after them.
+    int threadIndex = lGetThreadIndex();
+    int threadCount = lGetThreadCount();
+    int64_t start = lTimestamp();
+    for (int i = begin; i < last; ++i) {
+        DBG(fprintf(stderr, "running task %d from group %p\n", i, this));
+        ti->Run(i, threadIndex, threadCount);
+    }
+    lUpdateTaskTime(ti, lTimestamp() - start, last - begin);
+    lCurrentPool = savedPool;
+    lCurrentPriority = savedPriority;
 
     //
-    // Post to the worker semaphore to wake up worker threads that are
-    // sleeping waiting for tasks to show up
+    // Decrement the "number of unfinished tasks" counters in the task
+    // group and in the pool.
     //
-    for (int i = 0; i < count; ++i)
-        if ((err = sem_post(workerSemaphore)) != 0) {
-            fprintf(stderr, "Error from sem_post: %s\n", strerror(err));
-            exit(1);
+    lMemFence();
+    lAtomicAdd(&range.pool->numUnfinishedTasks[range.priority], -(last - begin));
+    if (lAtomicAdd(&numUnfinishedTasks, -(last - begin)) == last - begin) {
+        // That was the last of them; wake up the thread in Sync() if it's
+        // gone to sleep.  (The atomic add is a full barrier, which pairs
+        // with the one in Sync() after it sets syncWaiting.)
+        if (syncWaiting) {
+            pthread_mutex_lock(&syncMutex);
+            pthread_cond_signal(&syncCond);
+            pthread_mutex_unlock(&syncMutex);
         }
+    }
 }
 
 
-inline void
-TaskGroup::Sync() {
-    DBG(fprintf(stderr, "syncing %p - %d unfinished\n", tg, numUnfinishedTasks));
+struct WorkerStart {
+    TaskPool *pool;
+    int index;
+};
 
-    while (numUnfinishedTasks > 0) {
-        // All of the tasks in this group aren't finished yet.  We'll try
-        // to help out here since we don't have anything else to do...
 
-        DBG(fprintf(stderr, "while syncing %p - %d unfinished\n", tg, 
-                    numUnfinishedTasks));
+static void *
+lTaskEntry(void *arg) {
+    WorkerStart *start = (WorkerStart *)arg;
+    TaskPool *pool = start->pool;
+    lWorkerPool = pool;
+    lWorkerIndex = start->index;
+    lThreadIndex = pool->firstThreadIndex + lWorkerIndex;
+    delete start;
+
+    while (1) {
+        TaskRange range;
+        if (lFindRange(pool, &range)) {
+            range.taskGroup->RunRange(range);
+            continue;
+        }
+
+        // Spin for a while in case more work shows up soon.
+        bool found = false;
+        for (int i = 0; i < lSpinCount && !found; ++i) {
+            lPause();
+            found = lFindRange(pool, &range);
+        }
+        lUpdateSpinCount(found);
+        if (found) {
+            range.taskGroup->RunRange(range);
+            continue;
+        }
 
         //
-        // Acquire the global task system mutex to grab a task to work on
+        // There's no work anywhere; announce that we're going to sleep,
+        // check once more (in case a range was queued before the
+        // announcement was visible), and then wait on the semaphore until
+        // we're woken up due to the arrival of more work.
         //
-        int err;
-        if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
-            exit(1);
+        lAtomicAdd(&pool->numSleepingWorkers, 1);
+        if (lFindRange(pool, &range)) {
+            lAtomicAdd(&pool->numSleepingWorkers, -1);
+            range.taskGroup->RunRange(range);
+            continue;
         }
 
-        TaskInfo *myTask = NULL;
-        TaskGroup *runtg = this;
-        if (waitingTasks.size() > 0) {
-            int taskNumber = waitingTasks.back();
-            waitingTasks.pop_back();
-
-            if (waitingTasks.size() == 0) {
-                // There's nothing left to start running from this group,
-                // so remove it from the active task list.
-                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
-                                                 activeTaskGroups.end(), this));
-                inActiveList = false;
+        int64_t sleepStart = traceEnabled ? lTimestamp() : 0;
+        while (sem_wait(pool->workerSemaphore) != 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Error from sem_wait: %s\n", strerror(errno));
+                exit(1);
             }
-            myTask = GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from group %p in sync\n", taskNumber, tg));
         }
-        else {
-            // Other threads are already working on all of the tasks in
-            // this group, so we can't help out by running one ourself.
-            // We'll try to run one from another group to make ourselves
-            // useful here.
-            if (activeTaskGroups.size() == 0) {
-                // No active task groups left--there's nothing for us to do.
-                if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                    fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                    exit(1);
-                }
-                // FIXME: We basically end up busy-waiting here, which is
-                // extra wasteful in a world with hyper-threading.  It would
-                // be much better to put this thread to sleep on a
-                // condition variable that was signaled when the last task
-                // in this group was finished.
-#ifndef ISPC_IS_KNC
-                usleep(1);
-#else
-                _mm_delay_32(8);
-#endif
+        lAtomicAdd(&pool->numSleepingWorkers, -1);
+        if (traceEnabled)
+            lTraceEvent(TRACE_IDLE, sleepStart, lTimestamp());
+    }
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+
+#ifdef ISPC_IS_LINUX
+/** Parses a list of CPUs as given in sysfs (e.g. "0-3,8,10-11"). */
+static std::vector<int>
+lParseCpuList(const char *list) {
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        int first = (int)strtol(p, &end, 10), last = first;
+        if (*end == '-')
+            last = (int)strtol(end + 1, &end, 10);
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+        if (*end != ',')
+            break;
+        p = end + 1;
+    }
+    return cpus;
+}
+
+
+/** Gets the CPUs the process may run on, ordered by NUMA node, and the
+    node of each of them; nodes are numbered from zero.  Returns false if
+    the topology can't be determined, in which case threads are neither
+    pinned nor assigned to nodes. */
+static bool
+lGetTopology(std::vector<int> *cpus, std::vector<int> *cpuNodes, int *numNodes) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return false;
+
+    // Find the node of each CPU; if there's no NUMA information (e.g.
+    // the kernel was built without NUMA support), all CPUs are taken to
+    // be on a single node.
+    std::vector<std::pair<int, int> > nodeAndCpu;
+    std::vector<int> nodeIds;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int nodeId;
+            if (sscanf(entry->d_name, "node%d", &nodeId) != 1)
+                continue;
+            char path[128], list[4096];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                     nodeId);
+            FILE *f = fopen(path, "r");
+            if (f == NULL)
                 continue;
+            bool ok = fgets(list, sizeof(list), f) != NULL;
+            fclose(f);
+            if (!ok)
+                continue;
+
+            std::vector<int> nodeCpus = lParseCpuList(list);
+            for (unsigned int i = 0; i < nodeCpus.size(); ++i)
+                if (nodeCpus[i] < CPU_SETSIZE && CPU_ISSET(nodeCpus[i], &allowed))
+                    nodeAndCpu.push_back(std::make_pair(nodeId, nodeCpus[i]));
+        }
+        closedir(dir);
+    }
+    if (nodeAndCpu.size() == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed))
+                nodeAndCpu.push_back(std::make_pair(0, cpu));
+        if (nodeAndCpu.size() == 0)
+            return false;
+    }
+
+    // Sort by node and renumber the nodes that have CPUs we may use
+    // consecutively.
+    std::sort(nodeAndCpu.begin(), nodeAndCpu.end());
+    *numNodes = 0;
+    for (unsigned int i = 0; i < nodeAndCpu.size(); ++i) {
+        if (i > 0 && nodeAndCpu[i].first != nodeAndCpu[i-1].first)
+            ++*numNodes;
+        cpus->push_back(nodeAndCpu[i].second);
+        cpuNodes->push_back(*numNodes);
+    }
+    ++*numNodes;
+    return true;
+}
+#endif // ISPC_IS_LINUX
+
+
+/** Creates a pool with the given number of worker threads; must be
+    called with the lock held. */
+static TaskPool *
+lCreateTaskPool(int numThreads) {
+    TaskPool *pool = new TaskPool;
+    pool->nThreads = numThreads;
+    pool->numSleepingWorkers = 0;
+
+    char name[32];
+    bool success = false;
+    for (int i = 0; i < 10; i++) {
+        sprintf(name, "ispc_task.%d.%d", (int)getpid(), (int)rand());
+        pool->workerSemaphore = sem_open(name, O_CREAT, S_IRUSR|S_IWUSR, 0);
+        if (pool->workerSemaphore != SEM_FAILED) {
+            success = true;
+            break;
+        }
+        fprintf(stderr, "Failed to create %s\n", name);
+    }
+
+    if (!success) {
+        fprintf(stderr, "Error creating semaphore (%s): %s\n", name, strerror(errno));
+        exit(1);
+    }
+
+    for (int p = 0; p < ISPC_NUM_TASK_PRIORITIES; ++p) {
+        pool->taskDeques[p] = new TaskDeque[numThreads];
+        pool->nodeQueues[p] = new NodeQueue[nNodes * NUM_NODE_QUEUE_SHARDS];
+        pool->numUnfinishedTasks[p] = 0;
+    }
+
+    // Workers are assigned to CPUs (and thus nodes) round-robin, across
+    // all pools; the first CPU is left for the main thread, which isn't
+    // pinned, though.
+    std::vector<int> workerCpu(numThreads);
+    pool->workerNode = new int[numThreads];
+    for (int i = 0; i < numThreads; ++i) {
+        workerCpu[i] = nextCpu;
+        pool->workerNode[i] = cpuNodes[nextCpu];
+        nextCpu = (nextCpu + 1) % cpuNodes.size();
+    }
+
+    // Reserve thread indices for the workers.
+    pool->firstThreadIndex = lAtomicAdd(&lNumThreadIndices, numThreads);
+
+    // The deques must be set up before the threads start looking at them.
+    lMemFence();
+
+    pool->threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+#ifdef ISPC_IS_LINUX
+        if (pinThreads) {
+            cpu_set_t cpuSet;
+            CPU_ZERO(&cpuSet);
+            CPU_SET(cpus[workerCpu[i]], &cpuSet);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet);
+        }
+#endif // ISPC_IS_LINUX
+        WorkerStart *start = new WorkerStart;
+        start->pool = pool;
+        start->index = i;
+        int err = pthread_create(&pool->threads[i], &attr, &lTaskEntry, start);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+
+static void
+InitTaskSystem() {
+    if (defaultPool == NULL) {
+        while (1) {
+            if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+                if (defaultPool == NULL) {
+                    srand(time(NULL));
+
+                    // Unless the threads are pinned, they're all taken
+                    // to be on a single node.
+                    int nCores = sysconf(_SC_NPROCESSORS_ONLN);
+                    const char *pin = getenv("ISPC_TASKSYS_PIN_THREADS");
+                    pinThreads = (pin != NULL && atoi(pin) != 0);
+#ifdef ISPC_IS_LINUX
+                    if (pinThreads && !lGetTopology(&cpus, &cpuNodes, &nNodes)) {
+                        cpus.clear();
+                        cpuNodes.clear();
+                        pinThreads = false;
+                    }
+#else
+                    pinThreads = false;
+#endif // ISPC_IS_LINUX
+                    if (!pinThreads) {
+                        nNodes = 1;
+                        cpuNodes.assign(nCores, 0);
+                    }
+                    nodeCores.assign(nNodes, 0);
+                    for (unsigned int i = 0; i < cpuNodes.size(); ++i)
+                        ++nodeCores[cpuNodes[i]];
+                    nextCpu = 1 % cpuNodes.size();
+
+                    // We launch one fewer thread than there are cores,
+                    // since the main thread here will also grab jobs from
+                    // the task queue itself.
+                    TaskPool *pool = lCreateTaskPool(nCores - 1);
+                    lMemFence();
+                    defaultPool = pool;
+                }
+
+                // Make sure all of the above goes to memory before we
+                // clear the lock.
+                lMemFence();
+                lock = 0;
+                break;
             }
+        }
+    }
+}
 
-            // Get a task to run from another task group.
-            runtg = activeTaskGroups.back();
-            assert(runtg->waitingTasks.size() > 0);
-
-            int taskNumber = runtg->waitingTasks.back();
-            runtg->waitingTasks.pop_back();
-            if (runtg->waitingTasks.size() == 0) {
-                // There's left to start running from this group, so remove
-                // it from the active task list.
-                activeTaskGroups.pop_back();
-                runtg->inActiveList = false;
+
+inline void
+TaskGroup::Launch(TaskInfo *ti) {
+    // All of the group's launches go to the pool of its first one.
+    if (pool == NULL)
+        pool = (lCurrentPool != NULL) ? lCurrentPool : defaultPool;
+
+    //
+    // Update the counts of the number of tasks left to run in this task
+    // group and in the pool before any of them can run.
+    //
+    int count = ti->taskCount();
+    lAtomicAdd(&numUnfinishedTasks, count);
+    lAtomicAdd(&pool->numUnfinishedTasks[lCurrentPriority], count);
+    ti->avgTaskTime = lCachedTaskTime(ti->func);
+
+    TaskRange range;
+    range.taskGroup = this;
+    range.taskInfo = ti;
+    range.pool = pool;
+    range.priority = lCurrentPriority;
+
+    if (lWorkerPool != pool && nNodes > 1) {
+        // Give each NUMA node a contiguous chunk of the tasks, in
+        // proportion to its number of cores, so that tasks with nearby
+        // indices (which usually access nearby data) stay on one node.
+        int begin = 0, coresSoFar = 0, totalCores = 0;
+        for (int node = 0; node < nNodes; ++node)
+            totalCores += nodeCores[node];
+        for (int node = 0; node < nNodes; ++node) {
+            coresSoFar += nodeCores[node];
+            int end = (int)(((int64_t)count * coresSoFar) / totalCores);
+            if (end > begin) {
+                range.begin = begin;
+                range.end = end;
+                range.node = node;
+                lQueueRange(range);
             }
-            myTask = runtg->GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from other group %p in sync\n", 
-                        taskNumber, runtg));
+            begin = end;
         }
+        return;
+    }
 
-        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-            exit(1);
+    // Otherwise the whole launch is queued as a single range; it's split
+    // up as it's run.  If it can't be queued, we run it ourselves.
+    range.begin = 0;
+    range.end = count;
+    range.node = (lWorkerPool == pool) ? pool->workerNode[lWorkerIndex] : 0;
+    if (!lQueueRange(range))
+        RunRange(range);
+}
+
+
+/* Tasks may launch and sync tasks of their own.  A thread waiting in
+   Sync() only goes to sleep once there's nothing left for it to run, and
+   the tasks it's waiting for are then all running on other threads, so
+   waiting for a child group can't deadlock.  No threads besides the
+   workers are ever created, so nested launches don't oversubscribe the
+   machine either. */
+inline void
+TaskGroup::Sync() {
+    DBG(fprintf(stderr, "syncing %p - %d unfinished\n", this, numUnfinishedTasks));
+
+    while (numUnfinishedTasks > 0) {
+        // All of the tasks in this group aren't finished yet.  We'll try
+        // to help out here since we don't have anything else to do: our
+        // own deque holds this group's most recently launched tasks, and
+        // otherwise we run (or steal) whatever else is available in the
+        // group's pool.
+        TaskRange range;
+        if (lFindRange(pool, &range)) {
+            range.taskGroup->RunRange(range);
+            continue;
         }
-    
-        //
-        // Do work for _myTask_
-        //
-        // FIXME: bogus values for thread index/thread count here as well..
-        myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
 
-        //
-        // Decrement the number of unfinished tasks counter
-        //
-        lMemFence();
-        lAtomicAdd(&runtg->numUnfinishedTasks, -1);
+        // The remaining tasks are all running on other threads (or
+        // about to be); spin for a while, since they may finish soon or
+        // more work may show up.
+        bool found = false;
+        for (int i = 0; i < lSpinCount && numUnfinishedTasks > 0; ++i) {
+            lPause();
+            if ((found = lFindRange(pool, &range)) == true)
+                break;
+        }
+        lUpdateSpinCount(found || numUnfinishedTasks == 0);
+        if (found) {
+            range.taskGroup->RunRange(range);
+            continue;
+        }
+
+        // Otherwise go to sleep until the last task in this group
+        // finishes.  Any work that's queued meanwhile is picked up by
+        // the worker threads.
+        pthread_mutex_lock(&syncMutex);
+        syncWaiting = 1;
+        __sync_synchronize();
+        while (numUnfinishedTasks > 0)
+            pthread_cond_wait(&syncCond, &syncMutex);
+        syncWaiting = 0;
+        pthread_mutex_unlock(&syncMutex);
     }
-    DBG(fprintf(stderr, "sync for %p done!n", tg));
+    lMemFence();
+    DBG(fprintf(stderr, "sync for %p done!n", this));
+}
+
+
+void *
+ISPCCreateTaskPool(int numThreads) {
+    InitTaskSystem();
+
+    TaskPool *pool;
+    while (lAtomicCompareAndSwap32(&lock, 1, 0) != 0)
+        ;
+    pool = lCreateTaskPool(std::max(numThreads, 0));
+    lMemFence();
+    lock = 0;
+    return pool;
+}
+
+
+void
+ISPCSetTaskPool(void *pool) {
+    lCurrentPool = (TaskPool *)pool;
+}
+
+
+void
+ISPCSetTaskPriority(int priority) {
+    lCurrentPriority = std::max(0, std::min(priority, ISPC_NUM_TASK_PRIORITIES - 1));
 }
 
 #endif // ISPC_USE_PTHREADS
@@ -956,15 +2219,12 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
+TaskGroup::Launch(TaskInfo *ti) {
+    int count = ti->taskCount();
     cilk_for(int i = 0; i < count; i++) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
         // Actually run the task. 
         // Cilk does not expose the task -> thread mapping so we pretend it's 1:1
-        ti->func(ti->data, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        ti->Run(i, i, count);
     }
 }
 
@@ -985,21 +2245,19 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
+TaskGroup::Launch(TaskInfo *ti) {
+    const int count = ti->taskCount();
 #pragma omp parallel
   {
-    const int threadIndex = omp_get_thread_num();
-    const int threadCount = omp_get_num_threads();
+    // omp_get_thread_num() is only unique within a team, which isn't
+    // enough when tasks launch tasks (and so run nested teams).
+    const int threadIndex = lGetThreadIndex();
 
 #pragma omp for schedule(runtime)
     for(int i = 0; i < count; i++) 
     {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
         // Actually run the task. 
-        ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        ti->Run(i, threadIndex, lGetThreadCount());
     }
   }
 }
@@ -1022,18 +2280,12 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
+TaskGroup::Launch(TaskInfo *ti) {
+    int count = ti->taskCount();
     tbb::parallel_for(0, count, [=](int i) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
         // Actually run the task. 
-        // TBB does not expose the task -> thread mapping so we pretend it's 1:1
-        int threadIndex = ti->taskIndex;
-        int threadCount = ti->taskCount();
-
-        ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        int threadIndex = lGetThreadIndex();
+        ti->Run(i, threadIndex, lGetThreadCount());
     });
 }
 
@@ -1052,19 +2304,16 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    for (int i = 0; i < count; i++) {
-        tbbTaskGroup.run([=]() {
-            TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
-            // TBB does not expose the task -> thread mapping so we pretend it's 1:1
-            int threadIndex = ti->taskIndex;
-            int threadCount = ti->taskCount();
-            ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+TaskGroup::Launch(TaskInfo *ti) {
+    // A single TBB task runs the whole launch with a parallel_for, which
+    // splits it up as needed.
+    tbbTaskGroup.run([=]() {
+        int count = ti->taskCount();
+        tbb::parallel_for(0, count, [=](int i) {
+            int threadIndex = lGetThreadIndex();
+            ti->Run(i, threadIndex, lGetThreadCount());
         });
-    }
+    });
 }
 
 inline void
@@ -1084,13 +2333,13 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
+TaskGroup::Launch(TaskInfo *ti) {
+    int count = ti->taskCount();
     for (int i = 0; i < count; ++i) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
         int threadIndex = i;
         int threadCount = count;
-        futures.push_back(hpx::async(ti->func, ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
+        futures.push_back(hpx::async(ti->func, ti->data, threadIndex, threadCount, i, count,
+            ti->taskIndex0(i), ti->taskIndex1(i), ti->taskIndex2(i),
             ti->taskCount0(), ti->taskCount1(), ti->taskCount2()));
     }
 }
@@ -1105,22 +2354,113 @@ TaskGroup::Sync() {
 
 #ifndef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 
-#define MAX_FREE_TASK_GROUPS 64
-static TaskGroup *freeTaskGroups[MAX_FREE_TASK_GROUPS];
+/* Task groups are never deleted; free ones are kept in a small cache per
+   thread, and beyond that on a global lock-free stack, so that any
+   number of threads can launch tasks concurrently without contending for
+   anything but the stack's head (and that only when their caches
+   overflow or run dry).
+
+   To avoid the ABA problem, the head of the stack holds a 32-bit count of
+   the operations on it along with the index of the top group in the
+   table of all groups (groupTable), rather than a pointer to it. */
+#define TASK_GROUP_CACHE_SIZE 8
+#define LOG_GROUP_TABLE_CHUNK_SIZE 10
+#define GROUP_TABLE_CHUNK_SIZE (1<<LOG_GROUP_TABLE_CHUNK_SIZE)
+#define MAX_GROUP_TABLE_CHUNKS 4096
+
+static TaskGroup **volatile groupTable[MAX_GROUP_TABLE_CHUNKS];
+static volatile int32_t numTaskGroups = 0;
+static volatile int64_t freeGroupsHead = 0;
+
+static ISPC_THREAD_LOCAL TaskGroup *lGroupCache[TASK_GROUP_CACHE_SIZE];
+static ISPC_THREAD_LOCAL int lNumCachedGroups = 0;
+
 
 static inline TaskGroup *
-AllocTaskGroup() {
-    for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
-        TaskGroup *tg = freeTaskGroups[i];
-        if (tg != NULL) {
-            void *ptr = lAtomicCompareAndSwapPointer((void **)(&freeTaskGroups[i]), NULL, tg);
-            if (ptr != NULL) {
-                return (TaskGroup *)ptr;
-            }
-        }
+lLookupTaskGroup(int32_t index) {
+    return groupTable[index >> LOG_GROUP_TABLE_CHUNK_SIZE]
+                     [index & (GROUP_TABLE_CHUNK_SIZE-1)];
+}
+
+
+static TaskGroup *
+lNewTaskGroup() {
+    int32_t index = lAtomicAdd(&numTaskGroups, 1);
+    int chunk = index >> LOG_GROUP_TABLE_CHUNK_SIZE;
+    if (chunk >= MAX_GROUP_TABLE_CHUNKS) {
+        fprintf(stderr, "Too many task groups in use at once\n");
+        exit(1);
+    }
+    if (groupTable[chunk] == NULL) {
+        TaskGroup **newChunk = new TaskGroup *[GROUP_TABLE_CHUNK_SIZE];
+        if (lAtomicCompareAndSwapPointer((void **)&groupTable[chunk], newChunk,
+                                         NULL) != NULL)
+            delete[] newChunk;
     }
 
-    return new TaskGroup;
+    TaskGroup *tg = new TaskGroup;
+    tg->groupIndex = index;
+    groupTable[chunk][index & (GROUP_TABLE_CHUNK_SIZE-1)] = tg;
+    lMemFence();
+    return tg;
+}
+
+
+static TaskGroup *
+lPopFreeTaskGroup() {
+    while (1) {
+        int64_t head = freeGroupsHead;
+        int32_t top = (int32_t)(head & 0xffffffff);
+        if (top == 0)
+            return NULL;
+        TaskGroup *tg = lLookupTaskGroup(top - 1);
+        // If tg is popped by another thread meanwhile, nextFreeGroup may
+        // be stale, but then the count in the head has changed as well and
+        // the compare-and-swap fails.
+        int64_t newHead = (((head >> 32) + 1) << 32) | (uint32_t)tg->nextFreeGroup;
+        if (lAtomicCompareAndSwap64(&freeGroupsHead, newHead, head) == head)
+            return tg;
+    }
+}
+
+
+static void
+lPushFreeTaskGroup(TaskGroup *tg) {
+    while (1) {
+        int64_t head = freeGroupsHead;
+        tg->nextFreeGroup = (int32_t)(head & 0xffffffff);
+        int64_t newHead = (((head >> 32) + 1) << 32) | (uint32_t)(tg->groupIndex + 1);
+        if (lAtomicCompareAndSwap64(&freeGroupsHead, newHead, head) == head)
+            return;
+    }
+}
+
+
+#ifndef ISPC_IS_WINDOWS
+static pthread_key_t groupCacheKey;
+static pthread_once_t groupCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static void
+lFlushGroupCache(void *) {
+    // Called as the thread exits; hand its cached groups to the others.
+    while (lNumCachedGroups > 0)
+        lPushFreeTaskGroup(lGroupCache[--lNumCachedGroups]);
+}
+
+static void
+lCreateGroupCacheKey() {
+    pthread_key_create(&groupCacheKey, lFlushGroupCache);
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+static inline TaskGroup *
+AllocTaskGroup() {
+    if (lNumCachedGroups > 0)
+        return lGroupCache[--lNumCachedGroups];
+
+    TaskGroup *tg = lPopFreeTaskGroup();
+    return (tg != NULL) ? tg : lNewTaskGroup();
 }
 
 
@@ -1128,24 +2468,30 @@ static inline void
 FreeTaskGroup(TaskGroup *tg) {
     tg->Reset();
 
-    for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
-        if (freeTaskGroups[i] == NULL) {
-            void *ptr = lAtomicCompareAndSwapPointer((void **)&freeTaskGroups[i], tg, NULL);
-            if (ptr == NULL)
-                return;
+    if (lNumCachedGroups < TASK_GROUP_CACHE_SIZE) {
+#ifndef ISPC_IS_WINDOWS
+        if (lNumCachedGroups == 0) {
+            // Make sure that the cache is flushed when the thread exits.
+            pthread_once(&groupCacheKeyOnce, lCreateGroupCacheKey);
+            if (pthread_getspecific(groupCacheKey) == NULL)
+                pthread_setspecific(groupCacheKey, (void *)1);
         }
+#endif // !ISPC_IS_WINDOWS
+        lGroupCache[lNumCachedGroups++] = tg;
+        return;
     }
 
-    delete tg;
+    lPushFreeTaskGroup(tg);
 }
 
 ///////////////////////////////////////////////////////////////////////////
 
 void
 ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2) {
-    const int count = count0*count1*count2;
+    const int count = lLaunchTaskCount(count0, count1, count2);
     TaskGroup *taskGroup;
     if (*taskGroupPtr == NULL) {
+        lInitTrace();
         InitTaskSystem();
         taskGroup = AllocTaskGroup();
         *taskGroupPtr = taskGroup;
@@ -1153,17 +2499,24 @@ ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1,
     else
         taskGroup = (TaskGroup *)(*taskGroupPtr);
 
-    int baseIndex = taskGroup->AllocTaskInfo(count);
-    for (int i = 0; i < count; ++i) {
-        TaskInfo *ti = taskGroup->GetTaskInfo(baseIndex+i);
-        ti->func = (TaskFuncType)func;
-        ti->data = data;
-        ti->taskIndex = i;
-        ti->taskCount3d[0] = count0;
-        ti->taskCount3d[1] = count1;
-        ti->taskCount3d[2] = count2;
+    if (count == 0)
+        return;
+
+    // The whole launch is described by a single TaskInfo, so launching
+    // takes constant time and memory regardless of the number of tasks.
+    TaskInfo *ti = taskGroup->AllocTaskInfo();
+    ti->func = (TaskFuncType)func;
+    ti->data = data;
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
+    if (traceEnabled) {
+        ti->launchId = lAtomicAdd(&nextLaunchId, 1);
+        ti->launchTime = lTimestamp();
+        lTraceEvent(TRACE_LAUNCH, ti->launchTime, ti->launchTime,
+                    ti->launchId, count);
     }
-    taskGroup->Launch(baseIndex, count);
+    taskGroup->Launch(ti);
 }
 
 
@@ -1171,7 +2524,10 @@ void
 ISPCSync(void *h) {
     TaskGroup *taskGroup = (TaskGroup *)h;
     if (taskGroup != NULL) {
+        int64_t start = traceEnabled ? lTimestamp() : 0;
         taskGroup->Sync();
+        if (traceEnabled)
+            lTraceEvent(TRACE_SYNC, start, lTimestamp());
         FreeTaskGroup(taskGroup);
     }
 }
@@ -1191,6 +2547,38 @@ ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) {
     return taskGroup->AllocMemory(size, alignment);
 }
 
+
+void
+ISPCGetAllocStats(int64_t *bytesServed, int64_t *peakBytesInUse,
+                  int64_t *bytesReserved) {
+    // The statistics of arenas that are in use may be slightly out of
+    // date; the peak is the sum of each arena's peak.
+    *bytesServed = *peakBytesInUse = *bytesReserved = 0;
+    for (MemoryArena *arena = allArenas; arena != NULL; arena = arena->next) {
+        *bytesServed += arena->bytesServed;
+        *peakBytesInUse += arena->peakBytesInUse;
+        *bytesReserved += arena->bytesReserved;
+    }
+}
+
+#ifndef ISPC_USE_PTHREADS
+void *
+ISPCCreateTaskPool(int) {
+    // Not supported; launches always go to the task system's own pool.
+    return NULL;
+}
+
+
+void
+ISPCSetTaskPool(void *) {
+}
+
+
+void
+ISPCSetTaskPriority(int) {
+}
+#endif // !ISPC_USE_PTHREADS
+
 #else  // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 
 #define MAX_LIVE_TASKS 1024
@@ -1200,13 +2588,29 @@ pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 // Small structure used to hold the data for each task
 struct Task {
 public:
+    Task() : waiting(0) {
+        pthread_mutex_init(&waitMutex, NULL);
+        pthread_cond_init(&waitCond, NULL);
+    }
+
     TaskFuncType func;
     void *data;
     volatile int32_t taskIndex;
     int taskCount;
+    int taskCount3d[3];
+    // Only set if tracing is enabled.
+    int32_t launchId;
+    int64_t launchTime;
 
     volatile int numDone;
-    int liveIndex; // index in live task queue
+    int liveIndex; // index in live task queue, or -1 if it isn't queued
+
+    // A thread that's done spinning in wait() or TaskSys::sync() sleeps
+    // on waitCond, having set waiting first; the thread that makes the
+    // condition it's waiting for true then signals it.
+    pthread_mutex_t waitMutex;
+    pthread_cond_t waitCond;
+    volatile int waiting;
 
     inline int  noMoreWork() { return taskIndex >= taskCount; }
     /*! given thread is done working on this task --> decrease num locks */
@@ -1216,19 +2620,42 @@ public:
     inline int  numJobs() { return taskCount; }
     inline void schedule(int idx) { taskIndex = 0; numDone = 0; liveIndex = idx; }
     inline void run(int idx, int threadIdx);
-    inline void markOneDone() { lAtomicAdd(&numDone,1); }
+    inline void markOneDone() {
+        if (lAtomicAdd(&numDone,1) == taskCount - 1)
+            wake();
+    }
+    inline bool allDone() { return numDone == taskCount; }
     inline void wait()
     {
         while (!noMoreWork()) {
             int next = nextJob();
-            if (next < numJobs()) run(next, 0);
+            if (next < numJobs()) run(next, lGetThreadIndex());
         }
-        while (numDone != taskCount) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+        // The remaining jobs are running on the worker threads.
+        for (int i = 0; i < lSpinCount && !allDone(); ++i)
+            lPause();
+        lUpdateSpinCount(allDone());
+        if (allDone())
+            return;
+
+        pthread_mutex_lock(&waitMutex);
+        waiting = 1;
+        __sync_synchronize();
+        while (!allDone())
+            pthread_cond_wait(&waitCond, &waitMutex);
+        waiting = 0;
+        pthread_mutex_unlock(&waitMutex);
+    }
+
+    /*! wakes up the thread sleeping in wait() or TaskSys::sync(), if any;
+        must be called after the condition that it's waiting for has been
+        made true with an atomic operation */
+    inline void wake()
+    {
+        if (waiting) {
+            pthread_mutex_lock(&waitMutex);
+            pthread_cond_broadcast(&waitCond);
+            pthread_mutex_unlock(&waitMutex);
         }
     }
 };
@@ -1247,7 +2674,12 @@ class TaskSys {
                                  becomes active */
         Task *task;
 
-        inline void doneWithThis() { lAtomicAdd(&locks,-1); }
+        inline void doneWithThis() {
+            Task *t = task;
+            if (lAtomicAdd(&locks,-1) == 2)
+                // Only the creator's lock is left; see TaskSys::sync().
+                t->wake();
+        }
         LiveTask() : active(0), locks(-1) {}
     };
 
@@ -1261,11 +2693,19 @@ public:
     LiveTask taskQueue[MAX_LIVE_TASKS];
     std::stack<Task *> taskMem;
 
+    // Workers that find no active task in their next slot after spinning
+    // for a while sleep on workCond; schedule() wakes them up.
+    pthread_mutex_t workMutex;
+    pthread_cond_t workCond;
+    volatile int32_t numSleepingWorkers;
+
     static TaskSys *global;
 
-    TaskSys() : nextScheduleIndex(0)
+    TaskSys() : nextScheduleIndex(0), numSleepingWorkers(0)
     {
         TaskSys::global = this;
+        pthread_mutex_init(&workMutex, NULL);
+        pthread_cond_init(&workCond, NULL);
         Task *mem = new Task[MAX_LIVE_TASKS]; //< could actually be more than _live_ tasks
         for (int i=0;i<MAX_LIVE_TASKS;i++) {
             taskMem.push(mem+i);
@@ -1276,13 +2716,15 @@ public:
     inline Task *allocOne()
     {
         pthread_mutex_lock(&mutex);
-        if (taskMem.empty()) {
-            fprintf(stderr, "Too many live tasks.  "
-                    "Change the value of MAX_LIVE_TASKS and recompile.\n");
-            exit(1);
+        Task *task;
+        if (taskMem.empty())
+            // More tasks are live than we preallocated; they're recycled
+            // through taskMem once they're synced like the others.
+            task = new Task;
+        else {
+            task = taskMem.top();
+            taskMem.pop();
         }
-        Task *task = taskMem.top();
-        taskMem.pop();
         pthread_mutex_unlock(&mutex);
         return task;
     }
@@ -1305,29 +2747,59 @@ public:
     {
         pthread_mutex_lock(&mutex);
         int liveIndex = nextScheduleIndex;
-        nextScheduleIndex = (nextScheduleIndex+1)%MAX_LIVE_TASKS;
         if (taskQueue[liveIndex].active) {
-            fprintf(stderr, "Out of task queue resources.  "
-                    "Change the value of MAX_LIVE_TASKS and recompile.\n");
-            exit(1);
+            // All MAX_LIVE_TASKS slots of the queue are in use (the
+            // workers go through them in order, so the queue can't simply
+            // be grown).  The task isn't queued then; its jobs are all run
+            // by the thread that syncs it, in wait().
+            pthread_mutex_unlock(&mutex);
+            t->schedule(-1);
+            return;
         }
+        nextScheduleIndex = (nextScheduleIndex+1)%MAX_LIVE_TASKS;
         taskQueue[liveIndex].task = t;
         t->schedule(liveIndex);
         taskQueue[liveIndex].locks = numThreadsRunning+1; // num _worker_ threads plus creator
         taskQueue[liveIndex].active = true;
         pthread_mutex_unlock(&mutex);
+
+        // Pairs with the atomic increment of numSleepingWorkers in
+        // threadFct(): either the worker sees the task, or we see it.
+        __sync_synchronize();
+        if (numSleepingWorkers > 0) {
+            pthread_mutex_lock(&workMutex);
+            pthread_cond_broadcast(&workCond);
+            pthread_mutex_unlock(&workMutex);
+        }
     }
 
     void sync(Task *task)
     {
         task->wait();
         int liveIndex = task->liveIndex;
-        while (taskQueue[liveIndex].locks > 1) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+        if (liveIndex < 0) {
+            // It wasn't queued; see schedule().
+            _mm_free(task->data);
+            pthread_mutex_lock(&mutex);
+            taskMem.push(task);
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+
+        // Wait for all of the workers to have seen the task before it's
+        // recycled; one that's still running jobs of earlier tasks may
+        // take a while to get to it.
+        for (int i = 0; i < lSpinCount && taskQueue[liveIndex].locks > 1; ++i)
+            lPause();
+        lUpdateSpinCount(taskQueue[liveIndex].locks <= 1);
+        if (taskQueue[liveIndex].locks > 1) {
+            pthread_mutex_lock(&task->waitMutex);
+            task->waiting = 1;
+            __sync_synchronize();
+            while (taskQueue[liveIndex].locks > 1)
+                pthread_cond_wait(&task->waitCond, &task->waitMutex);
+            task->waiting = 0;
+            pthread_mutex_unlock(&task->waitMutex);
         }
         _mm_free(task->data);
         pthread_mutex_lock(&mutex);
@@ -1342,20 +2814,27 @@ void TaskSys::threadFct()
 {
     int myIndex = 0; //lAtomicAdd(&threadIdx,1);
     while (1) {
-        while (!taskQueue[myIndex].active) {
-#ifndef ISPC_IS_KNC
-            usleep(4);
-#else
-            _mm_delay_32(32);
-#endif
-            continue;
+        if (!taskQueue[myIndex].active) {
+            // Spin for a while in case a task shows up soon, then sleep
+            // until one is scheduled.
+            for (int i = 0; i < lSpinCount && !taskQueue[myIndex].active; ++i)
+                lPause();
+            lUpdateSpinCount(taskQueue[myIndex].active);
+            if (!taskQueue[myIndex].active) {
+                pthread_mutex_lock(&workMutex);
+                lAtomicAdd(&numSleepingWorkers, 1);
+                while (!taskQueue[myIndex].active)
+                    pthread_cond_wait(&workCond, &workMutex);
+                lAtomicAdd(&numSleepingWorkers, -1);
+                pthread_mutex_unlock(&workMutex);
+            }
         }
 
         Task *mine = taskQueue[myIndex].task;
         while (!mine->noMoreWork()) {
             int job = mine->nextJob();
             if (job >= mine->numJobs()) break;
-            mine->run(job,myIndex);
+            mine->run(job,lGetThreadIndex());
         }
         taskQueue[myIndex].doneWithThis();
         myIndex = (myIndex+1)%MAX_LIVE_TASKS;
@@ -1364,7 +2843,14 @@ void TaskSys::threadFct()
 
 
 inline void Task::run(int idx, int threadIdx) {
-    (*this->func)(data,threadIdx,TaskSys::global->nThreads,idx,taskCount);
+    int64_t start = traceEnabled ? lTimestamp() : 0;
+    int count0 = taskCount3d[0], count1 = taskCount3d[1];
+    (*this->func)(data, threadIdx, lGetThreadCount(), idx, taskCount,
+                  idx % count0, (idx / count0) % count1, idx / (count0 * count1),
+                  taskCount3d[0], taskCount3d[1], taskCount3d[2]);
+    if (traceEnabled)
+        lTraceEvent(TRACE_TASK, start, lTimestamp(), launchId, idx, threadIdx,
+                    launchTime);
     markOneDone();
 }
 
@@ -1410,13 +2896,22 @@ int TaskSys::numThreadsRunning = 0;
 
 ///////////////////////////////////////////////////////////////////////////
 
-void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count) 
+void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2) 
 {
     Task *ti = *(Task**)taskGroupPtr;
     ti->func = (TaskFuncType)func;
     ti->data = data;
     ti->taskIndex = 0;
-    ti->taskCount = count;
+    ti->taskCount = lLaunchTaskCount(count0, count1, count2);
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
+    if (traceEnabled) {
+        ti->launchId = lAtomicAdd(&nextLaunchId, 1);
+        ti->launchTime = lTimestamp();
+        lTraceEvent(TRACE_LAUNCH, ti->launchTime, ti->launchTime,
+                    ti->launchId, ti->taskCount);
+    }
     TaskSys::global->schedule(ti);
 }
 
@@ -1424,11 +2919,15 @@ void ISPCSync(void *h)
 {
     Task *task = (Task *)h; 
     assert(task);
+    int64_t start = traceEnabled ? lTimestamp() : 0;
     TaskSys::global->sync(task);
+    if (traceEnabled)
+        lTraceEvent(TRACE_SYNC, start, lTimestamp());
 }
 
 void *ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) 
 {
+    lInitTrace();
     TaskSys::init();
     Task *task = TaskSys::global->allocOne();
     *taskGroupPtr = task;
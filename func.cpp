@@ -45,6 +45,7 @@
 #include "sym.h"
 #include "util.h"
 #include <stdio.h>
+#include <string.h>
 
 #if ISPC_LLVM_VERSION == ISPC_LLVM_3_2 // 3.2
 #ifdef ISPC_NVPTX_ENABLED
@@ -92,36 +93,17 @@
 Function::Function(Symbol *s, Stmt *c) {
     sym = s;
     code = c;
+    codeChecked = false;
 
     maskSymbol = m->symbolTable->LookupVariable("__mask");
     Assert(maskSymbol != NULL);
 
-    if (code != NULL) {
-        code = TypeCheck(code);
-
-        if (code != NULL && g->debugPrint) {
-            printf("After typechecking function \"%s\":\n",
-                    sym->name.c_str());
-            code->Print(0);
-            printf("---------------------\n");
-        }
-
-        if (code != NULL) {
-            code = Optimize(code);
-            if (g->debugPrint) {
-                printf("After optimizing function \"%s\":\n",
-                        sym->name.c_str());
-                code->Print(0);
-                printf("---------------------\n");
-            }
-        }
-    }
-
-    if (g->debugPrint) {
-        printf("Add Function %s\n", sym->name.c_str());
-        code->Print(0);
-        printf("\n\n\n");
-    }
+    // Most programs only call a handful of the functions in the standard
+    // library, so type checking and optimizing the ASTs of stdlib
+    // functions is put off until AST::GenerateIR() finds that they're
+    // needed.
+    if (!IsStdlibFunction())
+        typeCheckAndOptimize();
 
     const FunctionType *type = CastType<FunctionType>(sym->type);
     Assert(type != NULL);
@@ -176,6 +158,78 @@ Function::Function(Symbol *s, Stmt *c) {
 }
 
 
+void
+Function::typeCheckAndOptimize() {
+    if (codeChecked)
+        return;
+    codeChecked = true;
+
+    if (code != NULL) {
+        {
+            TimeTraceScope traceTypeCheck("TypeCheck", sym->name.c_str());
+            code = TypeCheck(code);
+        }
+
+        if (code != NULL && g->debugPrint) {
+            printf("After typechecking function \"%s\":\n",
+                    sym->name.c_str());
+            code->Print(0);
+            printf("---------------------\n");
+        }
+
+        if (code != NULL) {
+            {
+                TimeTraceScope traceOptimize("Optimize AST", sym->name.c_str());
+                code = Optimize(code);
+            }
+            if (g->debugPrint) {
+                printf("After optimizing function \"%s\":\n",
+                        sym->name.c_str());
+                code->Print(0);
+                printf("---------------------\n");
+            }
+        }
+    }
+
+    if (g->debugPrint) {
+        printf("Add Function %s\n", sym->name.c_str());
+        code->Print(0);
+        printf("\n\n\n");
+    }
+}
+
+
+bool
+Function::IsStdlibFunction() const {
+    if (sym == NULL || sym->function == NULL || !sym->isStdlib)
+        return false;
+
+    // Only internal functions can be skipped safely; anything else may be
+    // called from outside of the module.
+    const FunctionType *type = CastType<FunctionType>(sym->type);
+    return (type != NULL && !type->isExported && !type->isTask &&
+            sym->function->hasLocalLinkage());
+}
+
+
+bool
+Function::IsReferenced() const {
+    return (sym != NULL && sym->function != NULL &&
+            sym->function->use_empty() == false);
+}
+
+
+void
+Function::DiscardDeclaration() {
+    Assert(IsStdlibFunction() && !IsReferenced());
+    // An internal function must have a definition, so the leftover
+    // declaration has to go; GlobalDCE would otherwise remove it later.
+    if (sym->function->empty())
+        sym->function->eraseFromParent();
+    sym->function = NULL;
+}
+
+
 const Type *
 Function::GetReturnType() const {
     const FunctionType *type = CastType<FunctionType>(sym->type);
@@ -512,6 +566,15 @@ Function::GenerateIR() {
         // May be NULL due to error earlier in compilation
         return;
 
+    TimeTraceScope traceFunction("GenerateIR Function", sym->name.c_str());
+
+    // This is a no-op unless this is a standard library function whose
+    // checking was deferred.
+    int errorCount = m->errorCount;
+    typeCheckAndOptimize();
+    if (m->errorCount > errorCount)
+        return;
+
     llvm::Function *function = sym->function;
     Assert(function != NULL);
 
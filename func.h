@@ -51,13 +51,28 @@ public:
     /** Generate LLVM IR for the function into the current module. */
     void GenerateIR();
 
+    /** Returns true if this is an internal function from the standard
+        library; code for these is only generated if something in the
+        program actually refers to them. */
+    bool IsStdlibFunction() const;
+
+    /** Returns true if there are references to the function's
+        llvm::Function in the module. */
+    bool IsReferenced() const;
+
+    /** Removes the declaration of an unreferenced standard library
+        function from the module, rather than generating code for it. */
+    void DiscardDeclaration();
+
 private:
+    void typeCheckAndOptimize();
     void emitCode(FunctionEmitContext *ctx, llvm::Function *function,
                   SourcePos firstStmtPos);
 
     Symbol *sym;
     std::vector<Symbol *> args;
     Stmt *code;
+    bool codeChecked;
     Symbol *maskSymbol;
     Symbol *threadIndexSym, *threadCountSym;
     Symbol *taskIndexSym,   *taskCountSym;
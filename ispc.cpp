@@ -1532,6 +1532,7 @@ Opt::Opt() {
     disableGatherScatterFlattening = false;
     disableUniformMemoryOptimizations = false;
     disableCoalescing = false;
+    disableUniformScalarization = false;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1571,6 +1572,9 @@ Globals::Globals() {
 #endif
     forceAlignment = -1;
     dllExport = false;
+    numJobs = 1;
+    numFunctionPartitions = 1;
+    numCodegenPartitions = 1;
 }
 
 ///////////////////////////////////////////////////////////////////////////
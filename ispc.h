@@ -530,6 +530,12 @@ struct Opt {
     /** Disables optimizations that coalesce incoherent scalar memory
         access from gathers into wider vector operations, when possible. */
     bool disableCoalescing;
+
+    /** Disables the optimization that computes varying values that are
+        provably the same across all of the program instances as scalars
+        and broadcasts them.  This is likely only useful for measuring the
+        impact of this optimization. */
+    bool disableUniformScalarization;
 };
 
 /** @brief This structure collects together a number of global variables.
@@ -655,6 +661,36 @@ struct Globals {
 
     /** When true, flag non-static functions with dllexport attribute on Windows. */
     bool dllExport;
+
+    /** Maximum number of targets whose code generation may run
+        concurrently when compiling for multiple targets.  Values less
+        than or equal to one mean that targets are compiled serially. */
+    int numJobs;
+
+    /** Number of partitions that the functions in the module are split
+        into when generating an object file; each partition is optimized
+        and compiled in parallel in a separate process.  Values less than
+        or equal to one disable partitioning. */
+    int numFunctionPartitions;
+
+    /** Number of partitions that the optimized module is split into when
+        generating an object file, so that the back-end can compile them
+        in parallel in separate processes.  Values less than or equal to
+        one disable partitioning. */
+    int numCodegenPartitions;
+
+    /** If non-empty, the directory holding the persistent compilation
+        cache, in which outputs are stored keyed by a hash of the
+        preprocessed source and all of the settings that affect code
+        generation. */
+    std::string cacheDir;
+
+    /** Specializations of exported functions requested with --specialize=,
+        each of the form "<function>:<param>=<value>[,<param>=<value>...]".
+        For each one, a copy of the function is compiled with the given
+        uniform parameters replaced with constants, and the exported
+        function calls it when it's called with those values. */
+    std::vector<std::string> specializations;
 };
 
 enum {
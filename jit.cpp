@@ -0,0 +1,343 @@
+/*
+  Copyright (c) 2010-2018, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file jit.cpp
+    @brief Implementation of the JIT class, which compiles ispc programs into
+           the running process.
+*/
+
+#include "jit.h"
+#include "builtins.h"
+#include "module.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_7 // LLVM 3.7+
+  #include <llvm/ExecutionEngine/MCJIT.h>
+  #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+  #include <llvm/Support/MD5.h>
+  #include <llvm/Support/TargetSelect.h>
+  #include <llvm/Target/TargetMachine.h>
+#endif
+
+
+JIT::JIT(const std::string &key, const Globals &globals)
+    : optionsKey(key), settings(globals) {
+}
+
+
+JIT::~JIT() {
+    ClearCache();
+    if (g->target == settings.target)
+        g->target = NULL;
+    delete settings.target;
+}
+
+
+void
+JIT::ClearCache() {
+    // Each engine owns the llvm::Module it was created for.
+    std::map<std::string, llvm::ExecutionEngine *>::iterator iter;
+    for (iter = programs.begin(); iter != programs.end(); ++iter)
+        delete iter->second;
+    programs.clear();
+}
+
+
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_7 // LLVM 3.7+
+
+/** The settings that g had when the first JIT was created, which the
+    options of every JIT are applied to. */
+static Globals *lDefaultSettings = NULL;
+
+
+/** Adds the paths in the given -I argument to the include path; as on the
+    command line, several can be given, separated by ':' (';' on
+    Windows). */
+static void
+lAddIncludePaths(const char *paths, Globals *settings) {
+#ifdef ISPC_IS_WINDOWS
+    char delim = ';';
+#else
+    char delim = ':';
+#endif
+    std::string str(paths);
+    size_t pos = 0, end;
+    do {
+        end = str.find(delim, pos);
+        settings->includePath.push_back(str.substr(pos, end == std::string::npos ?
+                                                   std::string::npos : end - pos));
+        pos = end + 1;
+    } while (end != std::string::npos);
+}
+
+
+JIT *
+JIT::Create(int argc, const char *argv[]) {
+    static bool initialized = false;
+    if (!initialized) {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+        LLVMLinkInMCJIT();
+        initialized = true;
+    }
+
+    if (g == NULL)
+        g = new Globals;
+    if (lDefaultSettings == NULL)
+        lDefaultSettings = new Globals(*g);
+
+    // Start from the default settings, so that none of the options given
+    // to the JITs created before carry over to this one.
+    Globals settings(*lDefaultSettings);
+    settings.target = NULL;
+
+    const char *arch = NULL, *cpu = NULL, *target = NULL;
+    std::string key;
+    for (int i = 0; i < argc; ++i) {
+        const char *arg = argv[i];
+        // Keep the NUL terminators so that consecutive options can't run
+        // together in the key.
+        key.append(arg, strlen(arg) + 1);
+
+        if (!strcmp(arg, "-O0"))
+            settings.opt.level = 0;
+        else if (!strcmp(arg, "-O") || !strcmp(arg, "-O1") ||
+                 !strcmp(arg, "-O2") || !strcmp(arg, "-O3"))
+            settings.opt.level = 1;
+        else if (!strncmp(arg, "--target=", 9))
+            target = arg + 9;
+        else if (!strncmp(arg, "--cpu=", 6))
+            cpu = arg + 6;
+        else if (!strncmp(arg, "--arch=", 7))
+            arch = arg + 7;
+        else if (!strncmp(arg, "--addressing=", 13)) {
+            if (atoi(arg + 13) == 64)
+                settings.opt.force32BitAddressing = false;
+            else if (atoi(arg + 13) == 32)
+                settings.opt.force32BitAddressing = true;
+            else {
+                fprintf(stderr, "Addressing width \"%s\" invalid--only 32 and "
+                        "64 are allowed.\n", arg + 13);
+                return NULL;
+            }
+        }
+        else if (!strncmp(arg, "--math-lib=", 11)) {
+            const char *lib = arg + 11;
+            if (!strcmp(lib, "default"))
+                settings.mathLib = Globals::Math_ISPC;
+            else if (!strcmp(lib, "fast"))
+                settings.mathLib = Globals::Math_ISPCFast;
+            else if (!strcmp(lib, "svml"))
+                settings.mathLib = Globals::Math_SVML;
+            else if (!strcmp(lib, "system"))
+                settings.mathLib = Globals::Math_System;
+            else {
+                fprintf(stderr, "Unknown --math-lib= option \"%s\".\n", lib);
+                return NULL;
+            }
+        }
+        else if (!strncmp(arg, "--opt=", 6)) {
+            const char *opt = arg + 6;
+            if (!strcmp(opt, "fast-math"))
+                settings.opt.fastMath = true;
+            else if (!strcmp(opt, "fast-masked-vload"))
+                settings.opt.fastMaskedVload = true;
+            else if (!strcmp(opt, "disable-assertions"))
+                settings.opt.disableAsserts = true;
+            else if (!strcmp(opt, "disable-loop-unroll"))
+                settings.opt.unrollLoops = false;
+            else if (!strcmp(opt, "disable-fma"))
+                settings.opt.disableFMA = true;
+            else if (!strcmp(opt, "force-aligned-memory"))
+                settings.opt.forceAlignedMemory = true;
+            else {
+                fprintf(stderr, "Unknown --opt= option \"%s\".\n", opt);
+                return NULL;
+            }
+        }
+        else if (!strncmp(arg, "-D", 2))
+            settings.cppArgs.push_back(arg);
+        else if (!strcmp(arg, "-I")) {
+            if (++i == argc) {
+                fprintf(stderr, "No path specified after -I option.\n");
+                return NULL;
+            }
+            key.append(argv[i], strlen(argv[i]) + 1);
+            lAddIncludePaths(argv[i], &settings);
+        }
+        else if (!strncmp(arg, "-I", 2))
+            lAddIncludePaths(arg + 2, &settings);
+        else if (!strcmp(arg, "--nostdlib"))
+            settings.includeStdlib = false;
+        else if (!strcmp(arg, "--nocpp"))
+            settings.runCPP = false;
+        else if (!strcmp(arg, "--werror"))
+            settings.warningsAsErrors = true;
+        else if (!strcmp(arg, "--woff")) {
+            settings.disableWarnings = true;
+            settings.emitPerfWarnings = false;
+        }
+        else if (!strcmp(arg, "--wno-perf"))
+            settings.emitPerfWarnings = false;
+        else {
+            fprintf(stderr, "Option \"%s\" isn't supported for JIT "
+                    "compilation.\n", arg);
+            return NULL;
+        }
+    }
+
+    // The code is loaded at arbitrary addresses in the process, so it's
+    // always compiled as position-independent code.  (Target's constructor
+    // looks at some of the other settings, so they're installed first.)
+    Target *previousTarget = g->target;
+    *g = settings;
+    g->target = new Target(arch, cpu, target, true, false);
+    if (!g->target->isValid()) {
+        delete g->target;
+        g->target = previousTarget;
+        return NULL;
+    }
+    settings.target = g->target;
+
+    return new JIT(key, settings);
+}
+
+
+llvm::ExecutionEngine *
+JIT::compile(const std::string &source) {
+    // g may have been set up for another JIT since this one was created.
+    *g = settings;
+    m = new Module("<jit>", source.c_str());
+    int errorCount = m->CompileFile();
+    // CompileFile() has linked in the builtins that the program needs.
+    DiscardLazyBuiltins(m->module);
+    if (errorCount > 0) {
+        delete m;
+        m = NULL;
+        return NULL;
+    }
+
+    // Generate code with the same CPU and features that ispc used when
+    // compiling the program.
+    std::vector<std::string> attrs;
+    std::string features =
+        g->target->GetTargetMachine()->getTargetFeatureString().str();
+    size_t pos = 0, end;
+    while (pos < features.size()) {
+        end = features.find(',', pos);
+        if (end == std::string::npos)
+            end = features.size();
+        if (end > pos)
+            attrs.push_back(features.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    std::string error;
+    llvm::EngineBuilder builder((std::unique_ptr<llvm::Module>(m->module)));
+    builder.setEngineKind(llvm::EngineKind::JIT)
+        .setErrorStr(&error)
+        .setOptLevel(g->opt.level > 0 ? llvm::CodeGenOpt::Aggressive :
+                     llvm::CodeGenOpt::None)
+        .setRelocationModel(llvm::Reloc::PIC_)
+        .setMCPU(g->target->getCPU())
+        .setMAttrs(attrs)
+        .setMCJITMemoryManager(std::unique_ptr<llvm::RTDyldMemoryManager>(
+                                   new llvm::SectionMemoryManager()));
+    llvm::ExecutionEngine *engine = builder.create();
+    if (engine == NULL)
+        Error(SourcePos(), "Unable to create JIT execution engine: %s",
+              error.c_str());
+    else
+        engine->finalizeObject();
+
+    // The engine has taken ownership of the llvm::Module.
+    delete m;
+    m = NULL;
+    return engine;
+}
+
+
+void *
+JIT::GetFunction(const std::string &source, const char *functionName) {
+    llvm::MD5 hash;
+    hash.update(llvm::StringRef(optionsKey.c_str(), optionsKey.size()));
+    hash.update(llvm::StringRef(source.c_str(), source.size()));
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    llvm::SmallString<32> key;
+    llvm::MD5::stringifyResult(result, key);
+
+    llvm::ExecutionEngine *engine;
+    std::map<std::string, llvm::ExecutionEngine *>::iterator iter =
+        programs.find(key.str().str());
+    if (iter != programs.end())
+        engine = iter->second;
+    else {
+        // Programs that fail to compile aren't cached, so that their
+        // errors are reported again if they're asked for again.
+        engine = compile(source);
+        if (engine == NULL)
+            return NULL;
+        programs[key.str().str()] = engine;
+    }
+
+    return (void *)(uintptr_t)engine->getFunctionAddress(functionName);
+}
+
+#else // LLVM 3.6-
+
+JIT *
+JIT::Create(int argc, const char *argv[]) {
+    fprintf(stderr, "JIT compilation requires ispc to be built with LLVM 3.7 "
+            "or later.\n");
+    return NULL;
+}
+
+
+llvm::ExecutionEngine *
+JIT::compile(const std::string &source) {
+    return NULL;
+}
+
+
+void *
+JIT::GetFunction(const std::string &source, const char *functionName) {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+  Copyright (c) 2010-2018, Intel Corporation
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are
+  met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of Intel Corporation nor the names of its
+      contributors may be used to endorse or promote products derived from
+      this software without specific prior written permission.
+
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+   IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/** @file jit.h
+    @brief Interface for compiling ispc programs into the running process
+           (libispc)
+*/
+
+#ifndef ISPC_JIT_H
+#define ISPC_JIT_H 1
+
+#include "ispc.h"
+#include <map>
+
+namespace llvm
+{
+    class ExecutionEngine;
+}
+
+/** @brief Compiles ispc programs given as source code into the running
+    process.
+
+    JIT compiles programs for the host (or the target given in the
+    options) and returns the addresses of their exported functions, which
+    can then be called directly.  Compiled programs are kept in an
+    in-memory cache keyed by a hash of the source code and the options, so
+    asking for a function from a program that has been compiled before
+    doesn't compile anything.
+
+    ispc keeps its compilation state in globals, so a program using JIT
+    must not use it from more than one thread at a time.  Each JIT keeps
+    its own copy of the settings, though, which it installs before it
+    compiles anything, so several JITs with different options can be
+    used.  Calls from the generated code to the
+    task system (ISPCLaunch(), ISPCSync() and ISPCAlloc()) are resolved
+    against the symbols of the running process.
+ */
+class JIT {
+public:
+    /** Options are given as they would be on the ispc command line.  The
+        supported ones are -O0/-O1/-O2/-O3, --target=, --cpu=, --arch=,
+        --addressing=, --math-lib=, --opt=, -D, -I, --nostdlib, --nocpp,
+        --werror, --woff and --wno-perf.  Returns NULL (after printing an
+        error message) if the options are invalid, or if JIT compilation
+        isn't supported with the LLVM version ispc was built with. */
+    static JIT *Create(int argc, const char *argv[]);
+
+    ~JIT();
+
+    /** Returns the address of the exported function with the given name
+        in the program with the given source code, compiling the program
+        if it isn't in the cache yet.  Returns NULL if the program couldn't
+        be compiled (the error messages are printed to stderr) or doesn't
+        export a function with that name. */
+    void *GetFunction(const std::string &source, const char *functionName);
+
+    /** Drops all of the compiled programs from the cache.  Functions
+        returned by GetFunction() must not be called afterwards. */
+    void ClearCache();
+
+private:
+    JIT(const std::string &optionsKey, const Globals &settings);
+
+    /** Compiles the given program; returns NULL on failure. */
+    llvm::ExecutionEngine *compile(const std::string &source);
+
+    /** The options the JIT was created with, which are part of the cache
+        key. */
+    std::string optionsKey;
+
+    /** The settings given by the options, including the Target, which the
+        JIT owns. */
+    Globals settings;
+
+    /** Compiled programs, keyed by a hash of the options and the source
+        code. */
+    std::map<std::string, llvm::ExecutionEngine *> programs;
+};
+
+#endif // ISPC_JIT_H
@@ -1125,6 +1125,28 @@ lVectorValuesAllEqual(llvm::Value *v, int vectorLength,
         return lVectorValuesAllEqual(cast->getOperand(0), vectorLength,
                                      seenPhis);
 
+    llvm::CmpInst *cmp = llvm::dyn_cast<llvm::CmpInst>(v);
+    if (cmp != NULL)
+        return (lVectorValuesAllEqual(cmp->getOperand(0), vectorLength,
+                                      seenPhis) &&
+                lVectorValuesAllEqual(cmp->getOperand(1), vectorLength,
+                                      seenPhis));
+
+    llvm::SelectInst *select = llvm::dyn_cast<llvm::SelectInst>(v);
+    if (select != NULL) {
+        // A select with a scalar condition picks one of its two operands
+        // for all of the lanes; with a vector condition, the condition
+        // has to be the same across the lanes as well.
+        llvm::Value *cond = select->getCondition();
+        if (llvm::isa<llvm::VectorType>(cond->getType()) &&
+            !lVectorValuesAllEqual(cond, vectorLength, seenPhis))
+            return false;
+        return (lVectorValuesAllEqual(select->getTrueValue(), vectorLength,
+                                      seenPhis) &&
+                lVectorValuesAllEqual(select->getFalseValue(), vectorLength,
+                                      seenPhis));
+    }
+
     llvm::InsertElementInst *ie = llvm::dyn_cast<llvm::InsertElementInst>(v);
     if (ie != NULL) {
         return (LLVMFlattenInsertChain(ie, vectorLength) != NULL);
@@ -45,6 +45,13 @@
   #include <time.h>
 #else
   #include <unistd.h>
+  #include <errno.h>
+  #include <signal.h>
+  #include <stdint.h>
+  #include <sys/socket.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+  #include <sys/wait.h>
 #endif // ISPC_IS_WINDOWS
 #include <llvm/Support/Signals.h>
 #include <llvm/Support/TargetRegistry.h>
@@ -93,7 +100,10 @@ usage(int ret) {
     printf("    [--arch={%s}]\t\tSelect target architecture\n",
            Target::SupportedArchs());
     printf("    [--c++-include-file=<name>]\t\tSpecify name of file to emit in #include statement in generated C++ code.\n");
+    printf("    [--cache-dir=<dir>]\t\t\tReuse outputs of identical earlier compilations cached in <dir>\n");
+    printf("    [--cache-stats]\t\t\tPrint the number of hits and misses in the compilation cache\n");
 #ifndef ISPC_IS_WINDOWS
+    printf("    [--codegen-partitions=<n>]\t\tSplit the optimized program into <n> partitions compiled in parallel (object file output only)\n");
     printf("    [--colored-output]\t\tAlways use terminal colors in error/warning messages.\n");
 #endif
     printf("    ");
@@ -114,6 +124,9 @@ usage(int ret) {
     printf("    [--emit-llvm]\t\t\tEmit LLVM bitode file as output\n");
     printf("    [--emit-obj]\t\t\tGenerate object file file as output (default)\n");
     printf("    [--force-alignment=<value>]\t\tForce alignment in memory allocations routine to be <value>\n");
+#ifndef ISPC_IS_WINDOWS
+    printf("    [--function-partitions=<n>]\t\tOptimize and compile the functions in <n> partitions in parallel (object file output only)\n");
+#endif // !ISPC_IS_WINDOWS
     printf("    [-g]\t\t\t\tGenerate source-level debug information\n");
     printf("    [--help]\t\t\t\tPrint help\n");
     printf("    [--help-dev]\t\t\tPrint help for developer options\n");
@@ -121,6 +134,9 @@ usage(int ret) {
     printf("    [-h <name>/--header-outfile=<name>]\tOutput filename for header\n");
     printf("    [-I <path>]\t\t\t\tAdd <path> to #include file search path\n");
     printf("    [--instrument]\t\t\tEmit instrumentation to gather performance data\n");
+#ifndef ISPC_IS_WINDOWS
+    printf("    [-j <n>/--jobs=<n>]\t\t\tGenerate code for up to <n> targets concurrently when compiling for multiple targets\n");
+#endif // !ISPC_IS_WINDOWS
     printf("    [--math-lib=<option>]\t\tSelect math library\n");
     printf("        default\t\t\t\tUse ispc's built-in math functions\n");
     printf("        fast\t\t\t\tUse high-performance but lower-accuracy math functions\n");
@@ -146,11 +162,17 @@ usage(int ret) {
     printf("    [--pic]\t\t\t\tGenerate position-independent code\n");
 #endif // !ISPC_IS_WINDOWS
     printf("    [--quiet]\t\t\t\tSuppress all output\n");
+    printf("    [--specialize=<f>:<p>=<v>[,...]]\tAlso compile exported function <f> for the given constant values of its uniform parameters\n");
+#ifndef ISPC_IS_WINDOWS
+    printf("    [--server=<socket>]\t\t\tServe compile requests from ispc invocations run with ISPC_SERVER=<socket>\n");
+#endif // !ISPC_IS_WINDOWS
     printf("    ");
     char targetHelp[2048];
     sprintf(targetHelp, "[--target=<t>]\t\t\tSelect target ISA and width.\n"
             "<t>={%s}", Target::SupportedTargets());
     PrintWithWordBreaks(targetHelp, 24, TerminalWidth(), stdout);
+    printf("    [--time-trace[=<file>]]\t\tWrite a Chrome trace of where compile time is spent to <file>\n");
+    printf("    [--time-trace-granularity=<us>]\tOmit trace events shorter than <us> microseconds (default 500)\n");
     printf("    [--version]\t\t\t\tPrint ispc version\n");
     printf("    [--werror]\t\t\t\tTreat warnings as errors\n");
     printf("    [--woff]\t\t\t\tDisable warnings\n");
@@ -180,6 +202,7 @@ devUsage(int ret) {
     printf("        disable-handle-pseudo-memory-ops\tLeave __pseudo_* calls for gather/scatter/etc. in final IR\n");
     printf("        disable-uniform-control-flow\t\tDisable uniform control flow optimizations\n");
     printf("        disable-uniform-memory-optimizations\tDisable uniform-based coherent memory access\n");
+    printf("        disable-uniform-scalarization\t\tDisable computing varying values that are the same in all lanes as scalars\n");
     printf("    [--yydebug]\t\t\t\tPrint debugging information during parsing\n");
     printf("    [--debug-phase=<value>]\t\tSet optimization phases to dump. --debug-phase=first,210:220,300,305,310:last\n");
 #if ISPC_LLVM_VERSION == ISPC_LLVM_3_4 || ISPC_LLVM_VERSION == ISPC_LLVM_3_5 // 3.4, 3.5
@@ -415,42 +438,18 @@ lParseInclude(const char *path) {
 }
 
 
-int main(int Argc, char *Argv[]) {
-    int argc;
-    char *argv[MAX_NUM_ARGS];
-    lGetAllArgs(Argc, Argv, argc, argv);
-
-    llvm::sys::AddSignalHandler(lSignal, NULL);
-
-    // initialize available LLVM targets
-#ifndef __arm__
-    // FIXME: LLVM build on ARM doesn't build the x86 targets by default.
-    // It's not clear that anyone's going to want to generate x86 from an
-    // ARM host, though...
-    LLVMInitializeX86TargetInfo();
-    LLVMInitializeX86Target();
-    LLVMInitializeX86AsmPrinter();
-    LLVMInitializeX86AsmParser();
-    LLVMInitializeX86Disassembler();
-    LLVMInitializeX86TargetMC();
-#endif // !__ARM__
+#ifndef ISPC_IS_WINDOWS
+static int lRunServer(const char *socketPath, const char *arch,
+                      const char *cpu, const char *target,
+                      Module::OutputFlags flags);
+#endif // !ISPC_IS_WINDOWS
 
-#ifdef ISPC_ARM_ENABLED
-    // Generating ARM from x86 is more likely to be useful, though.
-    LLVMInitializeARMTargetInfo();
-    LLVMInitializeARMTarget();
-    LLVMInitializeARMAsmPrinter();
-    LLVMInitializeARMAsmParser();
-    LLVMInitializeARMDisassembler();
-    LLVMInitializeARMTargetMC();
-#endif
 
-#ifdef ISPC_NVPTX_ENABLED
-    LLVMInitializeNVPTXTargetInfo();
-    LLVMInitializeNVPTXTarget();
-    LLVMInitializeNVPTXAsmPrinter();
-    LLVMInitializeNVPTXTargetMC();
-#endif /* ISPC_NVPTX_ENABLED */
+/** Parses the given command line and runs the compilation it describes.
+    This is called by main() once LLVM has been initialized, and by the
+    compile server for each request. */
+static int
+lCompile(int argc, char *argv[]) {
 
     char *file = NULL;
     const char *headerFileName = NULL;
@@ -467,6 +466,11 @@ int main(int Argc, char *Argv[]) {
     Module::OutputType ot = Module::Object;
     Module::OutputFlags flags = Module::NoFlags;
     const char *arch = NULL, *cpu = NULL, *target = NULL;
+    bool printCacheStats = false;
+    bool timeTrace = false;
+    const char *timeTraceFileName = NULL;
+    int timeTraceGranularity = 500;
+    const char *serverSocket = NULL;
 
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--help"))
@@ -491,6 +495,10 @@ int main(int Argc, char *Argv[]) {
             arch = argv[i] + 7;
         else if (!strncmp(argv[i], "--cpu=", 6))
             cpu = argv[i] + 6;
+        else if (!strncmp(argv[i], "--cache-dir=", 12))
+            g->cacheDir = argv[i] + 12;
+        else if (!strcmp(argv[i], "--cache-stats"))
+            printCacheStats = true;
         else if (!strcmp(argv[i], "--fast-math")) {
             fprintf(stderr, "--fast-math option has been renamed to --opt=fast-math!\n");
             usage(1);
@@ -611,6 +619,8 @@ int main(int Argc, char *Argv[]) {
                 g->opt.disableGatherScatterFlattening = true;
             else if (!strcmp(opt, "disable-uniform-memory-optimizations"))
                 g->opt.disableUniformMemoryOptimizations = true;
+            else if (!strcmp(opt, "disable-uniform-scalarization"))
+                g->opt.disableUniformScalarization = true;
             else {
                 fprintf(stderr, "Unknown --opt= option \"%s\".\n", opt);
                 usage(1);
@@ -623,6 +633,8 @@ int main(int Argc, char *Argv[]) {
             g->disableWarnings = true;
             g->emitPerfWarnings = false;
         }
+        else if (!strncmp(argv[i], "--specialize=", 13))
+            g->specializations.push_back(argv[i] + 13);
         else if (!strcmp(argv[i], "--werror"))
             g->warningsAsErrors = true;
         else if (!strcmp(argv[i], "--nowrap"))
@@ -667,11 +679,34 @@ int main(int Argc, char *Argv[]) {
 #ifndef ISPC_IS_WINDOWS
         else if (!strcmp(argv[i], "--pic"))
             flags |= Module::GeneratePIC;
+        else if (!strcmp(argv[i], "-j")) {
+            if (++i == argc) {
+                fprintf(stderr, "No job count specified after -j option.\n");
+                usage(1);
+            }
+            g->numJobs = atoi(argv[i]);
+        }
+        else if (!strncmp(argv[i], "--jobs=", 7))
+            g->numJobs = atoi(argv[i] + 7);
+        else if (!strncmp(argv[i], "--function-partitions=", 22))
+            g->numFunctionPartitions = atoi(argv[i] + 22);
+        else if (!strncmp(argv[i], "--codegen-partitions=", 21))
+            g->numCodegenPartitions = atoi(argv[i] + 21);
+        else if (!strncmp(argv[i], "--server=", 9))
+            serverSocket = argv[i] + 9;
         else if (!strcmp(argv[i], "--colored-output"))
             g->forceColoredOutput = true;
 #endif // !ISPC_IS_WINDOWS
         else if (!strcmp(argv[i], "--quiet"))
             g->quiet = true;
+        else if (!strcmp(argv[i], "--time-trace"))
+            timeTrace = true;
+        else if (!strncmp(argv[i], "--time-trace=", 13)) {
+            timeTrace = true;
+            timeTraceFileName = argv[i] + 13;
+        }
+        else if (!strncmp(argv[i], "--time-trace-granularity=", 25))
+            timeTraceGranularity = atoi(argv[i] + 25);
         else if (!strcmp(argv[i], "--yydebug")) {
             extern int yydebug;
             yydebug = 1;
@@ -751,6 +786,22 @@ int main(int Argc, char *Argv[]) {
         }
     }
 
+    if (printCacheStats && file == NULL) {
+        // Just report on the cache; there's nothing to compile.
+        Module::PrintCacheStatistics();
+        return 0;
+    }
+
+#ifndef ISPC_IS_WINDOWS
+    if (serverSocket != NULL) {
+        if (file != NULL) {
+            fprintf(stderr, "Can't specify a file to compile with --server.\n");
+            usage(1);
+        }
+        return lRunServer(serverSocket, arch, cpu, target, flags);
+    }
+#endif // !ISPC_IS_WINDOWS
+
     if (g->enableFuzzTest) {
         if (g->fuzzTestSeed == -1) {
 #ifdef ISPC_IS_WINDOWS
@@ -796,13 +847,425 @@ int main(int Argc, char *Argv[]) {
               "Program will be compiled and warnings/errors will "
               "be issued, but no output will be generated.");
 
-    return Module::CompileAndOutput(file, arch, cpu, target, flags,
-                                    ot,
-                                    outFileName,
-                                    headerFileName,
-                                    includeFileName,
-                                    depsFileName,
-                                    depsTargetName,
-                                    hostStubFileName,
-                                    devStubFileName);
+    if (timeTrace)
+        TimeTraceInitialize(timeTraceGranularity);
+
+    int ret;
+    {
+        TimeTraceScope traceCompile("Compile", file != NULL ? file : "<stdin>");
+        ret = Module::CompileAndOutput(file, arch, cpu, target, flags,
+                                       ot,
+                                       outFileName,
+                                       headerFileName,
+                                       includeFileName,
+                                       depsFileName,
+                                       depsTargetName,
+                                       hostStubFileName,
+                                       devStubFileName);
+    }
+    if (printCacheStats)
+        Module::PrintCacheStatistics();
+
+    if (timeTrace) {
+        // By default, the trace goes next to the output file, with a
+        // .json suffix.
+        std::string traceFileName;
+        if (timeTraceFileName != NULL)
+            traceFileName = timeTraceFileName;
+        else if (outFileName != NULL && strcmp(outFileName, "-") != 0) {
+            traceFileName = outFileName;
+            size_t dot = traceFileName.find_last_of('.');
+            size_t slash = traceFileName.find_last_of("/\\");
+            if (dot != std::string::npos &&
+                (slash == std::string::npos || dot > slash))
+                traceFileName.erase(dot, std::string::npos);
+            traceFileName.append(".json");
+        }
+        else
+            traceFileName = "ispc-time-trace.json";
+        if (!TimeTraceWrite(traceFileName.c_str()))
+            ret = 1;
+    }
+    return ret;
+}
+
+
+#ifndef ISPC_IS_WINDOWS
+///////////////////////////////////////////////////////////////////////////
+// Compile server
+//
+// "ispc --server=<socket>" listens on a Unix domain socket.  When ispc is
+// run with the ISPC_SERVER environment variable set to the socket's path,
+// it sends its (expanded) command line, its working directory and its
+// stdin/stdout/stderr to the server, waits for the exit status and exits
+// with it; if no server can be reached, it just compiles by itself.
+//
+// The server initializes LLVM and sets up the Target and a module with
+// the standard library defined once, up front, for the options it was
+// started with (see Module::PrepareWarmStart()).  Each request is handled
+// in a forked process, so requests run concurrently (as many at a time as
+// there are CPUs), a request can't disturb the state the server keeps warm
+// for the next ones, and crashes only affect the request that caused them.
+//
+// A request is a 4-byte size, sent along with the three file descriptors,
+// followed by that many bytes holding the NUL-terminated working
+// directory and arguments.  The reply is the 4-byte exit status.
+
+static bool
+lWriteAll(int fd, const void *data, size_t size) {
+    const char *ptr = (const char *)data;
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+static bool
+lReadAll(int fd, void *data, size_t size) {
+    char *ptr = (char *)data;
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+static bool
+lSocketAddress(const char *socketPath, struct sockaddr_un *addr) {
+    if (strlen(socketPath) >= sizeof(addr->sun_path))
+        return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socketPath);
+    return true;
+}
+
+
+/** If the ISPC_SERVER environment variable names the socket of a running
+    compile server, has the server carry out the compilation described by
+    the given arguments, and returns true with its exit status in *status.
+    Returns false if the compilation should be done locally. */
+static bool
+lRunOnServer(int argc, char *argv[], int *status) {
+    const char *socketPath = getenv("ISPC_SERVER");
+    if (socketPath == NULL || *socketPath == '\0')
+        return false;
+    // Don't try to send anything to ourselves...
+    for (int i = 1; i < argc; ++i)
+        if (!strncmp(argv[i], "--server=", 9))
+            return false;
+
+    struct sockaddr_un addr;
+    char cwd[1024];
+    if (!lSocketAddress(socketPath, &addr) ||
+        getcwd(cwd, sizeof(cwd)) == NULL)
+        return false;
+
+    std::string request(cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; ++i)
+        request.append(argv[i], strlen(argv[i]) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    uint32_t size = (uint32_t)request.size();
+    struct iovec iov;
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+    int fds[3] = { 0, 1, 2 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t result;
+    bool ok = (sendmsg(fd, &msg, 0) == (ssize_t)sizeof(size) &&
+               lWriteAll(fd, request.data(), request.size()) &&
+               lReadAll(fd, &result, sizeof(result)));
+    close(fd);
+    if (!ok)
+        // The server went away before answering; the compilation can
+        // safely be redone here.
+        return false;
+
+    *status = result;
+    return true;
+}
+
+
+/** Handles a single request from a client connected to the compile
+    server. */
+static int
+lServeRequest(int conn) {
+    uint32_t size;
+    struct iovec iov;
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != (ssize_t)sizeof(size) || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return 1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    std::vector<char> request(size);
+    if (size == 0 || !lReadAll(conn, &request[0], size) ||
+        request[size - 1] != '\0')
+        return 1;
+
+    const char *cwd = &request[0];
+    int argc = 0;
+    char *argv[MAX_NUM_ARGS];
+    for (size_t offset = strlen(cwd) + 1; offset < size;
+         offset += strlen(&request[offset]) + 1) {
+        if (argc == MAX_NUM_ARGS)
+            return 1;
+        argv[argc++] = &request[offset];
+    }
+    if (argc == 0)
+        return 1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Compile as if we were the client.
+        close(conn);
+        for (int i = 0; i < 3; ++i) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        if (chdir(cwd) != 0) {
+            perror(cwd);
+            _exit(1);
+        }
+        int ret = lCompile(argc, argv);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ret);
+    }
+    for (int i = 0; i < 3; ++i)
+        close(fds[i]);
+
+    int32_t result = 1;
+    int status;
+    if (pid > 0 && waitpid(pid, &status, 0) == pid) {
+        if (WIFEXITED(status))
+            result = WEXITSTATUS(status);
+        else if (WIFSIGNALED(status))
+            result = 128 + WTERMSIG(status);
+    }
+    lWriteAll(conn, &result, sizeof(result));
+    return 0;
+}
+
+
+/** Returns true if the process at the other end of the given connection
+    is running as the same user as the server.  The client hands over its
+    file descriptors and working directory and has the server compile as
+    if it were the client, so no one else may use the server. */
+static bool
+lPeerIsSameUser(int conn) {
+#ifdef ISPC_IS_LINUX
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0 ||
+        length != sizeof(cred))
+        return false;
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(conn, &uid, &gid) != 0)
+        return false;
+    return uid == geteuid();
+#endif // ISPC_IS_LINUX
+}
+
+
+static int
+lRunServer(const char *socketPath, const char *arch, const char *cpu,
+           const char *target, Module::OutputFlags flags) {
+    struct sockaddr_un addr;
+    if (!lSocketAddress(socketPath, &addr)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socketPath);
+        return 1;
+    }
+
+    if (!Module::PrepareWarmStart(arch, cpu, target, flags))
+        Warning(SourcePos(), "Unable to set up the standard library ahead "
+                "of time for the given options; each request will be "
+                "compiled from scratch.");
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+    // Don't take the socket away from a server that's still running, but
+    // clean up after one that went away without removing it.
+    if (connect(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A compile server is already running on \"%s\".\n",
+                socketPath);
+        close(listenFd);
+        return 1;
+    }
+    close(listenFd);
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(socketPath);
+
+    // Only the server's user may connect to the socket; the permissions
+    // are set when it's created, so that there's no window in which
+    // others can.  (Connections are checked in lPeerIsSameUser() as well,
+    // since not all systems honor the permissions of sockets.)
+    mode_t oldMask = umask(0177);
+    bool bound = (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    umask(oldMask);
+    if (!bound || chmod(socketPath, 0600) != 0 || listen(listenFd, 64) != 0) {
+        perror(socketPath);
+        close(listenFd);
+        return 1;
+    }
+
+    // Run at most one handler per CPU at a time; when that many are
+    // running, connections wait in the listen queue until one finishes.
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxHandlers = numCPUs > 0 ? (int)numCPUs : 1;
+    int numHandlers = 0;
+
+    while (true) {
+        // Reap the handlers that have finished, waiting for one if we're
+        // at the limit.
+        while (numHandlers > 0) {
+            pid_t done = waitpid(-1, NULL,
+                                 numHandlers >= maxHandlers ? 0 : WNOHANG);
+            if (done > 0)
+                --numHandlers;
+            else if (done < 0 && errno == EINTR)
+                continue;
+            else {
+                if (done < 0)
+                    // No children left after all.
+                    numHandlers = 0;
+                break;
+            }
+        }
+
+        int conn = accept(listenFd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            close(listenFd);
+            unlink(socketPath);
+            return 1;
+        }
+        if (!lPeerIsSameUser(conn)) {
+            close(conn);
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listenFd);
+            int ret = lServeRequest(conn);
+            close(conn);
+            _exit(ret);
+        }
+        else if (pid < 0)
+            perror("fork");
+        else
+            ++numHandlers;
+        close(conn);
+    }
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+int main(int Argc, char *Argv[]) {
+    int argc;
+    char *argv[MAX_NUM_ARGS];
+    lGetAllArgs(Argc, Argv, argc, argv);
+
+#ifndef ISPC_IS_WINDOWS
+    int status;
+    if (lRunOnServer(argc, argv, &status))
+        return status;
+#endif // !ISPC_IS_WINDOWS
+
+    llvm::sys::AddSignalHandler(lSignal, NULL);
+
+    // initialize available LLVM targets
+#ifndef __arm__
+    // FIXME: LLVM build on ARM doesn't build the x86 targets by default.
+    // It's not clear that anyone's going to want to generate x86 from an
+    // ARM host, though...
+    LLVMInitializeX86TargetInfo();
+    LLVMInitializeX86Target();
+    LLVMInitializeX86AsmPrinter();
+    LLVMInitializeX86AsmParser();
+    LLVMInitializeX86Disassembler();
+    LLVMInitializeX86TargetMC();
+#endif // !__ARM__
+
+#ifdef ISPC_ARM_ENABLED
+    // Generating ARM from x86 is more likely to be useful, though.
+    LLVMInitializeARMTargetInfo();
+    LLVMInitializeARMTarget();
+    LLVMInitializeARMAsmPrinter();
+    LLVMInitializeARMAsmParser();
+    LLVMInitializeARMDisassembler();
+    LLVMInitializeARMTargetMC();
+#endif
+
+#ifdef ISPC_NVPTX_ENABLED
+    LLVMInitializeNVPTXTargetInfo();
+    LLVMInitializeNVPTXTarget();
+    LLVMInitializeNVPTXAsmPrinter();
+    LLVMInitializeNVPTXTargetMC();
+#endif /* ISPC_NVPTX_ENABLED */
+
+    return lCompile(argc, argv);
 }
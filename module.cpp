@@ -50,12 +50,15 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <algorithm>
 #include <set>
+#include <fstream>
+#include <iterator>
 #include <sstream>
 #include <iostream>
 #ifdef ISPC_NVPTX_ENABLED
@@ -64,7 +67,12 @@
 #ifdef ISPC_IS_WINDOWS
 #include <windows.h>
 #include <io.h>
+#include <direct.h>
+#include <process.h>
 #define strcasecmp stricmp
+#else
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 #if ISPC_LLVM_VERSION == ISPC_LLVM_3_2
   #include <llvm/LLVMContext.h>
@@ -98,6 +106,7 @@
 #endif
 #include <llvm/PassRegistry.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Support/FormattedStream.h>
 #include <llvm/Support/FileUtilities.h>
 #include <llvm/Target/TargetMachine.h>
@@ -127,7 +136,11 @@
 #include <clang/Lex/PreprocessorOptions.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_4 // LLVM 3.4+
+    #include <llvm/Support/MD5.h>
+#endif
 #if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
     #include <llvm/Bitcode/ReaderWriter.h>
 #else
@@ -385,7 +398,7 @@ lStripUnusedDebugInfo(llvm::Module *module) {
 ///////////////////////////////////////////////////////////////////////////
 // Module
 
-Module::Module(const char *fn) {
+Module::Module(const char *fn, const char *source) {
     // It's a hack to do this here, but it must be done after the target
     // information has been set (so e.g. the vector width is known...)  In
     // particular, if we're compiling to multiple targets with different
@@ -393,9 +406,13 @@ Module::Module(const char *fn) {
     InitLLVMUtil(g->ctx, *g->target);
 
     filename = fn;
+    sourceText = source;
     errorCount = 0;
     symbolTable = new SymbolTable;
     ast = new AST;
+    havePreprocessedSource = false;
+    stdlibDefined = false;
+    numFunctionPartitions = 1;
 
     lDeclareSizeAndPtrIntTypes(symbolTable);
 
@@ -485,8 +502,8 @@ extern YY_BUFFER_STATE yy_scan_string(const char *);
 extern YY_BUFFER_STATE yy_create_buffer(FILE *, int);
 extern void yy_delete_buffer(YY_BUFFER_STATE);
 
-int
-Module::CompileFile() {
+void
+Module::defineStdlib() {
     extern void ParserInit();
     ParserInit();
 
@@ -494,26 +511,295 @@ Module::CompileFile() {
     // function ends up calling into routines that expect the global
     // variable 'm' to be initialized and available (which it isn't until
     // the Module constructor returns...)
+    TimeTraceScope traceStdlib("DefineStdlib");
     DefineStdlib(symbolTable, g->ctx, module, g->includeStdlib);
+    stdlibDefined = true;
+}
 
-    bool runPreprocessor = g->runCPP;
 
-    if (runPreprocessor) {
-        if (filename != NULL) {
-            // Try to open the file first, since otherwise we crash in the
-            // preprocessor if the file doesn't exist.
-            FILE *f = fopen(filename, "r");
-            if (!f) {
-                perror(filename);
-                return 1;
+void
+Module::setFilename(const char *fn) {
+    filename = fn;
+    module->setModuleIdentifier(filename ? filename : "<stdin>");
+}
+
+
+/** Parses the value of a --specialize= option,
+    "<function>:<param>=<value>[,<param>=<value>...]", and returns the
+    exported function that it names, with the constant value for each of
+    the given parameters (indexed by parameter number) in *values.
+    Returns NULL (after issuing an error) if the option is malformed or
+    doesn't match the function's declaration. */
+static llvm::Function *
+lParseSpecialization(const std::string &spec, SymbolTable *symbolTable,
+                     std::map<int, llvm::Constant *> *values) {
+    size_t colon = spec.find(':');
+    if (colon == 0 || colon == std::string::npos ||
+        colon + 1 == spec.size()) {
+        Error(SourcePos(), "Malformed \"--specialize=%s\" option; expected "
+              "<function>:<param>=<value>[,<param>=<value>...].",
+              spec.c_str());
+        return NULL;
+    }
+
+    std::string name = spec.substr(0, colon);
+    std::vector<Symbol *> matches;
+    symbolTable->LookupFunction(name.c_str(), &matches);
+    Symbol *sym = NULL;
+    for (unsigned int i = 0; i < matches.size(); ++i)
+        if (matches[i]->exportedFunction != NULL)
+            sym = matches[i];
+    if (sym == NULL) {
+        Error(SourcePos(), "Can't specialize \"%s\": no exported function "
+              "with that name is defined.", name.c_str());
+        return NULL;
+    }
+    const FunctionType *ftype = CastType<FunctionType>(sym->type);
+    Assert(ftype != NULL);
+    llvm::Function *function = sym->exportedFunction;
+
+    size_t pos = colon + 1;
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string assignment = spec.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t equals = assignment.find('=');
+        if (equals == 0 || equals == std::string::npos ||
+            equals + 1 == assignment.size()) {
+            Error(SourcePos(), "Malformed parameter value \"%s\" in "
+                  "\"--specialize=%s\" option.", assignment.c_str(),
+                  spec.c_str());
+            return NULL;
+        }
+        std::string param = assignment.substr(0, equals);
+        std::string value = assignment.substr(equals + 1);
+
+        int index = -1;
+        for (int i = 0; i < ftype->GetNumParameters(); ++i)
+            if (ftype->GetParameterName(i) == param)
+                index = i;
+        if (index == -1) {
+            Error(SourcePos(), "Can't specialize \"%s\": it has no parameter "
+                  "named \"%s\".", name.c_str(), param.c_str());
+            return NULL;
+        }
+
+        const Type *type = ftype->GetParameterType(index);
+        const AtomicType *atomicType = CastType<AtomicType>(type);
+        if (atomicType == NULL || !type->IsUniformType()) {
+            Error(SourcePos(), "Can't specialize parameter \"%s\" of \"%s\": "
+                  "only parameters with uniform atomic types can be "
+                  "specialized, but it has type \"%s\".", param.c_str(),
+                  name.c_str(), type->GetString().c_str());
+            return NULL;
+        }
+
+        llvm::Type *llvmType =
+            function->getFunctionType()->getParamType(index);
+        const char *str = value.c_str();
+        char *strEnd = NULL;
+        llvm::Constant *constant = NULL;
+        if (atomicType->basicType == AtomicType::TYPE_BOOL) {
+            if (value == "true" || value == "1")
+                constant = llvm::ConstantInt::get(llvmType, 1);
+            else if (value == "false" || value == "0")
+                constant = llvm::ConstantInt::get(llvmType, 0);
+        }
+        else if (atomicType->IsFloatType()) {
+            double v = strtod(str, &strEnd);
+            if (*strEnd == '\0')
+                constant = llvm::ConstantFP::get(llvmType, v);
+        }
+        else if (atomicType->IsUnsignedType()) {
+            unsigned long long v = strtoull(str, &strEnd, 0);
+            if (*strEnd == '\0')
+                constant = llvm::ConstantInt::get(llvmType, (uint64_t)v);
+        }
+        else {
+            long long v = strtoll(str, &strEnd, 0);
+            if (*strEnd == '\0')
+                constant = llvm::ConstantInt::get(llvmType, (uint64_t)v,
+                                                  true /* signed */);
+        }
+        if (constant == NULL) {
+            Error(SourcePos(), "Invalid value \"%s\" for parameter \"%s\" of "
+                  "\"%s\", which has type \"%s\".", value.c_str(),
+                  param.c_str(), name.c_str(), type->GetString().c_str());
+            return NULL;
+        }
+        (*values)[index] = constant;
+    }
+
+    return function;
+}
+
+
+/** Returns an internal copy of the given function, with its arguments
+    given in "values" replaced with the corresponding constants. */
+static llvm::Function *
+lCloneSpecialized(llvm::Function *function, const std::string &name,
+                  const std::map<int, llvm::Constant *> &values) {
+    llvm::Function *clone =
+        llvm::Function::Create(function->getFunctionType(),
+                               llvm::GlobalValue::InternalLinkage,
+                               name.c_str(), function->getParent());
+    llvm::ValueToValueMapTy vmap;
+    llvm::Function::arg_iterator dest = clone->arg_begin();
+    for (llvm::Function::arg_iterator src = function->arg_begin();
+         src != function->arg_end(); ++src, ++dest) {
+        dest->setName(src->getName());
+        vmap[&*src] = &*dest;
+    }
+    llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+    llvm::CloneFunctionInto(clone, function, vmap, false, returns);
+    clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_8
+    // The clone would otherwise share the original's debug information
+    // entry, which each function must have its own of.
+    llvm::stripDebugInfo(*clone);
+#endif
+
+    int index = 0;
+    for (llvm::Function::arg_iterator arg = clone->arg_begin();
+         arg != clone->arg_end(); ++arg, ++index) {
+        std::map<int, llvm::Constant *>::const_iterator iter =
+            values.find(index);
+        if (iter != values.end())
+            arg->replaceAllUsesWith(iter->second);
+    }
+    return clone;
+}
+
+
+/** Handles the --specialize= options: for each one, a copy of the exported
+    function is made with the given parameters replaced with the given
+    constants, which the optimizer then propagates through it, and the
+    exported function is given a prologue that calls that copy if it's
+    called with those values. */
+static void
+lSpecializeExportedFunctions(SymbolTable *symbolTable) {
+    std::vector<llvm::Function *> functions;
+    std::map<llvm::Function *,
+             std::vector<std::map<int, llvm::Constant *> > > specializations;
+    for (unsigned int i = 0; i < g->specializations.size(); ++i) {
+        std::map<int, llvm::Constant *> values;
+        llvm::Function *function =
+            lParseSpecialization(g->specializations[i], symbolTable, &values);
+        if (function == NULL)
+            return;
+        if (specializations.find(function) == specializations.end())
+            functions.push_back(function);
+        specializations[function].push_back(values);
+    }
+
+    for (unsigned int i = 0; i < functions.size(); ++i) {
+        llvm::Function *function = functions[i];
+        const std::vector<std::map<int, llvm::Constant *> > &valueSets =
+            specializations[function];
+
+        std::vector<llvm::Value *> args;
+        for (llvm::Function::arg_iterator arg = function->arg_begin();
+             arg != function->arg_end(); ++arg)
+            args.push_back(&*arg);
+
+        // The copies have to be made before the function is changed.
+        std::vector<llvm::Function *> clones;
+        for (unsigned int j = 0; j < valueSets.size(); ++j) {
+            char name[1024];
+            snprintf(name, sizeof(name), "%s___spec%d",
+                     function->getName().str().c_str(), (int)j);
+            clones.push_back(lCloneSpecialized(function, name, valueSets[j]));
+        }
+
+        // Add a pair of blocks for each specialization ahead of the
+        // function's body: one that checks whether the arguments match
+        // and one that calls the specialized copy if so.
+        llvm::BasicBlock *body = &function->getEntryBlock();
+        std::vector<llvm::BasicBlock *> checkBlocks, callBlocks;
+        for (unsigned int j = 0; j < valueSets.size(); ++j) {
+            checkBlocks.push_back(llvm::BasicBlock::Create(
+                *g->ctx, "specialization_check", function, body));
+            callBlocks.push_back(llvm::BasicBlock::Create(
+                *g->ctx, "specialization_call", function, body));
+        }
+
+        // Static allocas have to stay in the entry block so that they can
+        // still be promoted to registers.
+        std::vector<llvm::AllocaInst *> allocas;
+        for (llvm::BasicBlock::iterator inst = body->begin();
+             inst != body->end(); ++inst) {
+            llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(&*inst);
+            if (alloca != NULL && llvm::isa<llvm::Constant>(alloca->getArraySize()))
+                allocas.push_back(alloca);
+        }
+        for (unsigned int j = 0; j < allocas.size(); ++j) {
+            allocas[j]->removeFromParent();
+            checkBlocks[0]->getInstList().push_back(allocas[j]);
+        }
+
+        for (unsigned int j = 0; j < valueSets.size(); ++j) {
+            // Floating-point values are compared bitwise, so that e.g. a
+            // copy specialized for 0.0 isn't called with -0.0.
+            llvm::Value *match = NULL;
+            for (std::map<int, llvm::Constant *>::const_iterator iter =
+                     valueSets[j].begin(); iter != valueSets[j].end(); ++iter) {
+                llvm::Value *arg = args[iter->first];
+                llvm::Constant *value = iter->second;
+                if (value->getType()->isFloatingPointTy()) {
+                    llvm::Type *intType = llvm::IntegerType::get(
+                        *g->ctx, value->getType()->getPrimitiveSizeInBits());
+                    arg = new llvm::BitCastInst(arg, intType, "arg_bits",
+                                                checkBlocks[j]);
+                    value = llvm::ConstantExpr::getBitCast(value, intType);
+                }
+                llvm::Value *equal =
+                    new llvm::ICmpInst(*checkBlocks[j], llvm::CmpInst::ICMP_EQ,
+                                       arg, value, "arg_matches");
+                match = (match == NULL) ? equal :
+                    llvm::BinaryOperator::CreateAnd(match, equal, "args_match",
+                                                    checkBlocks[j]);
             }
-            fclose(f);
+            llvm::BasicBlock *next =
+                (j + 1 < valueSets.size()) ? checkBlocks[j + 1] : body;
+            llvm::BranchInst::Create(callBlocks[j], next, match,
+                                     checkBlocks[j]);
+
+            llvm::CallInst *call =
+                llvm::CallInst::Create(clones[j], args, "", callBlocks[j]);
+            call->setCallingConv(clones[j]->getCallingConv());
+            if (function->getReturnType()->isVoidTy())
+                llvm::ReturnInst::Create(*g->ctx, callBlocks[j]);
+            else
+                llvm::ReturnInst::Create(*g->ctx, call, callBlocks[j]);
         }
+    }
+}
+
 
-        std::string buffer;
-        llvm::raw_string_ostream os(buffer);
-        execPreprocessor((filename != NULL) ? filename : "-", &os);
-        YY_BUFFER_STATE strbuf = yy_scan_string(os.str().c_str());
+int
+Module::CompileFile() {
+    if (!stdlibDefined)
+        defineStdlib();
+
+    bool runPreprocessor = g->runCPP;
+
+    if (runPreprocessor) {
+        const std::string *source = getPreprocessedSource();
+        if (source == NULL)
+            return 1;
+
+        TimeTraceScope traceParse("Parse", filename != NULL ? filename : "<stdin>");
+        YY_BUFFER_STATE strbuf = yy_scan_string(source->c_str());
+        yyparse();
+        yy_delete_buffer(strbuf);
+    }
+    else if (sourceText != NULL) {
+        // No preprocessor, but we've been given the source code itself
+        TimeTraceScope traceParse("Parse", filename != NULL ? filename : "<source>");
+        YY_BUFFER_STATE strbuf = yy_scan_string(sourceText);
         yyparse();
         yy_delete_buffer(strbuf);
     }
@@ -529,6 +815,7 @@ Module::CompileFile() {
                 return 1;
             }
         }
+        TimeTraceScope traceParse("Parse", filename != NULL ? filename : "<stdin>");
         yyin = f;
         yy_switch_to_buffer(yy_create_buffer(yyin, 4096));
         yyparse();
@@ -541,17 +828,57 @@ Module::CompileFile() {
             f.addFnAttr("no-frame-pointer-elim", "true");
 #endif
 
-    ast->GenerateIR();
+    {
+        TimeTraceScope traceIR("GenerateIR");
+        ast->GenerateIR();
+    }
+
+    if (errorCount == 0 && g->specializations.size() > 0) {
+        TimeTraceScope traceSpecialize("Specialize");
+        lSpecializeExportedFunctions(symbolTable);
+    }
+
+    if (errorCount == 0) {
+        TimeTraceScope traceLink("LinkBuiltins");
+        LinkNeededBuiltins(module);
+    }
 
     if (diBuilder)
         diBuilder->finalize();
-    if (errorCount == 0)
+    if (errorCount == 0 && numFunctionPartitions <= 1) {
+        TimeTraceScope traceOptimize("Optimize");
         Optimize(module, g->opt.level);
+    }
 
     return errorCount;
 }
 
 
+const std::string *
+Module::getPreprocessedSource() {
+    if (havePreprocessedSource)
+        return &preprocessedSource;
+
+    if (filename != NULL && sourceText == NULL) {
+        // Try to open the file first, since otherwise we crash in the
+        // preprocessor if the file doesn't exist.
+        FILE *f = fopen(filename, "r");
+        if (!f) {
+            perror(filename);
+            return NULL;
+        }
+        fclose(f);
+    }
+
+    TimeTraceScope tracePreprocess("Preprocess", filename != NULL ? filename : "<stdin>");
+    llvm::raw_string_ostream os(preprocessedSource);
+    execPreprocessor((filename != NULL) ? filename : "-", &os);
+    os.flush();
+    havePreprocessedSource = true;
+    return &preprocessedSource;
+}
+
+
 void
 Module::AddTypeDef(const std::string &name, const Type *type,
                    SourcePos pos) {
@@ -1181,6 +1508,8 @@ Module::AddFunctionDeclaration(const std::string &name,
     // symbol table
     Symbol *funSym = new Symbol(name, pos, functionType, storageClass);
     funSym->function = function;
+    // Until defineStdlib() returns, everything that's parsed is stdlib.ispc.
+    funSym->isStdlib = !stdlibDefined;
     bool ok = symbolTable->AddFunction(funSym);
     Assert(ok);
 }
@@ -1506,6 +1835,22 @@ Module::writeBitcode(llvm::Module *module, const char *outFileName) {
 
 bool
 Module::writeObjectFileOrAssembly(OutputType outputType, const char *outFileName) {
+    if (numFunctionPartitions > 1) {
+        Assert(outputType == Object);
+        if (writePartitionedObjectFile(outFileName, numFunctionPartitions, true))
+            return true;
+
+        // Partitioning wasn't possible; optimize and compile the whole
+        // module here after all.
+        numFunctionPartitions = 1;
+        TimeTraceScope traceOptimize("Optimize");
+        Optimize(module, g->opt.level);
+    }
+    else if (outputType == Object && g->numCodegenPartitions > 1 &&
+             strcmp(outFileName, "-") != 0 &&
+             writePartitionedObjectFile(outFileName, g->numCodegenPartitions, false))
+        return true;
+
     llvm::TargetMachine *targetMachine = g->target->GetTargetMachine();
     return writeObjectFileOrAssembly(targetMachine, module, outputType,
                                      outFileName);
@@ -1516,6 +1861,8 @@ bool
 Module::writeObjectFileOrAssembly(llvm::TargetMachine *targetMachine,
                                   llvm::Module *module, OutputType outputType,
                                   const char *outFileName) {
+    TimeTraceScope traceBackend("Backend", outFileName);
+
     // Figure out if we're generating object file or assembly output, and
     // set binary output for object files
     llvm::TargetMachine::CodeGenFileType fileType = (outputType == Object) ?
@@ -1604,6 +1951,314 @@ Module::writeObjectFileOrAssembly(llvm::TargetMachine *targetMachine,
 }
 
 
+#ifndef ISPC_IS_WINDOWS
+/** Links the given relocatable object files into a single relocatable
+    object file with "ld -r". */
+static bool
+lLinkRelocatableObjects(const std::vector<std::string> &inputs,
+                        const char *outFileName) {
+    std::vector<const char *> args;
+    args.push_back("ld");
+    args.push_back("-r");
+    args.push_back("-o");
+    args.push_back(outFileName);
+    for (unsigned int i = 0; i < inputs.size(); ++i)
+        args.push_back(inputs[i].c_str());
+    args.push_back(NULL);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    else if (pid == 0) {
+        execvp(args[0], (char * const *)&args[0]);
+        perror("ld");
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+/** Adds the non-constant internal global variables that the given value
+    refers to (possibly via constant expressions) to the given set, and
+    the internal functions that it refers to to the given worklist. */
+static void
+lFindInternalStateRefs(llvm::Value *value,
+                       std::set<llvm::Value *> *seen,
+                       std::set<llvm::GlobalVariable *> *state,
+                       std::vector<llvm::Function *> *worklist) {
+    if (!seen->insert(value).second)
+        return;
+
+    if (llvm::GlobalVariable *gv = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+        if (gv->hasLocalLinkage() && !gv->isConstant())
+            state->insert(gv);
+    }
+    else if (llvm::Function *func = llvm::dyn_cast<llvm::Function>(value)) {
+        if (func->hasLocalLinkage() && !func->isDeclaration())
+            worklist->push_back(func);
+    }
+    else if (llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(value)) {
+        for (unsigned int i = 0; i < c->getNumOperands(); ++i)
+            lFindInternalStateRefs(c->getOperand(i), seen, state, worklist);
+    }
+}
+
+
+/** Assigns each of the functions that are defined with non-local linkage
+    in the module to one of numPartitions partitions, trying to balance
+    the amount of code in each one.  Every partition gets its own copy of
+    internal functions and variables, so functions that access the same
+    non-constant internal variable (directly or through internal functions
+    that they call) have to be kept together; those functions are added
+    to statefulFunctions.  The result only depends on the module's
+    contents, so the generated code is deterministic.  Returns false if
+    the module can't usefully be partitioned. */
+static bool
+lPartitionFunctions(llvm::Module *module, int numPartitions,
+                    std::map<llvm::Function *, int> *partitions,
+                    std::set<llvm::Function *> *statefulFunctions) {
+    // Variables with appending linkage (llvm.global_ctors and the like)
+    // can't be split between objects.
+    for (llvm::Module::global_iterator iter = module->global_begin();
+         iter != module->global_end(); ++iter)
+        if (iter->hasAppendingLinkage())
+            return false;
+
+    std::vector<llvm::Function *> roots;
+    std::vector<int> clusterOf, size;
+    std::map<llvm::GlobalVariable *, int> stateOwner;
+    for (llvm::Module::iterator iter = module->begin(); iter != module->end();
+         ++iter) {
+        llvm::Function *func = &*iter;
+        if (func->isDeclaration() || func->hasLocalLinkage())
+            continue;
+
+        int index = (int)roots.size();
+        roots.push_back(func);
+        clusterOf.push_back(index);
+
+        // Find the internal state that the function may access, and the
+        // amount of code it (and the internal functions it calls) has.
+        std::set<llvm::Value *> seen;
+        std::set<llvm::GlobalVariable *> state;
+        std::vector<llvm::Function *> worklist;
+        worklist.push_back(func);
+        int count = 0;
+        while (!worklist.empty()) {
+            llvm::Function *f = worklist.back();
+            worklist.pop_back();
+            for (llvm::Function::iterator bb = f->begin(); bb != f->end(); ++bb)
+                for (llvm::BasicBlock::iterator inst = bb->begin();
+                     inst != bb->end(); ++inst) {
+                    ++count;
+                    for (unsigned int i = 0; i < inst->getNumOperands(); ++i)
+                        if (llvm::isa<llvm::Constant>(inst->getOperand(i)))
+                            lFindInternalStateRefs(inst->getOperand(i), &seen,
+                                                   &state, &worklist);
+                }
+        }
+        size.push_back(count);
+        if (!state.empty())
+            statefulFunctions->insert(func);
+
+        // Merge this function's cluster with those of the other functions
+        // that share state with it.
+        for (std::set<llvm::GlobalVariable *>::iterator siter = state.begin();
+             siter != state.end(); ++siter) {
+            std::map<llvm::GlobalVariable *, int>::iterator owner =
+                stateOwner.find(*siter);
+            if (owner == stateOwner.end()) {
+                stateOwner[*siter] = index;
+                continue;
+            }
+            int a = owner->second, b = index;
+            while (clusterOf[a] != a)
+                a = clusterOf[a];
+            while (clusterOf[b] != b)
+                b = clusterOf[b];
+            clusterOf[std::max(a, b)] = std::min(a, b);
+        }
+    }
+
+    // Gather the clusters, in order of their first function.
+    std::vector<int> clusterIndex(roots.size(), -1);
+    std::vector<std::vector<int> > clusters;
+    std::vector<int> clusterSize;
+    for (unsigned int i = 0; i < roots.size(); ++i) {
+        int root = i;
+        while (clusterOf[root] != root)
+            root = clusterOf[root];
+        if (clusterIndex[root] == -1) {
+            clusterIndex[root] = (int)clusters.size();
+            clusters.push_back(std::vector<int>());
+            clusterSize.push_back(0);
+        }
+        clusters[clusterIndex[root]].push_back(i);
+        clusterSize[clusterIndex[root]] += size[i];
+    }
+    if (clusters.size() < 2)
+        return false;
+
+    // Greedily assign the clusters, largest first, to the partition with
+    // the least code so far.
+    std::vector<std::pair<int, int> > order;
+    for (unsigned int i = 0; i < clusters.size(); ++i)
+        order.push_back(std::make_pair(-clusterSize[i], (int)i));
+    std::sort(order.begin(), order.end());
+
+    std::vector<int> partitionSize(numPartitions, 0);
+    for (unsigned int i = 0; i < order.size(); ++i) {
+        int cluster = order[i].second;
+        int target = (int)(std::min_element(partitionSize.begin(),
+                                            partitionSize.end()) -
+                           partitionSize.begin());
+        partitionSize[target] += clusterSize[cluster];
+        for (unsigned int j = 0; j < clusters[cluster].size(); ++j)
+            (*partitions)[roots[clusters[cluster][j]]] = target;
+    }
+    return true;
+}
+
+
+/** Turns the module into the given partition.  If keepDefinitions is
+    true, the definitions of the functions assigned to other partitions
+    are kept, so that they can still be inlined, but aren't emitted;
+    otherwise they're turned into declarations.  The functions that
+    access internal state are always turned into declarations, since
+    inlining one would access this partition's copy of the state rather
+    than the one of the partition that it's assigned to.  Global variables
+    are defined in partition zero and declared in the others. */
+static void
+lExtractPartition(llvm::Module *module,
+                  const std::map<llvm::Function *, int> &partitions,
+                  const std::set<llvm::Function *> &statefulFunctions,
+                  int partition, bool keepDefinitions) {
+    for (std::map<llvm::Function *, int>::const_iterator iter = partitions.begin();
+         iter != partitions.end(); ++iter) {
+        if (iter->second == partition)
+            continue;
+        if (keepDefinitions && statefulFunctions.find(iter->first) ==
+            statefulFunctions.end())
+            iter->first->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        else
+            iter->first->deleteBody();
+    }
+
+    if (partition == 0)
+        return;
+    for (llvm::Module::global_iterator iter = module->global_begin();
+         iter != module->global_end(); ++iter) {
+        llvm::GlobalVariable *gv = &*iter;
+        if (gv->isDeclaration() || gv->hasLocalLinkage())
+            continue;
+        if (gv->isConstant())
+            gv->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        else {
+            gv->setInitializer(NULL);
+            gv->setLinkage(llvm::GlobalValue::ExternalLinkage);
+        }
+    }
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+/** Generates the object file for the module by splitting its functions
+    into numPartitions partitions, each of which is compiled (and first
+    optimized, if optimize is true) in a child process, and then linking
+    the resulting objects together.  The front-end's global state means
+    that this can't be done with threads, but each child gets a private
+    copy-on-write copy of it.  Returns false, leaving the module untouched,
+    if this isn't possible, in which case the caller should compile the
+    whole module itself. */
+bool
+Module::writePartitionedObjectFile(const char *outFileName, int numPartitions,
+                                   bool optimize) {
+#ifdef ISPC_IS_WINDOWS
+    return false;
+#else
+    std::map<llvm::Function *, int> partitions;
+    std::set<llvm::Function *> statefulFunctions;
+    if (!lPartitionFunctions(module, numPartitions, &partitions,
+                             &statefulFunctions))
+        return false;
+
+    TimeTraceScope tracePartitions("Partitioned Compile", outFileName);
+    std::vector<std::string> objFileNames;
+    std::vector<pid_t> children;
+    bool ok = true;
+    for (int i = 0; i < numPartitions; ++i) {
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), ".part%d.%d.o", i, (int)getpid());
+        objFileNames.push_back(std::string(outFileName) + suffix);
+
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            ok = false;
+            objFileNames.pop_back();
+            break;
+        }
+        else if (pid == 0) {
+            TimeTraceChildBegin();
+            lExtractPartition(module, partitions, statefulFunctions, i,
+                              optimize);
+            if (optimize)
+                Optimize(module, g->opt.level);
+            else {
+                // Get rid of the internal functions and variables that
+                // only the other partitions' functions used.
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_6
+                llvm::PassManager pm;
+#else // LLVM 3.7+
+                llvm::legacy::PassManager pm;
+#endif
+                pm.add(llvm::createGlobalDCEPass());
+                pm.run(*module);
+            }
+            bool written = writeObjectFileOrAssembly(g->target->GetTargetMachine(),
+                                                     module, Object,
+                                                     objFileNames.back().c_str());
+            TimeTraceChildEnd();
+            fflush(stdout);
+            fflush(stderr);
+            _exit(written ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+
+    for (unsigned int i = 0; i < children.size(); ++i) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(children[i], &status, 0)) < 0 && errno == EINTR)
+            ;
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+        if (pid > 0)
+            TimeTraceMergeChild(pid);
+    }
+
+    if (ok)
+        ok = lLinkRelocatableObjects(objFileNames, outFileName);
+
+    for (unsigned int i = 0; i < objFileNames.size(); ++i)
+        remove(objFileNames[i].c_str());
+    if (!ok)
+        Warning(SourcePos(), "Unable to compile \"%s\" in %d partitions; "
+                "compiling it as a whole instead.", outFileName,
+                numPartitions);
+    return ok;
+#endif // ISPC_IS_WINDOWS
+}
+
+
 /** Given a pointer to an element of a structure, see if it is a struct
     type or an array of a struct type.  If so, return a pointer to the
     underlying struct type. */
@@ -1970,15 +2625,15 @@ lUnescapeStringInPlace(std::string& str) {
       if (*it == '\\' && next != str.end()) {
         switch (*next) {
 #define UNESCAPE_SEQ(c, esc)  case c: *it = esc; str.erase(next); it = str.begin() + pos; break
-        UNESCAPE_SEQ('\'', '\'');
-        UNESCAPE_SEQ('?', '?');
-        UNESCAPE_SEQ('\\', '\\');
-        UNESCAPE_SEQ('a', '\a');
-        UNESCAPE_SEQ('b', '\b');
-        UNESCAPE_SEQ('f', '\f');
-        UNESCAPE_SEQ('n', '\n');
-        UNESCAPE_SEQ('r', '\r');
-        UNESCAPE_SEQ('t', '\t');
+        UNESCAPE_SEQ('\'', '\'');
+        UNESCAPE_SEQ('?', '?');
+        UNESCAPE_SEQ('\\', '\\');
+        UNESCAPE_SEQ('a', '\a');
+        UNESCAPE_SEQ('b', '\b');
+        UNESCAPE_SEQ('f', '\f');
+        UNESCAPE_SEQ('n', '\n');
+        UNESCAPE_SEQ('r', '\r');
+        UNESCAPE_SEQ('t', '\t');
         UNESCAPE_SEQ('v', '\v');
 #undef UNESCAPE_SEQ
         }
@@ -2319,6 +2974,7 @@ Module::writeHostStub(const char *fn)
 
 bool
 Module::writeHeader(const char *fn) {
+    TimeTraceScope traceHeader("WriteHeader", fn);
     FILE *f = fopen(fn, "w");
     if (!f) {
         perror("fopen");
@@ -2605,6 +3261,19 @@ Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostre
 #else // LLVM 5.0+
     clang::FrontendInputFile inputFile(infilename, clang::InputKind::Unknown);
 #endif
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_6 // LLVM 3.6+
+    // If we were given the source code, preprocess it from memory (the
+    // source manager doesn't take ownership of the buffer).
+    std::unique_ptr<llvm::MemoryBuffer> sourceBuffer;
+    if (sourceText != NULL) {
+        sourceBuffer = llvm::MemoryBuffer::getMemBuffer(sourceText, infilename);
+#if ISPC_LLVM_VERSION < ISPC_LLVM_5_0
+        inputFile = clang::FrontendInputFile(sourceBuffer.get(), clang::IK_None);
+#else // LLVM 5.0+
+        inputFile = clang::FrontendInputFile(sourceBuffer.get(), clang::InputKind::Unknown);
+#endif
+    }
+#endif // LLVM 3.6+
     inst.InitializeSourceManager(inputFile);
 
     // Don't remove comments in the preprocessor, so that we can accurately
@@ -2773,6 +3442,68 @@ lExtractTargets(const char *target) {
 }
 
 
+#ifndef ISPC_IS_WINDOWS
+// Wait for child processes started by lStartTargetJob() to finish until
+// at most maxRunning of them are still running.  Returns the number of
+// children that exited with an error.
+static int
+lWaitForTargetJobs(std::vector<pid_t> &jobs, unsigned int maxRunning) {
+    int failures = 0;
+    while (jobs.size() > maxRunning) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
+            failures += (int)jobs.size();
+            jobs.clear();
+            break;
+        }
+        std::vector<pid_t>::iterator iter =
+            std::find(jobs.begin(), jobs.end(), pid);
+        if (iter == jobs.end())
+            continue;
+        jobs.erase(iter);
+        TimeTraceMergeChild(pid);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ++failures;
+    }
+    return failures;
+}
+
+
+// Generate the output file for the current target in a child process, so
+// that code generation for it overlaps with compiling the following
+// targets.  The child gets a copy-on-write snapshot of the compiler's
+// state, so the (global) Module and Target don't need to be made thread
+// safe.  Returns false if a child couldn't be started, in which case the
+// caller should write the output itself.
+static bool
+lStartTargetJob(std::vector<pid_t> &jobs, int *failures, Module::OutputType type,
+                Module::OutputFlags flags, const char *outFileName,
+                const char *includeFileName) {
+    *failures += lWaitForTargetJobs(jobs, g->numJobs - 1);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    else if (pid == 0) {
+        TimeTraceChildBegin();
+        bool ok = m->writeOutput(type, flags, outFileName, includeFileName);
+        TimeTraceChildEnd();
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ok ? 0 : 1);
+    }
+    jobs.push_back(pid);
+    return true;
+}
+#endif // !ISPC_IS_WINDOWS
+
+
 static bool
 lSymbolIsExported(const Symbol *s) {
     return s->exportedFunction != NULL;
@@ -3167,6 +3898,463 @@ static std::string lCBEMangle(const std::string &S)
 }
 #endif /* ISPC_NVPTX_ENABLED */
 
+
+///////////////////////////////////////////////////////////////////////////
+// Compilation cache
+//
+// When a cache directory is given with --cache-dir, the outputs of
+// single-target compilations are saved there, keyed by a hash of the
+// preprocessed source and of all the settings that affect the generated
+// code.  Compiling the same thing again then just copies the saved files,
+// without parsing the program or running LLVM.  An entry <key> consists of
+// <key>.out (the object/assembly/bitcode/C++ output), <key>.h (the header)
+// and <key>.deps (the files the source depends on, one per line); the
+// .deps file is written last and marks the entry as complete.  <key>.diag
+// holds the warnings the compilation printed, which are printed again when
+// the entry is used.  The "stats" file holds the hit and miss counts.
+
+// Reads the hit and miss counts from the cache's statistics file; both
+// are zero if it isn't there yet.
+static void
+lCacheReadStatistics(int *hits, int *misses) {
+    *hits = *misses = 0;
+    FILE *f = fopen((g->cacheDir + "/stats").c_str(), "r");
+    if (f == NULL)
+        return;
+    if (fscanf(f, "%d %d", hits, misses) != 2)
+        *hits = *misses = 0;
+    fclose(f);
+}
+
+
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_4 // LLVM 3.4+
+static void
+lCacheHash(llvm::MD5 &hash, const std::string &str) {
+    // Include the terminating NUL so that consecutive strings can't run
+    // together.
+    hash.update(llvm::StringRef(str.c_str(), str.size() + 1));
+}
+
+
+static void
+lCacheHash(llvm::MD5 &hash, const char *str) {
+    lCacheHash(hash, std::string(str != NULL ? str : ""));
+}
+
+
+static void
+lCacheHash(llvm::MD5 &hash, int value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", value);
+    lCacheHash(hash, buf);
+}
+
+
+static std::string
+lGetCacheKey(const std::string &source, const char *srcFile, const char *arch,
+             const char *cpu, const char *target, Module::OutputType outputType,
+             Module::OutputFlags outputFlags, const char *headerFileName,
+             const char *includeFileName) {
+    llvm::MD5 hash;
+
+    // The compiler itself
+    lCacheHash(hash, ISPC_VERSION);
+#if defined(BUILD_VERSION) && defined(BUILD_DATE)
+    lCacheHash(hash, BUILD_VERSION);
+    lCacheHash(hash, BUILD_DATE);
+#else
+    lCacheHash(hash, __DATE__);
+    lCacheHash(hash, __TIME__);
+#endif
+    lCacheHash(hash, ISPC_LLVM_VERSION);
+
+    // What's being compiled
+    lCacheHash(hash, source);
+    lCacheHash(hash, srcFile);
+
+    // How it's being compiled
+    lCacheHash(hash, arch);
+    lCacheHash(hash, cpu);
+    lCacheHash(hash, target);
+    lCacheHash(hash, g->target->GetTripleString());
+    lCacheHash(hash, g->target->GetISATargetString());
+    lCacheHash(hash, g->target->getCPU());
+
+    lCacheHash(hash, g->opt.level);
+    lCacheHash(hash, g->opt.fastMath);
+    lCacheHash(hash, g->opt.fastMaskedVload);
+    lCacheHash(hash, g->opt.unrollLoops);
+    lCacheHash(hash, g->opt.force32BitAddressing);
+    lCacheHash(hash, g->opt.disableAsserts);
+    lCacheHash(hash, g->opt.disableFMA);
+    lCacheHash(hash, g->opt.forceAlignedMemory);
+    lCacheHash(hash, g->opt.disableMaskAllOnOptimizations);
+    lCacheHash(hash, g->opt.disableHandlePseudoMemoryOps);
+    lCacheHash(hash, g->opt.disableBlendedMaskedStores);
+    lCacheHash(hash, g->opt.disableCoherentControlFlow);
+    lCacheHash(hash, g->opt.disableUniformControlFlow);
+    lCacheHash(hash, g->opt.disableGatherScatterOptimizations);
+    lCacheHash(hash, g->opt.disableMaskedStoreToStore);
+    lCacheHash(hash, g->opt.disableGatherScatterFlattening);
+    lCacheHash(hash, g->opt.disableUniformMemoryOptimizations);
+    lCacheHash(hash, g->opt.disableCoalescing);
+    lCacheHash(hash, g->opt.disableUniformScalarization);
+
+    // Warnings aren't replayed when there's a cache hit, so a compile
+    // with --werror can't reuse a result from one without it, which may
+    // have had warnings.
+    lCacheHash(hash, g->warningsAsErrors);
+    lCacheHash(hash, (int)g->mathLib);
+    lCacheHash(hash, g->includeStdlib);
+    lCacheHash(hash, g->NoOmitFramePointer);
+    lCacheHash(hash, g->emitInstrumentation);
+    lCacheHash(hash, g->generateDebuggingSymbols);
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_5
+    lCacheHash(hash, g->generateDWARFVersion);
+#endif
+    if (g->generateDebuggingSymbols)
+        lCacheHash(hash, g->currentDirectory);
+    lCacheHash(hash, g->forceAlignment);
+    lCacheHash(hash, g->dllExport);
+    lCacheHash(hash, g->numFunctionPartitions);
+    lCacheHash(hash, g->numCodegenPartitions);
+    for (unsigned int i = 0; i < g->specializations.size(); ++i)
+        lCacheHash(hash, g->specializations[i]);
+    for (std::set<int>::const_iterator iter = g->off_stages.begin();
+         iter != g->off_stages.end(); ++iter)
+        lCacheHash(hash, *iter);
+
+    // What's being generated
+    lCacheHash(hash, (int)outputType);
+    lCacheHash(hash, (int)(outputFlags & Module::GeneratePIC));
+    lCacheHash(hash, headerFileName);
+    lCacheHash(hash, includeFileName);
+
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    llvm::SmallString<32> key;
+    llvm::MD5::stringifyResult(result, key);
+    return key.str().str();
+}
+
+
+static std::string
+lCacheFileName(const std::string &key, const char *suffix) {
+    return g->cacheDir + "/" + key + suffix;
+}
+
+
+// Copy the contents of one file to another; the destination may be "-" to
+// write to stdout.
+static bool
+lCopyFile(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    if (in == NULL)
+        return false;
+    bool toStdout = (strcmp(to, "-") == 0);
+    FILE *out = toStdout ? stdout : fopen(to, "wb");
+    if (out == NULL) {
+        perror(to);
+        fclose(in);
+        return false;
+    }
+
+    bool ok = true;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (fwrite(buf, 1, n, out) != n) {
+            ok = false;
+            break;
+        }
+    ok = ok && !ferror(in);
+
+    fclose(in);
+    if (toStdout)
+        ok = (fflush(out) == 0) && ok;
+    else
+        ok = (fclose(out) == 0) && ok;
+    return ok;
+}
+
+
+static bool
+lFileExists(const std::string &fn) {
+    struct stat st;
+    return stat(fn.c_str(), &st) == 0;
+}
+
+
+// Copy a file into the cache; it's written under a temporary name first
+// so that concurrent compilations never see a partially-written entry.
+static std::string
+lCacheTempFileName(const std::string &fn) {
+    char suffix[32];
+#ifdef ISPC_IS_WINDOWS
+    snprintf(suffix, sizeof(suffix), ".tmp%d", (int)_getpid());
+#else
+    snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+#endif
+    return fn + suffix;
+}
+
+
+static bool
+lCacheStoreFile(const char *from, const std::string &to) {
+    std::string tmp = lCacheTempFileName(to);
+    if (!lCopyFile(from, tmp.c_str())) {
+        remove(tmp.c_str());
+        return false;
+    }
+#ifdef ISPC_IS_WINDOWS
+    // rename() doesn't replace existing files on Windows.
+    remove(to.c_str());
+#endif
+    if (rename(tmp.c_str(), to.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Counts a cache hit or miss.  The statistics file is replaced with a
+// rename, like the cache entries are, so that readers never see it half
+// written; a count may be lost if two compiles update it at once.
+static void
+lCacheRecordStatistic(bool hit) {
+    int hits, misses;
+    lCacheReadStatistics(&hits, &misses);
+    if (hit)
+        ++hits;
+    else
+        ++misses;
+
+    std::string statsFile = g->cacheDir + "/stats";
+    std::string tmp = lCacheTempFileName(statsFile);
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL)
+        return;
+    fprintf(f, "%d %d\n", hits, misses);
+    fclose(f);
+#ifdef ISPC_IS_WINDOWS
+    // rename() doesn't replace existing files on Windows.
+    remove(statsFile.c_str());
+#endif
+    if (rename(tmp.c_str(), statsFile.c_str()) != 0)
+        remove(tmp.c_str());
+}
+
+
+// Emit the outputs of a compilation from the cache entry with the given
+// key, if it's there.  On success, the dependencies of the original
+// compilation are registered so that they can be written out as usual.
+static bool
+lCacheLookup(const std::string &key, const char *outFileName,
+             const char *headerFileName) {
+    std::string depsFile = lCacheFileName(key, ".deps");
+    if (!lFileExists(depsFile) ||
+        (outFileName != NULL && !lFileExists(lCacheFileName(key, ".out"))) ||
+        (headerFileName != NULL && !lFileExists(lCacheFileName(key, ".h"))))
+        return false;
+
+    if (outFileName != NULL &&
+        !lCopyFile(lCacheFileName(key, ".out").c_str(), outFileName))
+        return false;
+    if (headerFileName != NULL &&
+        !lCopyFile(lCacheFileName(key, ".h").c_str(), headerFileName))
+        return false;
+
+    std::ifstream deps(depsFile.c_str());
+    if (!deps)
+        return false;
+    std::string line;
+    while (std::getline(deps, line))
+        if (!line.empty())
+            RegisterDependency(line);
+
+    std::ifstream diag(lCacheFileName(key, ".diag").c_str(),
+                       std::ios::in | std::ios::binary);
+    if (diag) {
+        std::string recorded((std::istreambuf_iterator<char>(diag)),
+                             std::istreambuf_iterator<char>());
+        DiagnosticsReplay(recorded);
+    }
+    return true;
+}
+
+
+static void
+lCacheStore(const std::string &key, const char *outFileName,
+            const char *headerFileName, const std::string &diagnostics) {
+#ifdef ISPC_IS_WINDOWS
+    _mkdir(g->cacheDir.c_str());
+#else
+    mkdir(g->cacheDir.c_str(), 0777);
+#endif
+
+    if (outFileName != NULL &&
+        !lCacheStoreFile(outFileName, lCacheFileName(key, ".out")))
+        return;
+    if (headerFileName != NULL &&
+        !lCacheStoreFile(headerFileName, lCacheFileName(key, ".h")))
+        return;
+
+    std::string diagFile = lCacheFileName(key, ".diag");
+    if (diagnostics.empty())
+        remove(diagFile.c_str());
+    else {
+        std::string tmp = lCacheTempFileName(diagFile + ".text");
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (f == NULL)
+            return;
+        bool written = fwrite(diagnostics.data(), 1, diagnostics.size(),
+                              f) == diagnostics.size();
+        fclose(f);
+        if (!written || !lCacheStoreFile(tmp.c_str(), diagFile)) {
+            remove(tmp.c_str());
+            return;
+        }
+        remove(tmp.c_str());
+    }
+
+    std::string depsFile = lCacheFileName(key, ".deps");
+    std::string tmp = lCacheTempFileName(depsFile + ".list");
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL)
+        return;
+    for (std::set<std::string>::const_iterator it = registeredDependencies.begin();
+         it != registeredDependencies.end(); ++it)
+        fprintf(f, "%s\n", it->c_str());
+    fclose(f);
+    if (!lCacheStoreFile(tmp.c_str(), depsFile))
+        Warning(SourcePos(), "Unable to write compilation cache entry \"%s\".",
+                depsFile.c_str());
+    remove(tmp.c_str());
+}
+#endif // LLVM 3.4+
+
+
+void
+Module::PrintCacheStatistics() {
+    if (g->cacheDir.empty()) {
+        fprintf(stderr, "No compilation cache directory specified.\n");
+        return;
+    }
+
+    int hits, misses;
+    lCacheReadStatistics(&hits, &misses);
+    printf("Compilation cache \"%s\": %d hits, %d misses\n",
+           g->cacheDir.c_str(), hits, misses);
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Compile server warm start
+//
+// A compile server (ispc --server) sets up a Module with the standard
+// library already parsed and its builtins linked in, along with the Target
+// and the LLVMContext they live in.  Each request is compiled in a process
+// forked from the server, so a request whose settings match the ones the
+// module was set up with can just pick it up and go straight to parsing
+// its own source.
+
+static Module *lWarmModule = NULL;
+static Target *lWarmTarget = NULL;
+static llvm::LLVMContext *lWarmContext = NULL;
+static std::string lWarmSettings;
+
+
+/** Returns a string describing all of the settings that affect the
+    Target and the definition of the standard library. */
+static std::string
+lWarmStartSettings(const char *arch, const char *cpu, const char *target,
+                   Module::OutputFlags outputFlags) {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "%s/%s/%s/%d/%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d/%d/%d/%d/%d/%d/%d/%d",
+             arch != NULL ? arch : "", cpu != NULL ? cpu : "",
+             target != NULL ? target : "",
+             (int)((outputFlags & Module::GeneratePIC) != 0),
+             g->opt.level, (int)g->opt.fastMath, (int)g->opt.fastMaskedVload,
+             (int)g->opt.unrollLoops, (int)g->opt.force32BitAddressing,
+             (int)g->opt.disableAsserts, (int)g->opt.disableFMA,
+             (int)g->opt.forceAlignedMemory,
+             (int)g->opt.disableMaskAllOnOptimizations,
+             (int)g->opt.disableHandlePseudoMemoryOps,
+             (int)g->opt.disableBlendedMaskedStores,
+             (int)g->opt.disableCoherentControlFlow,
+             (int)g->opt.disableUniformControlFlow,
+             (int)g->opt.disableGatherScatterOptimizations,
+             (int)g->opt.disableMaskedStoreToStore,
+             (int)g->opt.disableGatherScatterFlattening,
+             (int)g->opt.disableUniformMemoryOptimizations,
+             (int)g->opt.disableCoalescing,
+             (int)g->opt.disableUniformScalarization,
+             (int)g->mathLib, (int)g->includeStdlib, (int)g->NoOmitFramePointer,
+             (int)g->emitInstrumentation, g->forceAlignment,
+             (int)g->debugPrint, (int)g->dllExport);
+    return buf;
+}
+
+
+bool
+Module::PrepareWarmStart(const char *arch, const char *cpu,
+                         const char *target, OutputFlags outputFlags) {
+    if ((target != NULL && strchr(target, ',') != NULL) ||
+        g->generateDebuggingSymbols || g->printTarget || g->enableFuzzTest)
+        return false;
+
+    g->target = new Target(arch, cpu, target,
+                           0 != (outputFlags & GeneratePIC), false);
+    if (!g->target->isValid()) {
+        delete g->target;
+        g->target = NULL;
+        return false;
+    }
+
+    m = new Module(NULL);
+    m->defineStdlib();
+    if (m->errorCount > 0) {
+        delete m;
+        m = NULL;
+        g->target = NULL;
+        return false;
+    }
+
+    lWarmModule = m;
+    lWarmTarget = g->target;
+    lWarmContext = g->ctx;
+    lWarmSettings = lWarmStartSettings(arch, cpu, target, outputFlags);
+
+    // Requests set these up for themselves, starting from the above.
+    m = NULL;
+    g->target = NULL;
+    return true;
+}
+
+
+/** If a compile server set up a module for the given settings, makes it
+    (and its Target and LLVMContext) the current one for compiling srcFile
+    and returns true. */
+static bool
+lUseWarmStart(const char *srcFile, const char *arch, const char *cpu,
+              const char *target, Module::OutputFlags outputFlags) {
+    if (lWarmModule == NULL || g->generateDebuggingSymbols ||
+        g->printTarget || g->enableFuzzTest ||
+        lWarmStartSettings(arch, cpu, target, outputFlags) != lWarmSettings)
+        return false;
+
+    g->ctx = lWarmContext;
+    g->target = lWarmTarget;
+    m = lWarmModule;
+    lWarmModule = NULL;
+
+    m->setFilename(srcFile);
+    return true;
+}
+
+
 int
 Module::CompileAndOutput(const char *srcFile,
                          const char *arch,
@@ -3184,12 +4372,45 @@ Module::CompileAndOutput(const char *srcFile,
 {
     if (target == NULL || strchr(target, ',') == NULL) {
         // We're only compiling to a single target
-        g->target = new Target(arch, cpu, target, 0 != (outputFlags & GeneratePIC), g->printTarget);
-        if (!g->target->isValid())
-            return 1;
+        if (!lUseWarmStart(srcFile, arch, cpu, target, outputFlags)) {
+            g->target = new Target(arch, cpu, target, 0 != (outputFlags & GeneratePIC), g->printTarget);
+            if (!g->target->isValid())
+                return 1;
 
-        m = new Module(srcFile);
-        if (m->CompileFile() == 0) {
+            m = new Module(srcFile);
+        }
+#ifndef ISPC_IS_WINDOWS
+        if (outputType == Object && outFileName != NULL &&
+            strcmp(outFileName, "-") != 0)
+            m->numFunctionPartitions = g->numFunctionPartitions;
+#endif // !ISPC_IS_WINDOWS
+
+        // See if the outputs can be taken from the compilation cache.  Its
+        // key includes the preprocessed source, so the preprocessor has to
+        // run; CompileFile() reuses its output on a miss.
+        std::string cacheKey;
+        bool fromCache = false;
+#if ISPC_LLVM_VERSION >= ISPC_LLVM_3_4 // LLVM 3.4+
+        if (!g->cacheDir.empty() && g->runCPP && !g->enableFuzzTest &&
+            srcFile != NULL && strcmp(srcFile, "-") != 0 &&
+            (outFileName == NULL || strcmp(outFileName, "-") != 0) &&
+            hostStubFileName == NULL && devStubFileName == NULL) {
+            const std::string *source = m->getPreprocessedSource();
+            if (source != NULL) {
+                cacheKey = lGetCacheKey(*source, srcFile, arch, cpu, target,
+                                        outputType, outputFlags, headerFileName,
+                                        includeFileName);
+                fromCache = lCacheLookup(cacheKey, outFileName, headerFileName);
+                lCacheRecordStatistic(fromCache);
+                // Keep the warnings this compile prints so that they can
+                // be printed again when its cache entry is used.
+                if (!fromCache)
+                    DiagnosticsRecordBegin();
+            }
+        }
+#endif // LLVM 3.4+
+
+        if (fromCache || m->CompileFile() == 0) {
 #ifdef ISPC_NVPTX_ENABLED
             /* NVPTX:
              * for PTX target replace '.' with '_' in all global variables
@@ -3234,12 +4455,15 @@ Module::CompileAndOutput(const char *srcFile,
                 }
             }
 
-            if (outFileName != NULL)
+            if (outFileName != NULL && !fromCache)
                 if (!m->writeOutput(outputType, outputFlags, outFileName, includeFileName))
                     return 1;
-            if (headerFileName != NULL)
+            if (headerFileName != NULL && !fromCache)
                 if (!m->writeOutput(Module::Header, outputFlags, headerFileName))
                     return 1;
+            if (!cacheKey.empty() && !fromCache)
+                lCacheStore(cacheKey, outFileName, headerFileName,
+                            DiagnosticsRecordEnd());
             if (depsFileName != NULL || (outputFlags & Module::OutputDepsToStdout)) {
               std::string targetName;
               if (depsTargetName)
@@ -3267,6 +4491,7 @@ Module::CompileAndOutput(const char *srcFile,
         else
             ++m->errorCount;
 
+        DiscardLazyBuiltins(m->module);
         int errorCount = m->errorCount;
         delete m;
         m = NULL;
@@ -3341,7 +4566,14 @@ Module::CompileAndOutput(const char *srcFile,
         // It indicates if we have *-generic target.
         std::string treatGenericAsSmth = "";
 
+#ifndef ISPC_IS_WINDOWS
+        // Child processes that are generating code for targets that have
+        // already been through the front-end.
+        std::vector<pid_t> jobs;
+#endif // !ISPC_IS_WINDOWS
+
         for (unsigned int i = 0; i < targets.size(); ++i) {
+            TimeTraceScope traceTarget("Target", targets[i].c_str());
             g->target = new Target(arch, cpu, targets[i].c_str(), 0 != (outputFlags & GeneratePIC), g->printTarget);
             if (!g->target->isValid())
                 return 1;
@@ -3375,20 +4607,32 @@ Module::CompileAndOutput(const char *srcFile,
 
                 if (outFileName != NULL) {
                     std::string targetOutFileName;
+                    OutputType targetOutputType = outputType;
+                    const char *targetIncludeFileName = NULL;
                     // We always generate cpp file for *-generic target during multitarget compilation
                     if (g->target->getISA() == Target::GENERIC &&
                         !g->target->getTreatGenericAsSmth().empty()) {
                         targetOutFileName = lGetTargetFileName(outFileName,
                                                 g->target->getTreatGenericAsSmth().c_str(), true);
-                        if (!m->writeOutput(CXX, outputFlags, targetOutFileName.c_str(), includeFileName))
-                            return 1;
+                        targetOutputType = CXX;
+                        targetIncludeFileName = includeFileName;
                     }
                     else {
                         const char *isaName = g->target->GetISAString();
                         targetOutFileName = lGetTargetFileName(outFileName, isaName, false);
-                        if (!m->writeOutput(outputType, outputFlags, targetOutFileName.c_str()))
-                            return 1;
                     }
+
+                    bool started = false;
+#ifndef ISPC_IS_WINDOWS
+                    if (g->numJobs > 1)
+                        started = lStartTargetJob(jobs, &errorCount, targetOutputType,
+                                                  outputFlags, targetOutFileName.c_str(),
+                                                  targetIncludeFileName);
+#endif // !ISPC_IS_WINDOWS
+                    if (!started &&
+                        !m->writeOutput(targetOutputType, outputFlags,
+                                        targetOutFileName.c_str(), targetIncludeFileName))
+                        ++errorCount;
                 }
             } else {
               ++m->errorCount;
@@ -3396,6 +4640,9 @@ Module::CompileAndOutput(const char *srcFile,
 
             errorCount += m->errorCount;
             if (errorCount != 0) {
+#ifndef ISPC_IS_WINDOWS
+                lWaitForTargetJobs(jobs, 0);
+#endif // !ISPC_IS_WINDOWS
                 return 1;
             }
 
@@ -3427,6 +4674,7 @@ Module::CompileAndOutput(const char *srcFile,
               }
             }
 
+            DiscardLazyBuiltins(m->module);
             delete g->target;
             g->target = NULL;
 
@@ -3435,6 +4683,14 @@ Module::CompileAndOutput(const char *srcFile,
             // we generate the dispatch module's functions...
         }
 
+#ifndef ISPC_IS_WINDOWS
+        // Make sure that all of the per-target outputs were written
+        // successfully before emitting the dispatch module.
+        errorCount += lWaitForTargetJobs(jobs, 0);
+        if (errorCount != 0)
+            return 1;
+#endif // !ISPC_IS_WINDOWS
+
         // Find the first non-NULL target machine from the targets we
         // compiled to above.  We'll use this as the target machine for
         // compiling the dispatch module--this is safe in that it is the
@@ -3453,7 +4709,10 @@ Module::CompileAndOutput(const char *srcFile,
             return 1;
         }
 
-        lEmitDispatchModule(dispatchModule, exportedFunctions);
+        {
+            TimeTraceScope traceDispatch("EmitDispatchModule");
+            lEmitDispatchModule(dispatchModule, exportedFunctions);
+        }
 
         if (outFileName != NULL) {
             if (outputType == Bitcode)
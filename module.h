@@ -57,8 +57,9 @@ struct DispatchHeaderInfo;
 class Module {
 public:
     /** The name of the source file being compiled should be passed as the
-        module name. */
-    Module(const char *filename);
+        module name.  If source is non-NULL, it gives the program's source
+        code, and filename is only used to refer to it in messages. */
+    Module(const char *filename, const char *source = NULL);
 
     /** Compiles the source file passed to the Module constructor, adding
         its global variables and functions to both the llvm::Module and
@@ -155,6 +156,19 @@ public:
                                 const char *hostStubFileName,
                                 const char *devStubFileName);
 
+    /** Prints the number of hits and misses recorded in the compilation
+        cache directory given by Globals::cacheDir. */
+    static void PrintCacheStatistics();
+
+    /** Used by the compile server (ispc --server): sets up a module with
+        the standard library defined for the given target and the current
+        settings, which subsequent single-target compiles with the same
+        settings in processes forked from this one start from, rather
+        than setting everything up again.  Returns false if the settings
+        don't allow this. */
+    static bool PrepareWarmStart(const char *arch, const char *cpu,
+                                 const char *target, OutputFlags outputFlags);
+
     /** Total number of errors encountered during compilation. */
     int errorCount;
 
@@ -176,8 +190,23 @@ public:
 
 private:
     const char *filename;
+    const char *sourceText;
     AST *ast;
 
+    /** Output of the preprocessor for the source file, once it has been
+        run; see getPreprocessedSource(). */
+    std::string preprocessedSource;
+    bool havePreprocessedSource;
+
+    /** Indicates whether defineStdlib() has already been called. */
+    bool stdlibDefined;
+
+    /** If greater than one, CompileFile() leaves the module unoptimized,
+        and the object file is generated by optimizing and compiling this
+        many partitions of its functions in parallel; see
+        writePartitionedObjectFile(). */
+    int numFunctionPartitions;
+
     std::vector<std::pair<const Type *, SourcePos> > exportedTypes;
 
     /** Write the corresponding output type to the given file.  Returns
@@ -197,9 +226,23 @@ private:
     static bool writeObjectFileOrAssembly(llvm::TargetMachine *targetMachine,
                                           llvm::Module *module, OutputType outputType,
                                           const char *outFileName);
+    bool writePartitionedObjectFile(const char *outFileName, int numPartitions,
+                                    bool optimize);
     static bool writeBitcode(llvm::Module *module, const char *outFileName);
 
     void execPreprocessor(const char *infilename, llvm::raw_string_ostream* ostream) const;
+
+    /** Runs the preprocessor over the module's source file, if that
+        hasn't been done already, and returns its output.  Returns NULL
+        if the source file can't be opened. */
+    const std::string *getPreprocessedSource();
+
+    /** Initializes the parser and defines the standard library symbols
+        and builtins in the module. */
+    void defineStdlib();
+
+    /** Changes the name of the source file that the module is for. */
+    void setFilename(const char *filename);
 };
 
 inline Module::OutputFlags& operator|=(Module::OutputFlags& lhs, const __underlying_type(Module::OutputFlags) rhs) {
@@ -42,6 +42,7 @@
 #include "module.h"
 #include "util.h"
 #include "llvmutil.h"
+#include "builtins.h"
 
 #include <stdio.h>
 #include <map>
@@ -83,11 +84,13 @@
     #include <llvm/IR/IRPrintingPasses.h>
     #include <llvm/IR/PatternMatch.h>
     #include <llvm/IR/DebugInfo.h>
+    #include <llvm/IR/CFG.h>
 #else // < 3.5
     #include <llvm/Analysis/Verifier.h>
     #include <llvm/Assembly/PrintModulePass.h>
     #include <llvm/Support/PatternMatch.h>
     #include <llvm/DebugInfo.h>
+    #include <llvm/Support/CFG.h>
 #endif
 #include <llvm/Analysis/ConstantFolding.h>
 #if ISPC_LLVM_VERSION <= ISPC_LLVM_3_6
@@ -150,14 +153,17 @@ static llvm::Pass *CreateIntrinsicsOptPass();
 static llvm::Pass *CreateInstructionSimplifyPass();
 static llvm::Pass *CreatePeepholePass();
 
-static llvm::Pass *CreateImproveMemoryOpsPass();
+static llvm::Pass *CreateImproveMemoryOpsPass(bool lowerStrided = false);
 static llvm::Pass *CreateGatherCoalescePass();
+static llvm::Pass *CreateScatterCoalescePass();
+static llvm::Pass *CreateScalarizeUniformPass();
 static llvm::Pass *CreateReplacePseudoMemoryOpsPass();
 
 static llvm::Pass *CreateIsCompileTimeConstantPass(bool isLastTry);
 static llvm::Pass *CreateMakeInternalFuncsStaticPass();
 
 static llvm::Pass *CreateDebugPass(char * output);
+static llvm::Pass *CreateTimeTraceMarkerPass(llvm::Pass *tracedPass, bool begin);
 
 static llvm::Pass *CreateReplaceStdlibShiftPass();
 
@@ -506,8 +512,19 @@ DebugPassManager::add(llvm::Pass * P, int stage = -1) {
         number = stage;
     }
     if (g->off_stages.find(number) == g->off_stages.end()) {
-        // adding optimization (not switched off)
+        // adding optimization (not switched off), bracketed by markers
+        // that record the time spent in it if --time-trace is in effect
+        llvm::Pass *traceEnd = NULL;
+        if (TimeTraceEnabled()) {
+            llvm::Pass *traceBegin = CreateTimeTraceMarkerPass(P, true);
+            if (traceBegin != NULL) {
+                PM.add(traceBegin);
+                traceEnd = CreateTimeTraceMarkerPass(P, false);
+            }
+        }
         PM.add(P);
+        if (traceEnd != NULL)
+            PM.add(traceEnd);
         if (g->debug_stages.find(number) != g->debug_stages.end()) {
             // adding dump of LLVM IR after optimization
             char buf[100];
@@ -737,6 +754,7 @@ Optimize(llvm::Module *module, int optLevel) {
                 // finding matching gathers we can coalesce..
                 optPM.add(llvm::createEarlyCSEPass(), 260);
                 optPM.add(CreateGatherCoalescePass());
+                optPM.add(CreateScatterCoalescePass());
             }
         }
 
@@ -748,7 +766,7 @@ Optimize(llvm::Module *module, int optLevel) {
         if (g->opt.disableGatherScatterOptimizations == false &&
             g->target->getVectorWidth() > 1) {
             optPM.add(llvm::createInstructionCombiningPass(), 270);
-            optPM.add(CreateImproveMemoryOpsPass());
+            optPM.add(CreateImproveMemoryOpsPass(true));
         }
 
         optPM.add(llvm::createIPSCCPPass(), 275);
@@ -770,6 +788,10 @@ Optimize(llvm::Module *module, int optLevel) {
 #else
         optPM.add(llvm::createSROAPass());
 #endif
+        if (g->opt.disableUniformScalarization == false &&
+            g->target->getVectorWidth() > 1) {
+            optPM.add(CreateScalarizeUniformPass());
+        }
         optPM.add(llvm::createInstructionCombiningPass());
         optPM.add(CreateInstructionSimplifyPass());
         optPM.add(llvm::createCFGSimplificationPass());
@@ -930,6 +952,11 @@ Optimize(llvm::Module *module, int optLevel) {
     optPM.add(llvm::createVerifierPass(), LAST_OPT_NUMBER);
     optPM.run(*module);
 
+    // In case the optimizations introduced calls to builtins that weren't
+    // used before (and aren't kept alive by __keep_funcs_live), make sure
+    // that their definitions are there.
+    LinkNeededBuiltins(module);
+
     if (g->debugPrint) {
         printf("\n*****\nFINAL OUTPUT\n*****\n");
         module->dump();
@@ -1445,7 +1472,9 @@ CreateInstructionSimplifyPass() {
 class ImproveMemoryOpsPass : public llvm::BasicBlockPass {
 public:
     static char ID;
-    ImproveMemoryOpsPass() : BasicBlockPass(ID) { }
+    ImproveMemoryOpsPass(bool strided = false) : BasicBlockPass(ID) {
+        lowerStrided = strided;
+    }
 
 #if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
     const char *getPassName() const { return "Improve Memory Ops"; }
@@ -1453,6 +1482,13 @@ public:
     llvm::StringRef getPassName() const { return "Improve Memory Ops"; }
 #endif
     bool runOnBasicBlock(llvm::BasicBlock &BB);
+
+    /** Whether gathers with strided offsets should be turned into vector
+        loads and shuffles.  This is only done after GatherCoalescePass
+        has had a chance at them, since it does better with several
+        gathers from the same interleaved data (e.g. the R, G, and B
+        components of pixels). */
+    bool lowerStrided;
 };
 
 char ImproveMemoryOpsPass::ID = 0;
@@ -2795,6 +2831,195 @@ lGetOffsetScaleVec(llvm::Value *offsetScale, llvm::Type *vecType) {
 }
 
 
+/** If base points to the start of a small array of 32-bit values (a global
+    or a local variable with at most maxEntries elements), returns the
+    contents of the array as a vector of i32 padded with undefined values
+    to a multiple of chunkSize elements; otherwise returns NULL.  Constant
+    arrays give constant vectors; others are loaded before insertBefore.
+ */
+static llvm::Value *
+lGetSmallTable(llvm::Value *base, llvm::Type *scalarType, int maxEntries,
+               int chunkSize, llvm::Instruction *insertBefore) {
+    llvm::Value *array = base->stripPointerCasts();
+    if (!llvm::isa<llvm::GlobalVariable>(array) &&
+        !llvm::isa<llvm::AllocaInst>(array))
+        return NULL;
+
+    llvm::PointerType *pt = llvm::dyn_cast<llvm::PointerType>(array->getType());
+    llvm::ArrayType *at = llvm::dyn_cast<llvm::ArrayType>(pt->getElementType());
+    if (at == NULL || at->getElementType() != scalarType ||
+        at->getNumElements() == 0 || (int)at->getNumElements() > maxEntries)
+        return NULL;
+    int numEntries = (int)at->getNumElements();
+
+    llvm::Type *tableType = llvm::VectorType::get(scalarType, numEntries);
+    llvm::Value *table = NULL;
+    llvm::GlobalVariable *gv = llvm::dyn_cast<llvm::GlobalVariable>(array);
+    if (gv != NULL && gv->isConstant() && gv->hasDefinitiveInitializer()) {
+        std::vector<llvm::Constant *> entries;
+        for (int i = 0; i < numEntries; ++i)
+            entries.push_back(gv->getInitializer()->getAggregateElement(i));
+        table = llvm::ConstantVector::get(entries);
+    }
+    else {
+        llvm::Value *ptr = new llvm::BitCastInst(array, llvm::PointerType::get(tableType, 0),
+                                                 "table_ptr", insertBefore);
+        table = new llvm::LoadInst(ptr, "table", false /* not volatile */,
+                                   4, insertBefore);
+    }
+    if (scalarType != LLVMTypes::Int32Type)
+        table = new llvm::BitCastInst(table, llvm::VectorType::get(LLVMTypes::Int32Type,
+                                                                   numEntries),
+                                      "table_i32", insertBefore);
+
+    int paddedEntries = (numEntries + chunkSize - 1) / chunkSize * chunkSize;
+    if (paddedEntries == numEntries)
+        return table;
+    int32_t shuf[ISPC_MAX_NVEC];
+    for (int i = 0; i < paddedEntries; ++i)
+        shuf[i] = (i < numEntries) ? i : -1;
+    return LLVMShuffleVectors(table, table, shuf, paddedEntries, insertBefore);
+}
+
+
+/** Looks up each element of index (a chunkSize-wide vector of i32) in
+    table, a chunkSize-wide vector of i32, with a single permute: pshufb
+    on the table's bytes for 4-wide chunks and vpermd for 8-wide ones.
+    Only the low bits of the indices are used, so indices past the end of
+    the table wrap around.
+ */
+static llvm::Value *
+lPermute(llvm::Value *table, llvm::Value *index, int chunkSize,
+         llvm::Instruction *insertBefore) {
+    if (chunkSize == 8) {
+        llvm::Function *permd =
+            llvm::Intrinsic::getDeclaration(m->module, llvm::Intrinsic::x86_avx2_permd);
+        return lCallInst(permd, table, index, "permd", insertBefore);
+    }
+
+    // Turn each index i into the bytes 4i, 4i+1, 4i+2, 4i+3 (in that
+    // order, low to high) that pshufb needs to move the entry's bytes.
+    Assert(chunkSize == 4);
+    llvm::Type *bytesType = llvm::VectorType::get(LLVMTypes::Int8Type, 16);
+    llvm::Value *byteIndex =
+        llvm::BinaryOperator::Create(llvm::Instruction::Mul, index,
+                                     llvm::ConstantVector::getSplat(4, LLVMInt32(0x04040404)), "byte_index",
+                                     insertBefore);
+    byteIndex =
+        llvm::BinaryOperator::Create(llvm::Instruction::Add, byteIndex,
+                                     llvm::ConstantVector::getSplat(4, LLVMInt32(0x03020100)), "byte_index",
+                                     insertBefore);
+    byteIndex = new llvm::BitCastInst(byteIndex, bytesType, "byte_index", insertBefore);
+    llvm::Value *tableBytes = new llvm::BitCastInst(table, bytesType, "table_bytes",
+                                                    insertBefore);
+    llvm::Function *pshufb =
+        llvm::Intrinsic::getDeclaration(m->module, llvm::Intrinsic::x86_ssse3_pshuf_b_128);
+    llvm::Value *result = lCallInst(pshufb, tableBytes, byteIndex, "pshufb",
+                                    insertBefore);
+    return new llvm::BitCastInst(result, index->getType(), "pshufb_i32",
+                                 insertBefore);
+}
+
+
+/** Tries to turn a gather of 32-bit values from a small array into
+    in-register table lookups: the array is held in one or two vector
+    registers and each chunk of lanes picks its values out of them with
+    permutes (see lPermute()), blending the results from two registers
+    based on the index.  On SSE4 and AVX, arrays of up to 8 elements are
+    handled this way, and arrays of up to 16 elements with AVX2 and
+    AVX-512.  Returns the gathered value or NULL.
+ */
+static llvm::Value *
+lGatherToTableLookup(llvm::Value *base, llvm::Value *fullOffsets,
+                     llvm::Type *scalarType, llvm::Instruction *insertBefore) {
+    if (scalarType != LLVMTypes::Int32Type && scalarType != LLVMTypes::FloatType)
+        return NULL;
+
+    int chunkSize;
+    switch (g->target->getISA()) {
+    case Target::SSE4:
+    case Target::AVX:
+    case Target::AVX11:
+        chunkSize = 4;
+        break;
+    case Target::AVX2:
+    case Target::KNL_AVX512:
+    case Target::SKX_AVX512:
+        chunkSize = 8;
+        break;
+    default:
+        return NULL;
+    }
+
+    llvm::Value *table = lGetSmallTable(base, scalarType, 2 * chunkSize,
+                                        chunkSize, insertBefore);
+    if (table == NULL)
+        return NULL;
+    int numTables = llvm::dyn_cast<llvm::VectorType>(table->getType())->getNumElements() /
+        chunkSize;
+
+    // The offsets are in bytes; get element indices as i32s.
+    int width = g->target->getVectorWidth();
+    llvm::Value *index =
+        llvm::BinaryOperator::Create(llvm::Instruction::LShr, fullOffsets,
+                                     (fullOffsets->getType() == LLVMTypes::Int64VectorType) ?
+                                     LLVMInt64Vector((int64_t)2) : LLVMInt32Vector(2),
+                                     "table_index", insertBefore);
+    if (index->getType() == LLVMTypes::Int64VectorType)
+        index = new llvm::TruncInst(index, LLVMTypes::Int32VectorType, "table_index",
+                                    insertBefore);
+
+    int32_t shuf[ISPC_MAX_NVEC];
+    llvm::Value *tables[2];
+    for (int t = 0; t < numTables; ++t) {
+        for (int i = 0; i < chunkSize; ++i)
+            shuf[i] = t * chunkSize + i;
+        tables[t] = (numTables == 1) ? table :
+            LLVMShuffleVectors(table, table, shuf, chunkSize, insertBefore);
+    }
+
+    // Look up the values for each chunkSize-wide chunk of the lanes.
+    std::vector<llvm::Value *> chunks;
+    for (int c = 0; c < width; c += chunkSize) {
+        for (int i = 0; i < chunkSize; ++i)
+            shuf[i] = (c + i < width) ? (c + i) : -1;
+        llvm::Value *chunkIndex = LLVMShuffleVectors(index, index, shuf, chunkSize,
+                                                     insertBefore);
+        llvm::Value *result = lPermute(tables[0], chunkIndex, chunkSize, insertBefore);
+        if (numTables == 2) {
+            llvm::Value *upper = lPermute(tables[1], chunkIndex, chunkSize,
+                                          insertBefore);
+            llvm::Value *isUpper =
+                new llvm::ICmpInst(insertBefore, llvm::CmpInst::ICMP_UGE, chunkIndex,
+                                   llvm::ConstantVector::getSplat(chunkSize,
+                                                                  LLVMInt32(chunkSize)),
+                                   "is_upper");
+            result = llvm::SelectInst::Create(isUpper, upper, result, "table_value",
+                                              insertBefore);
+        }
+        chunks.push_back(result);
+    }
+
+    // Put the chunks back together into a full-width result.
+    while (chunks.size() > 1) {
+        std::vector<llvm::Value *> joined;
+        for (int i = 0; i < (int)chunks.size(); i += 2)
+            joined.push_back(LLVMConcatVectors(chunks[i], chunks[i+1], insertBefore));
+        chunks.swap(joined);
+    }
+    llvm::Value *result = chunks[0];
+    if (width < chunkSize) {
+        for (int i = 0; i < width; ++i)
+            shuf[i] = i;
+        result = LLVMShuffleVectors(result, result, shuf, width, insertBefore);
+    }
+    if (scalarType != LLVMTypes::Int32Type)
+        result = new llvm::BitCastInst(result, LLVMTypes::FloatVectorType, "table_float",
+                                       insertBefore);
+    return result;
+}
+
+
 /** After earlier optimization passes have run, we are sometimes able to
     determine that gathers/scatters are actually accessing memory in a more
     regular fashion and then change the operation to something simpler and
@@ -2803,15 +3028,23 @@ lGetOffsetScaleVec(llvm::Value *offsetScale, llvm::Type *vecType) {
     broadcast.  This pass examines gathers and scatters and tries to
     simplify them if at all possible.
 
-    @todo Currently, this only looks for all program instances going to the
-    same location and all going to a linear sequence of locations in
-    memory.  There are a number of other cases that might make sense to
-    look for, including things that could be handled with a vector load +
-    shuffle or things that could be handled with hybrids of e.g. 2 4-wide
-    vector loads with AVX, etc.
+    If lowerStrided is true, gathers with the mask all on that read every
+    2nd, 3rd, 4th, or 8th element are also turned into a vector load of
+    the elements they span and a shuffle that picks out the ones they
+    need.  (Strided scatters are left alone, since a vector store would
+    also write the elements in between; sets of scatters that write all of
+    them, like the ones that write all of the fields of an array of
+    structs, are handled by ScatterCoalescePass.)
+
+    Gathers of 32-bit values from small arrays are turned into permutes of
+    the array's contents held in registers; see lGatherToTableLookup().
+
+    @todo There are a number of other cases that might make sense to look
+    for, including things that could be handled with hybrids of e.g. 2
+    4-wide vector loads with AVX, etc.
 */
 static bool
-lGSToLoadStore(llvm::CallInst *callInst) {
+lGSToLoadStore(llvm::CallInst *callInst, bool lowerStrided) {
     struct GatherImpInfo {
         GatherImpInfo(const char *pName, const char *lmName, llvm::Type *st,
                       int a)
@@ -2945,7 +3178,7 @@ lGSToLoadStore(llvm::CallInst *callInst) {
         return false;
 
     SourcePos pos;
-    lGetSourcePosFromMetadata(callInst, &pos);
+    bool havePos = lGetSourcePosFromMetadata(callInst, &pos);
 
     llvm::Value *base = callInst->getArgOperand(0);
     llvm::Value *fullOffsets = NULL;
@@ -3003,6 +3236,14 @@ lGSToLoadStore(llvm::CallInst *callInst) {
             // handled as a scalar load and broadcast across the lanes.
             Debug(pos, "Transformed gather to scalar load and broadcast!");
 
+            // The index was varying in the source program but turned out
+            // to be the same for all of the program instances; let the
+            // user know that it (and the value loaded) could be uniform.
+            if (havePos)
+                PerformanceWarning(pos, "All program instances are loading the "
+                                   "same location; the varying index used here "
+                                   "could be declared \"uniform\".");
+
             ptr = new llvm::BitCastInst(ptr, llvm::PointerType::get(gatherInfo->scalarType, 0),
                                         ptr->getName(), callInst);
             llvm::Value *scalarValue = new llvm::LoadInst(ptr, callInst->getName(), callInst);
@@ -3076,6 +3317,59 @@ lGSToLoadStore(llvm::CallInst *callInst) {
                 return true;
             }
         }
+
+        if (lowerStrided && gatherInfo != NULL && step > 0 &&
+            lGetMaskStatus(mask) == ALL_ON) {
+            // Don't bother with loads that span more than this many bytes;
+            // at that point we'd be loading mostly unneeded data.
+            const int maxStridedLoadBytes = 256;
+            const int strides[] = { 2, 3, 4, 8 };
+            int width = g->target->getVectorWidth();
+            for (int i = 0; i < (int)(sizeof(strides) / sizeof(strides[0])); ++i) {
+                int span = (width - 1) * strides[i] + 1;
+                if (span * step > maxStridedLoadBytes ||
+                    !LLVMVectorIsLinear(fullOffsets, step * strides[i]))
+                    continue;
+
+                // Since all of the lanes are active, all of the elements
+                // from the first one read to the last one are safe to
+                // load.
+                Debug(pos, "Transformed gather to vector load and stride-%d "
+                      "shuffle!", strides[i]);
+                llvm::Value *ptr = lComputeCommonPointer(base, fullOffsets, callInst);
+                lCopyMetadata(ptr, callInst);
+                llvm::Type *spanType =
+                    llvm::VectorType::get(gatherInfo->scalarType, span);
+                ptr = new llvm::BitCastInst(ptr, llvm::PointerType::get(spanType, 0),
+                                            "ptrcast", callInst);
+                llvm::Value *load =
+                    new llvm::LoadInst(ptr, "strided_load", false /* not volatile */,
+                                       gatherInfo->align, callInst);
+
+                int32_t shuf[ISPC_MAX_NVEC];
+                for (int j = 0; j < width; ++j)
+                    shuf[j] = j * strides[i];
+                llvm::Value *result = LLVMShuffleVectors(load, load, shuf, width,
+                                                         callInst);
+                lCopyMetadata(result, callInst);
+                callInst->replaceAllUsesWith(result);
+                callInst->eraseFromParent();
+                return true;
+            }
+        }
+
+        if (gatherInfo != NULL) {
+            llvm::Value *result =
+                lGatherToTableLookup(base, fullOffsets, gatherInfo->scalarType,
+                                     callInst);
+            if (result != NULL) {
+                Debug(pos, "Transformed gather to in-register table lookup!");
+                lCopyMetadata(result, callInst);
+                callInst->replaceAllUsesWith(result);
+                callInst->eraseFromParent();
+                return true;
+            }
+        }
         return false;
     }
 }
@@ -3258,7 +3552,7 @@ ImproveMemoryOpsPass::runOnBasicBlock(llvm::BasicBlock &bb) {
             modifiedAny = true;
             goto restart;
         }
-        if (lGSToLoadStore(callInst)) {
+        if (lGSToLoadStore(callInst, lowerStrided)) {
             modifiedAny = true;
             goto restart;
         }
@@ -3279,8 +3573,8 @@ ImproveMemoryOpsPass::runOnBasicBlock(llvm::BasicBlock &bb) {
 
 
 static llvm::Pass *
-CreateImproveMemoryOpsPass() {
-    return new ImproveMemoryOpsPass;
+CreateImproveMemoryOpsPass(bool lowerStrided) {
+    return new ImproveMemoryOpsPass(lowerStrided);
 }
 
 
@@ -3288,9 +3582,10 @@ CreateImproveMemoryOpsPass() {
 // GatherCoalescePass
 
 // This pass implements two optimizations to improve the performance of
-// gathers; currently only gathers of 32-bit values where it can be
-// determined at compile time that the mask is all on are supported, though
-// both of those limitations may be generalized in the future.
+// gathers where it can be determined at compile time that the mask is all
+// on.  Gathers of 32-bit and 64-bit values are handled in terms of 32-bit
+// units (a 64-bit element is just two consecutive ones); 8-bit and 16-bit
+// values are loaded and shuffled at their own width.
 //
 //  First, for any single gather, see if it's worthwhile to break it into
 //  any of scalar, 2-wide (i.e. 64-bit), 4-wide, or 8-wide loads.  Further,
@@ -3304,19 +3599,25 @@ CreateImproveMemoryOpsPass() {
 //  different gathers reuse values from the same location in memory, but
 //  it's specifically helpful when data with AOS layout is being accessed;
 //  in this case, we're often able to generate wide vector loads and
-//  appropriate shuffles automatically.
+//  appropriate shuffles automatically.  The series of gathers doesn't
+//  have to be in a single basic block: it may continue into the blocks
+//  that are always executed after the first one's (e.g. past an "if"
+//  statement), as long as nothing in between writes to memory.
 
-class GatherCoalescePass : public llvm::BasicBlockPass {
+class GatherCoalescePass : public llvm::FunctionPass {
 public:
     static char ID;
-    GatherCoalescePass() : BasicBlockPass(ID) { }
+    GatherCoalescePass() : FunctionPass(ID) { }
 
 #if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
     const char *getPassName() const { return "Gather Coalescing"; }
 #else // LLVM 4.0+
     llvm::StringRef getPassName() const { return "Gather Coalescing"; }
 #endif
-    bool runOnBasicBlock(llvm::BasicBlock &BB);
+    bool runOnFunction(llvm::Function &F);
+
+private:
+    bool coalesceGathersInBlock(llvm::BasicBlock &BB);
 };
 
 char GatherCoalescePass::ID = 0;
@@ -3509,15 +3810,19 @@ lSelectLoads(const std::vector<int64_t> &loadOffsets,
 
 
 /** Print a performance message with the details of the result of
-    coalescing over a group of gathers. */
+    coalescing over a group of gathers (or scatters) into memory operations
+    with the given widths.  opName and memOpName give the kind of the
+    original and new operations: "gather" and "load", or "scatter" and
+    "store". */
 static void
 lCoalescePerfInfo(const std::vector<llvm::CallInst *> &coalesceGroup,
-                  const std::vector<CoalescedLoadOp> &loadOps) {
+                  const std::vector<int> &memOpWidths, const char *opName,
+                  const char *memOpName) {
     SourcePos pos;
     lGetSourcePosFromMetadata(coalesceGroup[0], &pos);
 
     // Create a string that indicates the line numbers of the subsequent
-    // gathers from the first one that were coalesced here.
+    // gathers (or scatters) from the first one that were coalesced here.
     char otherPositions[512];
     otherPositions[0] = '\0';
     if (coalesceGroup.size() > 1) {
@@ -3540,33 +3845,33 @@ lCoalescePerfInfo(const std::vector<llvm::CallInst *> &coalesceGroup,
         strcat(otherPositions, ") ");
     }
 
-    // Count how many loads of each size there were.
-    std::map<int, int> loadOpsCount;
-    for (int i = 0; i < (int)loadOps.size(); ++i)
-        ++loadOpsCount[loadOps[i].count];
+    // Count how many memory ops of each size there were.
+    std::map<int, int> memOpsCount;
+    for (int i = 0; i < (int)memOpWidths.size(); ++i)
+        ++memOpsCount[memOpWidths[i]];
 
-    // Generate a string the describes the mix of load ops
-    char loadOpsInfo[512];
-    loadOpsInfo[0] = '\0';
-    std::map<int, int>::const_iterator iter = loadOpsCount.begin();
-    while (iter != loadOpsCount.end()) {
+    // Generate a string the describes the mix of memory ops
+    char memOpsInfo[512];
+    memOpsInfo[0] = '\0';
+    std::map<int, int>::const_iterator iter = memOpsCount.begin();
+    while (iter != memOpsCount.end()) {
         char buf[32];
         sprintf(buf, "%d x %d-wide", iter->second, iter->first);
-        strcat(loadOpsInfo, buf);
+        strcat(memOpsInfo, buf);
         ++iter;
-        if (iter != loadOpsCount.end())
-            strcat(loadOpsInfo, ", ");
+        if (iter != memOpsCount.end())
+            strcat(memOpsInfo, ", ");
     }
 
     if (coalesceGroup.size() == 1)
-        PerformanceWarning(pos, "Coalesced gather into %d load%s (%s).",
-                           (int)loadOps.size(),
-                           (loadOps.size() > 1) ? "s" : "", loadOpsInfo);
+        PerformanceWarning(pos, "Coalesced %s into %d %s%s (%s).", opName,
+                           (int)memOpWidths.size(), memOpName,
+                           (memOpWidths.size() > 1) ? "s" : "", memOpsInfo);
     else
-        PerformanceWarning(pos, "Coalesced %d gathers starting here %sinto %d "
-                           "load%s (%s).", (int)coalesceGroup.size(),
-                           otherPositions,(int)loadOps.size(),
-                           (loadOps.size() > 1) ? "s" : "", loadOpsInfo);
+        PerformanceWarning(pos, "Coalesced %d %ss starting here %sinto %d "
+                           "%s%s (%s).", (int)coalesceGroup.size(), opName,
+                           otherPositions, (int)memOpWidths.size(), memOpName,
+                           (memOpWidths.size() > 1) ? "s" : "", memOpsInfo);
 }
 
 
@@ -3590,11 +3895,12 @@ lGEPAndLoad(llvm::Value *basePtr, int64_t offset, int align,
 
 /* Having decided that we're doing to emit a series of loads, as encoded in
    the loadOps array, this function emits the corresponding load
-   instructions.
+   instructions.  unitSize gives the size in bytes of the units that the
+   load offsets and counts are in terms of.
  */
 static void
 lEmitLoads(llvm::Value *basePtr, std::vector<CoalescedLoadOp> &loadOps,
-           int elementSize, llvm::Instruction *insertBefore) {
+           int unitSize, llvm::Instruction *insertBefore) {
     Debug(SourcePos(), "Coalesce doing %d loads.", (int)loadOps.size());
     for (int i = 0; i < (int)loadOps.size(); ++i) {
         Debug(SourcePos(), "Load #%d @ %" PRId64 ", %d items", i, loadOps[i].start,
@@ -3602,7 +3908,20 @@ lEmitLoads(llvm::Value *basePtr, std::vector<CoalescedLoadOp> &loadOps,
 
         // basePtr is an i8 *, so the offset from it should be in terms of
         // bytes, not underlying i32 elements.
-        int64_t start = loadOps[i].start * elementSize;
+        int64_t start = loadOps[i].start * unitSize;
+
+        if (unitSize < 4) {
+            // 8-bit and 16-bit units are just loaded as scalars or vectors
+            // of the unit type; lAssembleSmallResultVectors() picks the
+            // values out of them.
+            llvm::Type *unitType = (unitSize == 1) ? LLVMTypes::Int8Type :
+                LLVMTypes::Int16Type;
+            llvm::Type *type = (loadOps[i].count == 1) ? unitType :
+                llvm::VectorType::get(unitType, loadOps[i].count);
+            loadOps[i].load = lGEPAndLoad(basePtr, start, unitSize,
+                                          insertBefore, type);
+            continue;
+        }
 
         int align = 4;
         switch (loadOps[i].count) {
@@ -3997,12 +4316,13 @@ lAssemble4Vector(const std::vector<CoalescedLoadOp> &loadOps,
 
 /** Given the set of loads that we've done and the set of result values to
     be computed, this function computes the final llvm::Value *s for each
-    result vector.
+    result vector.  Each of the numResults results is assembled from the
+    same number of consecutive 32-bit values in constOffsets.
  */
 static void
 lAssembleResultVectors(const std::vector<CoalescedLoadOp> &loadOps,
                        const std::vector<int64_t> &constOffsets,
-                       std::vector<llvm::Value *> &results,
+                       int numResults, std::vector<llvm::Value *> &results,
                        llvm::Instruction *insertBefore) {
     // We work on 4-wide chunks of the final values, even when we're
     // computing 8-wide or 16-wide vectors.  This gives better code from
@@ -4013,30 +4333,61 @@ lAssembleResultVectors(const std::vector<CoalescedLoadOp> &loadOps,
         vec4s.push_back(lAssemble4Vector(loadOps, &constOffsets[i],
                                          insertBefore));
 
-    // And now concatenate 1, 2, or 4 of the 4-wide vectors computed above
-    // into 4, 8, or 16-wide final result vectors.
-    int numGathers = constOffsets.size() / g->target->getVectorWidth();
-    for (int i = 0; i < numGathers; ++i) {
-        llvm::Value *result = NULL;
-        switch (g->target->getVectorWidth()) {
-        case 4:
-            result = vec4s[i];
-            break;
-        case 8:
-            result = LLVMConcatVectors(vec4s[2*i], vec4s[2*i+1], insertBefore);
-            break;
-        case 16: {
-            llvm::Value *v1 = LLVMConcatVectors(vec4s[4*i], vec4s[4*i+1],
-                                                insertBefore);
-            llvm::Value *v2 = LLVMConcatVectors(vec4s[4*i+2], vec4s[4*i+3],
-                                                insertBefore);
-            result = LLVMConcatVectors(v1, v2, insertBefore);
-            break;
-        }
-        default:
-            FATAL("Unhandled vector width in lAssembleResultVectors()");
+    // And now concatenate the 4-wide vectors computed above into the
+    // final result vectors, pairwise, so that a result made of 2^n of them
+    // takes n levels of concatenation.
+    int vec4sPerResult = (int)vec4s.size() / numResults;
+    for (int i = 0; i < numResults; ++i) {
+        std::vector<llvm::Value *> parts(vec4s.begin() + i * vec4sPerResult,
+                                         vec4s.begin() + (i + 1) * vec4sPerResult);
+        while (parts.size() > 1) {
+            Assert((parts.size() % 2) == 0);
+            std::vector<llvm::Value *> joined;
+            for (int j = 0; j < (int)parts.size(); j += 2)
+                joined.push_back(LLVMConcatVectors(parts[j], parts[j+1],
+                                                   insertBefore));
+            parts.swap(joined);
         }
+        results.push_back(parts[0]);
+    }
+}
+
 
+/** The counterpart of lAssembleResultVectors() for gathers of 8-bit and
+    16-bit values: each lane of each result is extracted from the load that
+    covers its offset and inserted into the result vector; LLVM turns the
+    resulting chains of inserts into shuffles.
+ */
+static void
+lAssembleSmallResultVectors(const std::vector<CoalescedLoadOp> &loadOps,
+                            const std::vector<int64_t> &constOffsets,
+                            llvm::Type *unitType,
+                            std::vector<llvm::Value *> &results,
+                            llvm::Instruction *insertBefore) {
+    int width = g->target->getVectorWidth();
+    llvm::Type *resultType = llvm::VectorType::get(unitType, width);
+    for (int i = 0; i < (int)constOffsets.size(); i += width) {
+        llvm::Value *result = llvm::UndefValue::get(resultType);
+        for (int lane = 0; lane < width; ++lane) {
+            int64_t offset = constOffsets[i + lane];
+            const CoalescedLoadOp *load = NULL;
+            for (int j = 0; j < (int)loadOps.size(); ++j)
+                if (offset >= loadOps[j].start &&
+                    offset < loadOps[j].start + loadOps[j].count) {
+                    load = &loadOps[j];
+                    break;
+                }
+            Assert(load != NULL);
+
+            llvm::Value *value = load->load;
+            if (load->count > 1)
+                value = llvm::ExtractElementInst::Create(value,
+                            LLVMInt32(int32_t(offset - load->start)),
+                            "extract_load", insertBefore);
+            result = llvm::InsertElementInst::Create(result, value,
+                                                     LLVMInt32(lane),
+                                                     "insert_load", insertBefore);
+        }
         results.push_back(result);
     }
 }
@@ -4072,26 +4423,35 @@ lComputeBasePtr(llvm::CallInst *gatherInst, llvm::Instruction *insertBefore) {
 /** Extract the constant offsets (from the common base pointer) from each
     of the gathers in a set to be coalesced.  These come in as byte
     offsets, but we'll transform them into offsets in terms of the size of
-    the base scalar type being gathered.  (e.g. for an i32 gather, we might
-    have offsets like <0,4,16,20>, which would be transformed to <0,1,4,5>
-    here.)
+    the units that are loaded.  (e.g. for an i32 gather, we might have
+    offsets like <0,4,16,20>, which would be transformed to <0,1,4,5>
+    here.)  Elements bigger than a unit give a run of consecutive offsets
+    for each lane: an i64 gather with offsets <0,8,...> loaded as 32-bit
+    units gives <0,1,2,3,...>.  Returns false if some offset isn't a
+    multiple of the unit size.
  */
-static void
+static bool
 lExtractConstOffsets(const std::vector<llvm::CallInst *> &coalesceGroup,
-                     int elementSize, std::vector<int64_t> *constOffsets) {
+                     int elementSize, int unitSize,
+                     std::vector<int64_t> *constOffsets) {
     int width = g->target->getVectorWidth();
-    *constOffsets = std::vector<int64_t>(coalesceGroup.size() * width, 0);
+    int unitsPerElement = elementSize / unitSize;
 
-    int64_t *endPtr = &((*constOffsets)[0]);
-    for (int i = 0; i < (int)coalesceGroup.size(); ++i, endPtr += width) {
+    for (int i = 0; i < (int)coalesceGroup.size(); ++i) {
         llvm::Value *offsets = coalesceGroup[i]->getArgOperand(3);
+        int64_t gatherOffsets[ISPC_MAX_NVEC];
         int nElts;
-        bool ok = LLVMExtractVectorInts(offsets, endPtr, &nElts);
+        bool ok = LLVMExtractVectorInts(offsets, gatherOffsets, &nElts);
         Assert(ok && nElts == width);
-    }
 
-    for (int i = 0; i < (int)constOffsets->size(); ++i)
-        (*constOffsets)[i] /= elementSize;
+        for (int j = 0; j < width; ++j) {
+            if ((gatherOffsets[j] % unitSize) != 0)
+                return false;
+            for (int k = 0; k < unitsPerElement; ++k)
+                constOffsets->push_back(gatherOffsets[j] / unitSize + k);
+        }
+    }
+    return true;
 }
 
 
@@ -4109,46 +4469,72 @@ static bool
 lCoalesceGathers(const std::vector<llvm::CallInst *> &coalesceGroup) {
     llvm::Instruction *insertBefore = coalesceGroup[0];
 
-    // First, compute the shared base pointer for all of the gathers
-    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
-
+    // 32-bit and 64-bit values are loaded in 32-bit units; smaller ones at
+    // their own size.
+    llvm::Type *elementType = coalesceGroup[0]->getType()->getScalarType();
     int elementSize = 0;
-    if (coalesceGroup[0]->getType() == LLVMTypes::Int32VectorType ||
-        coalesceGroup[0]->getType() == LLVMTypes::FloatVectorType)
+    if (elementType == LLVMTypes::Int8Type)
+        elementSize = 1;
+    else if (elementType == LLVMTypes::Int16Type)
+        elementSize = 2;
+    else if (elementType == LLVMTypes::Int32Type ||
+             elementType == LLVMTypes::FloatType)
         elementSize = 4;
-    else if (coalesceGroup[0]->getType() == LLVMTypes::Int64VectorType ||
-             coalesceGroup[0]->getType() == LLVMTypes::DoubleVectorType)
+    else if (elementType == LLVMTypes::Int64Type ||
+             elementType == LLVMTypes::DoubleType)
         elementSize = 8;
     else
         FATAL("Unexpected gather type in lCoalesceGathers");
+    int unitSize = (elementSize < 4) ? elementSize : 4;
+
+    // The 32-bit path assembles the results in 4-wide chunks.
+    int unitsPerResult = g->target->getVectorWidth() * elementSize / unitSize;
+    if (unitSize == 4 &&
+        ((unitsPerResult % 4) != 0 || unitsPerResult > ISPC_MAX_NVEC))
+        return false;
 
     // Extract the constant offsets from the gathers into the constOffsets
     // vector: the first vectorWidth elements will be those for the first
     // gather, the next vectorWidth those for the next gather, and so
     // forth.
     std::vector<int64_t> constOffsets;
-    lExtractConstOffsets(coalesceGroup, elementSize, &constOffsets);
+    if (!lExtractConstOffsets(coalesceGroup, elementSize, unitSize,
+                              &constOffsets))
+        return false;
+
+    // Compute the shared base pointer for all of the gathers
+    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
 
     // Determine a set of loads to perform to get all of the values we need
     // loaded.
     std::vector<CoalescedLoadOp> loadOps;
     lSelectLoads(constOffsets, &loadOps);
 
-    lCoalescePerfInfo(coalesceGroup, loadOps);
+    std::vector<int> loadWidths;
+    for (int i = 0; i < (int)loadOps.size(); ++i)
+        loadWidths.push_back(loadOps[i].count);
+    lCoalescePerfInfo(coalesceGroup, loadWidths, "gather", "load");
 
     // Actually emit load instructions for them
-    lEmitLoads(basePtr, loadOps, elementSize, insertBefore);
-
-    // Now, for any loads that give us <8 x i32> vectors, split their
-    // values into two <4 x i32> vectors; it turns out that LLVM gives us
-    // better code on AVX when we assemble the pieces from 4-wide vectors.
-    loadOps = lSplit8WideLoads(loadOps, insertBefore);
+    lEmitLoads(basePtr, loadOps, unitSize, insertBefore);
 
     // Given all of these chunks of values, shuffle together a vector that
     // gives us each result value; the i'th element of results[] gives the
     // result for the i'th gather in coalesceGroup.
     std::vector<llvm::Value *> results;
-    lAssembleResultVectors(loadOps, constOffsets, results, insertBefore);
+    if (unitSize < 4)
+        lAssembleSmallResultVectors(loadOps, constOffsets, elementType,
+                                    results, insertBefore);
+    else {
+        // For any loads that give us <8 x i32> vectors, split their
+        // values into two <4 x i32> vectors; it turns out that LLVM gives
+        // us better code on AVX when we assemble the pieces from 4-wide
+        // vectors.
+        loadOps = lSplit8WideLoads(loadOps, insertBefore);
+        lAssembleResultVectors(loadOps, constOffsets,
+                               (int)coalesceGroup.size(), results,
+                               insertBefore);
+    }
 
     // Finally, replace each of the original gathers with the instruction
     // that gives the value from the coalescing process.
@@ -4209,15 +4595,118 @@ lInstructionMayWriteToMemory(llvm::Instruction *inst) {
 }
 
 
+/** Returns the number of successors of the given block. */
+static int
+lNumSuccessors(llvm::BasicBlock *bb) {
+    return bb->getTerminator()->getNumSuccessors();
+}
+
+
+/** Looks for the block that a series of gathers to be coalesced may
+    continue into after the given one: the nearest block that is always
+    executed after bb (i.e. that post-dominates it) and that can only be
+    reached through bb (i.e. that it dominates), like the block after an
+    "if" statement that starts at the end of bb.  None of the blocks in
+    between may write to memory; to keep this cheap, we give up on regions
+    of more than a few blocks.  Returns NULL if there's no such block.
+ */
+static llvm::BasicBlock *
+lNextCoalesceBlock(llvm::BasicBlock *bb) {
+    const int maxRegionBlocks = 16;
+
+    // The candidates are the blocks near bb, in breadth-first order, so
+    // that the first one that all paths from bb go through is the nearest
+    // one.
+    std::vector<llvm::BasicBlock *> candidates;
+    std::set<llvm::BasicBlock *> seen;
+    seen.insert(bb);
+    candidates.push_back(bb);
+    for (int c = 0; c < (int)candidates.size() &&
+             (int)candidates.size() <= maxRegionBlocks; ++c)
+        for (int i = 0; i < lNumSuccessors(candidates[c]); ++i) {
+            llvm::BasicBlock *succ = candidates[c]->getTerminator()->getSuccessor(i);
+            if (seen.insert(succ).second)
+                candidates.push_back(succ);
+        }
+
+    for (int c = 1; c < (int)candidates.size(); ++c) {
+        llvm::BasicBlock *cand = candidates[c];
+
+        // Find the blocks that are reachable from bb without going
+        // through the candidate.
+        std::set<llvm::BasicBlock *> region;
+        std::vector<llvm::BasicBlock *> worklist(1, bb);
+        bool postDominates = true;
+        while (worklist.size() > 0 && postDominates) {
+            llvm::BasicBlock *block = worklist.back();
+            worklist.pop_back();
+            if (lNumSuccessors(block) == 0 ||
+                (int)region.size() > maxRegionBlocks)
+                // We can leave the function without reaching the
+                // candidate (or the region is too big to bother).
+                postDominates = false;
+            for (int i = 0; i < lNumSuccessors(block); ++i) {
+                llvm::BasicBlock *succ = block->getTerminator()->getSuccessor(i);
+                if (succ == bb)
+                    // We can loop back to bb; we don't try to handle
+                    // loops.
+                    postDominates = false;
+                else if (succ != cand && region.insert(succ).second)
+                    worklist.push_back(succ);
+            }
+        }
+        if (!postDominates)
+            continue;
+
+        // The candidate is the block we're looking for if nothing else can
+        // branch into the region or into it, and if nothing in the region
+        // writes to memory.
+        region.insert(cand);
+        for (std::set<llvm::BasicBlock *>::iterator iter = region.begin();
+             iter != region.end(); ++iter) {
+            for (llvm::pred_iterator pi = llvm::pred_begin(*iter),
+                     pe = llvm::pred_end(*iter); pi != pe; ++pi)
+                if (*pi != bb && region.find(*pi) == region.end())
+                    return NULL;
+            if (*iter == cand)
+                continue;
+            for (llvm::BasicBlock::iterator ii = (*iter)->begin();
+                 ii != (*iter)->end(); ++ii)
+                if (lInstructionMayWriteToMemory(&*ii))
+                    return NULL;
+        }
+        return cand;
+    }
+    return NULL;
+}
+
+
 bool
-GatherCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
+GatherCoalescePass::runOnFunction(llvm::Function &F) {
+    bool modifiedAny = false;
+    for (llvm::Function::iterator bb = F.begin(); bb != F.end(); ++bb)
+        modifiedAny |= coalesceGathersInBlock(*bb);
+    return modifiedAny;
+}
+
+
+bool
+GatherCoalescePass::coalesceGathersInBlock(llvm::BasicBlock &bb) {
     DEBUG_START_PASS("GatherCoalescePass");
 
     llvm::Function *gatherFuncs[] = {
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_i8"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_i16"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets32_i32"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets32_float"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_i64"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets32_double"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_i8"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_i16"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets64_i32"),
         m->module->getFunction("__pseudo_gather_factored_base_offsets64_float"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_i64"),
+        m->module->getFunction("__pseudo_gather_factored_base_offsets64_double"),
     };
     int nGatherFuncs = sizeof(gatherFuncs) / sizeof(gatherFuncs[0]);
 
@@ -4227,7 +4716,7 @@ GatherCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
     for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e;
          ++iter) {
         // Iterate over all of the instructions and look for calls to
-        // __pseudo_gather_factored_base_offsets{32,64}_{i32,float} calls.
+        // __pseudo_gather_factored_base_offsets{32,64}_* calls.
         llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
         if (callInst == NULL)
             continue;
@@ -4277,12 +4766,21 @@ GatherCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
         coalesceGroup.push_back(callInst);
 
         // Start iterating at the instruction after the initial gather;
-        // look at the remainder of instructions in the basic block (up
-        // until we reach a write to memory) to try to find any other
-        // gathers that can coalesce with this one.
+        // look at the remainder of instructions in the basic block and
+        // the ones that always follow it (up until we reach a write to
+        // memory) to try to find any other gathers that can coalesce with
+        // this one.
+        llvm::BasicBlock *fwdBB = &bb;
         llvm::BasicBlock::iterator fwdIter = iter;
-        ++fwdIter;
-        for (; fwdIter != bb.end(); ++fwdIter) {
+        while (true) {
+            ++fwdIter;
+            if (fwdIter == fwdBB->end()) {
+                fwdBB = lNextCoalesceBlock(fwdBB);
+                if (fwdBB == NULL)
+                    break;
+                fwdIter = fwdBB->begin();
+            }
+
             // Must stop once we come to an instruction that may write to
             // memory; otherwise we could end up moving a read before this
             // write.
@@ -4362,6 +4860,606 @@ CreateGatherCoalescePass() {
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// ScatterCoalescePass
+
+// This is the store-side counterpart of GatherCoalescePass: given a
+// series of scatters with the mask all on that all write to a common base
+// pointer plus constant offsets (as happens when writing a varying struct
+// to memory with AOS layout), it works out which memory locations they
+// write to collectively and writes each fully covered contiguous range of
+// them with vector stores of 8, 4, or 2 elements (and scalar stores for
+// whatever is left over).  The values to store are shuffled together from
+// the scattered values.  Locations that aren't written by the scatters
+// are never written, so sparse sets of offsets just give scalar stores;
+// in that case the scatters are left alone.
+//
+// All of the stores are issued where the last scatter in the series was,
+// so there must not be any other memory accesses between the scatters.
+
+class ScatterCoalescePass : public llvm::BasicBlockPass {
+public:
+    static char ID;
+    ScatterCoalescePass() : BasicBlockPass(ID) { }
+
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
+    const char *getPassName() const { return "Scatter Coalescing"; }
+#else // LLVM 4.0+
+    llvm::StringRef getPassName() const { return "Scatter Coalescing"; }
+#endif
+    bool runOnBasicBlock(llvm::BasicBlock &BB);
+};
+
+char ScatterCoalescePass::ID = 0;
+
+
+/** Representation of a store that the scatter coalescing code has decided
+    to generate: count units starting at the given offset (in units) from
+    the common base pointer. */
+struct CoalescedStoreOp {
+    CoalescedStoreOp(int64_t s, int c) {
+        start = s;
+        count = c;
+    }
+
+    int64_t start;
+    int count;
+};
+
+
+/** Given the sorted set of offsets that are written, pick stores for
+    them: each run of consecutive offsets is covered with the widest
+    vector stores that fit in it. */
+static void
+lSelectStores(const std::map<int64_t, std::pair<int, int> > &writes,
+              std::vector<CoalescedStoreOp> *stores) {
+    std::map<int64_t, std::pair<int, int> >::const_iterator iter = writes.begin();
+    while (iter != writes.end()) {
+        // Find the end of the run of consecutive offsets starting here.
+        int64_t start = iter->first, end = start;
+        while (iter != writes.end() && iter->first == end) {
+            ++end;
+            ++iter;
+        }
+
+        while (start < end) {
+            int vectorWidths[] = { 8, 4, 2, 1 };
+            int nVectorWidths = sizeof(vectorWidths) / sizeof(vectorWidths[0]);
+            for (int i = 0; i < nVectorWidths; ++i)
+                if (end - start >= vectorWidths[i]) {
+                    stores->push_back(CoalescedStoreOp(start, vectorWidths[i]));
+                    start += vectorWidths[i];
+                    break;
+                }
+        }
+    }
+}
+
+
+/** Actually do the coalescing of a set of scatters that all write to
+    addresses of the form basePtr + constOffset; see lCoalesceGathers().
+    Returns false if it doesn't make sense to coalesce them.
+ */
+static bool
+lCoalesceScatters(const std::vector<llvm::CallInst *> &coalesceGroup) {
+    // As with gathers, 32-bit and 64-bit values are handled as 32-bit
+    // units and smaller ones at their own size.
+    llvm::Value *firstValues = coalesceGroup[0]->getArgOperand(4);
+    llvm::Type *elementType = firstValues->getType()->getScalarType();
+    int elementSize = 0;
+    if (elementType == LLVMTypes::Int8Type)
+        elementSize = 1;
+    else if (elementType == LLVMTypes::Int16Type)
+        elementSize = 2;
+    else if (elementType == LLVMTypes::Int32Type ||
+             elementType == LLVMTypes::FloatType)
+        elementSize = 4;
+    else if (elementType == LLVMTypes::Int64Type ||
+             elementType == LLVMTypes::DoubleType)
+        elementSize = 8;
+    else
+        FATAL("Unexpected scatter type in lCoalesceScatters");
+    int unitSize = (elementSize < 4) ? elementSize : 4;
+    llvm::Type *unitType = (unitSize == 1) ? LLVMTypes::Int8Type :
+        ((unitSize == 2) ? LLVMTypes::Int16Type : LLVMTypes::Int32Type);
+    int unitsPerScatter = g->target->getVectorWidth() * elementSize / unitSize;
+
+    std::vector<int64_t> constOffsets;
+    if (!lExtractConstOffsets(coalesceGroup, elementSize, unitSize,
+                              &constOffsets))
+        return false;
+
+    // Figure out which scatter and which of its units provides the final
+    // value at each offset that's written; later scatters (and, within a
+    // scatter, later lanes) overwrite the values written by earlier ones.
+    std::map<int64_t, std::pair<int, int> > writes;
+    for (int i = 0; i < (int)coalesceGroup.size(); ++i)
+        for (int j = 0; j < unitsPerScatter; ++j)
+            writes[constOffsets[i * unitsPerScatter + j]] = std::make_pair(i, j);
+
+    std::vector<CoalescedStoreOp> storeOps;
+    lSelectStores(writes, &storeOps);
+
+    bool anyVectorStores = false;
+    for (int i = 0; i < (int)storeOps.size(); ++i)
+        anyVectorStores |= (storeOps[i].count > 1);
+    if (!anyVectorStores)
+        return false;
+
+    std::vector<int> storeWidths;
+    for (int i = 0; i < (int)storeOps.size(); ++i)
+        storeWidths.push_back(storeOps[i].count);
+    lCoalescePerfInfo(coalesceGroup, storeWidths, "scatter", "store");
+
+    // All of the stores go where the last scatter is.
+    llvm::Instruction *insertBefore = coalesceGroup.back();
+    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
+
+    // Get the scattered values as vectors of units.
+    llvm::Type *unitVectorType = llvm::VectorType::get(unitType, unitsPerScatter);
+    std::vector<llvm::Value *> values;
+    for (int i = 0; i < (int)coalesceGroup.size(); ++i) {
+        llvm::Value *v = coalesceGroup[i]->getArgOperand(4);
+        if (v->getType() != unitVectorType)
+            v = new llvm::BitCastInst(v, unitVectorType, "scatter_units",
+                                      insertBefore);
+        values.push_back(v);
+    }
+
+    for (int i = 0; i < (int)storeOps.size(); ++i) {
+        const CoalescedStoreOp &op = storeOps[i];
+        llvm::Value *toStore = NULL;
+        if (op.count == 1) {
+            std::pair<int, int> src = writes[op.start];
+            toStore = llvm::ExtractElementInst::Create(values[src.first],
+                          LLVMInt32(src.second), "scatter_elt", insertBefore);
+        }
+        else {
+            // Assemble the vector to store one element at a time; LLVM
+            // turns this into shuffles of the scattered values.
+            toStore = llvm::UndefValue::get(llvm::VectorType::get(unitType, op.count));
+            for (int j = 0; j < op.count; ++j) {
+                std::pair<int, int> src = writes[op.start + j];
+                llvm::Value *elt =
+                    llvm::ExtractElementInst::Create(values[src.first],
+                        LLVMInt32(src.second), "scatter_elt", insertBefore);
+                toStore = llvm::InsertElementInst::Create(toStore, elt,
+                              LLVMInt32(j), "store_vec", insertBefore);
+            }
+        }
+
+        llvm::Value *ptr = lGEPInst(basePtr, LLVMInt64(op.start * unitSize),
+                                    "new_base", insertBefore);
+        ptr = new llvm::BitCastInst(ptr, llvm::PointerType::get(toStore->getType(), 0),
+                                    "ptr_cast", insertBefore);
+        new llvm::StoreInst(toStore, ptr, false /* not volatile */, unitSize,
+                            insertBefore);
+    }
+
+    for (int i = 0; i < (int)coalesceGroup.size(); ++i)
+        coalesceGroup[i]->eraseFromParent();
+
+    return true;
+}
+
+
+bool
+ScatterCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
+    DEBUG_START_PASS("ScatterCoalescePass");
+
+    llvm::Function *scatterFuncs[] = {
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_i8"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_i16"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_i32"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_float"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_i64"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_double"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_i8"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_i16"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_i32"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_float"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_i64"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_double"),
+    };
+    int nScatterFuncs = sizeof(scatterFuncs) / sizeof(scatterFuncs[0]);
+
+    bool modifiedAny = false;
+
+ restart:
+    for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e;
+         ++iter) {
+        llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
+        if (callInst == NULL)
+            continue;
+
+        llvm::Function *calledFunc = callInst->getCalledFunction();
+        if (calledFunc == NULL)
+            continue;
+
+        int i;
+        for (i = 0; i < nScatterFuncs; ++i)
+            if (scatterFuncs[i] != NULL && calledFunc == scatterFuncs[i])
+                break;
+        if (i == nScatterFuncs)
+            continue;
+
+        SourcePos pos;
+        lGetSourcePosFromMetadata(callInst, &pos);
+        Debug(pos, "Checking for coalescable scatters starting here...");
+
+        // The same conditions as for gathers apply: mask all on, uniform
+        // variable offsets, and the same base pointer, variable offsets
+        // and offset scale for all of the scatters.
+        llvm::Value *base = callInst->getArgOperand(0);
+        llvm::Value *variableOffsets = callInst->getArgOperand(1);
+        llvm::Value *offsetScale = callInst->getArgOperand(2);
+        llvm::Value *mask = callInst->getArgOperand(5);
+
+        if (lGetMaskStatus(mask) != ALL_ON)
+            continue;
+
+        if (!LLVMVectorValuesAllEqual(variableOffsets))
+            continue;
+
+        std::vector<llvm::CallInst *> coalesceGroup;
+        coalesceGroup.push_back(callInst);
+
+        llvm::BasicBlock::iterator fwdIter = iter;
+        ++fwdIter;
+        for (; fwdIter != bb.end(); ++fwdIter) {
+            llvm::CallInst *fwdCall = llvm::dyn_cast<llvm::CallInst>(&*fwdIter);
+            if (fwdCall != NULL &&
+                fwdCall->getCalledFunction() == calledFunc &&
+                base == fwdCall->getArgOperand(0) &&
+                variableOffsets == fwdCall->getArgOperand(1) &&
+                offsetScale == fwdCall->getArgOperand(2) &&
+                mask == fwdCall->getArgOperand(5)) {
+                SourcePos fwdPos;
+                lGetSourcePosFromMetadata(fwdCall, &fwdPos);
+                Debug(fwdPos, "This scatter can be coalesced.");
+                coalesceGroup.push_back(fwdCall);
+
+                if (coalesceGroup.size() == 4)
+                    // Same window as for gathers.
+                    break;
+            }
+            else if (fwdIter->mayReadOrWriteMemory())
+                // The earlier scatters' stores can't be moved past any
+                // other memory access.
+                break;
+        }
+
+        Debug(pos, "Done with checking for matching scatters");
+
+        if (lCoalesceScatters(coalesceGroup)) {
+            modifiedAny = true;
+            goto restart;
+        }
+    }
+
+    DEBUG_END_PASS("ScatterCoalescePass");
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateScatterCoalescePass() {
+    return new ScatterCoalescePass;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// ScalarizeUniformPass
+
+/** ispc programs often leave values "varying" even though every program
+    instance computes the same thing: loop bounds derived from uniform
+    parameters, the results of reduce_add() and friends that are assigned
+    to a varying, and so forth.  This pass runs a uniformity analysis over
+    each function and rewrites vector arithmetic, comparisons, casts and
+    selects whose results are provably the same in all of the lanes so
+    that they are computed once on scalar values and broadcast afterward.
+
+    The analysis follows ispc's masking model: branches in the generated
+    IR are always on scalar conditions, so a phi node that merges values
+    that are each the same across the lanes is itself uniform.  Values
+    only become varying via things like programIndex, loads, calls, and
+    blends under a varying execution mask (which show up as selects with a
+    varying condition).
+ */
+class ScalarizeUniformPass : public llvm::FunctionPass {
+public:
+    static char ID;
+    ScalarizeUniformPass() : FunctionPass(ID) { }
+
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
+    const char *getPassName() const { return "Scalarize Uniform Values"; }
+#else // LLVM 4.0+
+    llvm::StringRef getPassName() const { return "Scalarize Uniform Values"; }
+#endif
+    bool runOnFunction(llvm::Function &F);
+
+private:
+    bool scalarizeInBlock(llvm::BasicBlock &bb,
+                          const std::set<llvm::Value *> &uniform);
+};
+
+char ScalarizeUniformPass::ID = 0;
+
+
+/** Returns true if the given instruction is one that the uniformity
+    analysis tracks: a vector-typed phi, binary operator, cast, comparison
+    or select. */
+static bool
+lIsUniformCandidate(llvm::Instruction *inst) {
+    if (!llvm::isa<llvm::VectorType>(inst->getType()))
+        return false;
+
+    if (llvm::CastInst *cast = llvm::dyn_cast<llvm::CastInst>(inst)) {
+        // Casts that change the number of elements (e.g. a bitcast from
+        // <4 x i64> to <8 x i32>) can turn equal lanes into differing
+        // ones.
+        llvm::VectorType *srcType =
+            llvm::dyn_cast<llvm::VectorType>(cast->getSrcTy());
+        return (srcType != NULL &&
+                srcType->getNumElements() ==
+                inst->getType()->getVectorNumElements());
+    }
+
+    return (llvm::isa<llvm::PHINode>(inst) ||
+            llvm::isa<llvm::BinaryOperator>(inst) ||
+            llvm::isa<llvm::CmpInst>(inst) ||
+            llvm::isa<llvm::SelectInst>(inst));
+}
+
+
+/** Returns true if the given value is the same in all of its lanes, given
+    the set of tracked instructions currently believed to be uniform. */
+static bool
+lIsUniformValue(llvm::Value *v, const std::set<llvm::Value *> &uniform) {
+    if (!llvm::isa<llvm::VectorType>(v->getType()))
+        // Scalar operands (e.g. the condition of a select) are the same
+        // for the entire gang.
+        return true;
+
+    if (llvm::isa<llvm::UndefValue>(v))
+        return false;
+
+    if (llvm::isa<llvm::ConstantVector>(v) ||
+        llvm::isa<llvm::ConstantDataVector>(v) ||
+        llvm::isa<llvm::ConstantAggregateZero>(v) ||
+        llvm::isa<llvm::InsertElementInst>(v) ||
+        llvm::isa<llvm::ShuffleVectorInst>(v))
+        // This covers splatted constants as well as the
+        // insertelement/shufflevector sequences that broadcast a scalar.
+        return LLVMVectorValuesAllEqual(v);
+
+    if (llvm::isa<llvm::Constant>(v))
+        return false;
+
+    return (uniform.find(v) != uniform.end());
+}
+
+
+/** Returns true if all of the lanes of the result of the given tracked
+    instruction are equal, given the current state of the analysis. */
+static bool
+lIsUniformInst(llvm::Instruction *inst,
+               const std::set<llvm::Value *> &uniform) {
+    llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(inst);
+    if (phi != NULL) {
+        for (unsigned int i = 0; i < phi->getNumIncomingValues(); ++i) {
+            llvm::Value *incoming = phi->getIncomingValue(i);
+            // Incoming undef values don't constrain the result; whatever
+            // the other incoming values are can be used for them.
+            if (!llvm::isa<llvm::UndefValue>(incoming) &&
+                !lIsUniformValue(incoming, uniform))
+                return false;
+        }
+        return true;
+    }
+
+    for (unsigned int i = 0; i < inst->getNumOperands(); ++i)
+        if (!lIsUniformValue(inst->getOperand(i), uniform)) {
+            // Right shifts may still give the same value in all of the
+            // lanes even if their first operand varies (e.g. when it is a
+            // short linear sequence); LLVMVectorValuesAllEqual() knows how
+            // to figure that out.
+            if (inst->getOpcode() == llvm::Instruction::AShr ||
+                inst->getOpcode() == llvm::Instruction::LShr)
+                return LLVMVectorValuesAllEqual(inst);
+            return false;
+        }
+    return true;
+}
+
+
+/** Returns true if the given instruction is expensive enough as a vector
+    operation that it's worth computing it as a scalar even when some of
+    its operands need to be extracted from vectors first.  In particular,
+    LLVM scalarizes vector integer divides and floating-point remainders
+    on all of our targets. */
+static bool
+lIsExpensiveVectorOp(llvm::Instruction *inst) {
+    switch (inst->getOpcode()) {
+    case llvm::Instruction::UDiv:
+    case llvm::Instruction::SDiv:
+    case llvm::Instruction::URem:
+    case llvm::Instruction::SRem:
+    case llvm::Instruction::FRem:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/** Returns the value of the first lane of the given uniform value,
+    inserting an extractelement instruction before insertBefore if it
+    isn't directly available. */
+static llvm::Value *
+lGetUniformScalar(llvm::Value *v, llvm::Instruction *insertBefore) {
+    if (!llvm::isa<llvm::VectorType>(v->getType()))
+        return v;
+
+    llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(v);
+    if (c != NULL && c->getAggregateElement(0u) != NULL)
+        return c->getAggregateElement(0u);
+
+    // Look through broadcasts of a scalar value.
+    llvm::ShuffleVectorInst *shuffle = llvm::dyn_cast<llvm::ShuffleVectorInst>(v);
+    if (shuffle != NULL && shuffle->getMaskValue(0) == 0) {
+        llvm::InsertElementInst *ie =
+            llvm::dyn_cast<llvm::InsertElementInst>(shuffle->getOperand(0));
+        llvm::ConstantInt *ci = (ie != NULL) ?
+            llvm::dyn_cast<llvm::ConstantInt>(ie->getOperand(2)) : NULL;
+        if (ci != NULL && ci->isZero())
+            return ie->getOperand(1);
+    }
+
+    return llvm::ExtractElementInst::Create(v, LLVMInt32(0),
+                                            LLVMGetName(v, "_lane0"),
+                                            insertBefore);
+}
+
+
+/** Returns true if lGetUniformScalar() can find the scalar value for the
+    given uniform value without extracting it from a vector. */
+static bool
+lHaveUniformScalar(llvm::Value *v) {
+    if (!llvm::isa<llvm::VectorType>(v->getType()))
+        return true;
+
+    llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(v);
+    if (c != NULL)
+        return (c->getAggregateElement(0u) != NULL);
+
+    llvm::ShuffleVectorInst *shuffle = llvm::dyn_cast<llvm::ShuffleVectorInst>(v);
+    if (shuffle == NULL || shuffle->getMaskValue(0) != 0)
+        return false;
+    llvm::InsertElementInst *ie =
+        llvm::dyn_cast<llvm::InsertElementInst>(shuffle->getOperand(0));
+    llvm::ConstantInt *ci = (ie != NULL) ?
+        llvm::dyn_cast<llvm::ConstantInt>(ie->getOperand(2)) : NULL;
+    return (ci != NULL && ci->isZero());
+}
+
+
+bool
+ScalarizeUniformPass::runOnFunction(llvm::Function &F) {
+    // Start out optimistically assuming that all of the tracked
+    // instructions are uniform and then iterate to a fixed point, removing
+    // the ones that turn out not to be; this gets loop-carried values
+    // (phis that feed back into themselves) right.
+    std::set<llvm::Value *> uniform;
+    std::vector<llvm::Instruction *> candidates;
+    for (llvm::Function::iterator bb = F.begin(); bb != F.end(); ++bb)
+        for (llvm::BasicBlock::iterator iter = bb->begin(); iter != bb->end();
+             ++iter) {
+            llvm::Instruction *inst = &*iter;
+            if (lIsUniformCandidate(inst)) {
+                uniform.insert(inst);
+                candidates.push_back(inst);
+            }
+        }
+
+    if (candidates.empty())
+        return false;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (unsigned int i = 0; i < candidates.size(); ++i) {
+            llvm::Instruction *inst = candidates[i];
+            if (uniform.find(inst) != uniform.end() &&
+                !lIsUniformInst(inst, uniform)) {
+                uniform.erase(inst);
+                changed = true;
+            }
+        }
+    }
+
+    bool modifiedAny = false;
+    for (llvm::Function::iterator bb = F.begin(); bb != F.end(); ++bb)
+        modifiedAny |= scalarizeInBlock(*bb, uniform);
+    return modifiedAny;
+}
+
+
+bool
+ScalarizeUniformPass::scalarizeInBlock(llvm::BasicBlock &bb,
+                                       const std::set<llvm::Value *> &uniform) {
+    DEBUG_START_PASS("ScalarizeUniformPass");
+
+    bool modifiedAny = false;
+
+    for (llvm::BasicBlock::iterator iter = bb.begin(); iter != bb.end(); ) {
+        llvm::Instruction *inst = &*iter;
+        ++iter;
+
+        // Phis are left as vectors; their users extract the first lane if
+        // they end up being scalarized.
+        if (uniform.find(inst) == uniform.end() ||
+            llvm::isa<llvm::PHINode>(inst))
+            continue;
+
+        // Only scalarize if doing so doesn't require extracting operands
+        // from vectors, or if the vector operation is expensive enough
+        // that it's a win anyway.  Since we're going through the
+        // instructions in order, operands that have already been
+        // scalarized are broadcasts by now and are free to use.
+        bool needsExtract = false;
+        for (unsigned int i = 0; i < inst->getNumOperands(); ++i)
+            if (!lHaveUniformScalar(inst->getOperand(i)))
+                needsExtract = true;
+        if (needsExtract && !lIsExpensiveVectorOp(inst))
+            continue;
+
+        // Clone the instruction so that its opcode, comparison predicate,
+        // flags and so forth carry over, and then turn the clone into the
+        // scalar version of the operation.
+        llvm::Instruction *scalarInst = inst->clone();
+        scalarInst->mutateType(inst->getType()->getScalarType());
+        for (unsigned int i = 0; i < inst->getNumOperands(); ++i)
+            scalarInst->setOperand(i, lGetUniformScalar(inst->getOperand(i),
+                                                        inst));
+        scalarInst->setName(LLVMGetName(inst, "_uniform"));
+        scalarInst->insertBefore(inst);
+
+        // Broadcast the result for the vector users:
+        //   %name123 = insertelement <4 x i32> undef, i32 %val, i32 0
+        //   %name124 = shufflevector <4 x i32> %name123, <4 x i32> undef,
+        //                                              <4 x i32> zeroinitializer
+        llvm::Type *vecType = inst->getType();
+        llvm::Value *insertVec = llvm::InsertElementInst::Create(
+            llvm::UndefValue::get(vecType), scalarInst, LLVMInt32(0),
+            inst->getName(), inst);
+        llvm::Value *zeroMask = llvm::ConstantVector::getSplat(
+            vecType->getVectorNumElements(),
+            llvm::Constant::getNullValue(llvm::Type::getInt32Ty(*g->ctx)));
+        llvm::Instruction *shufValue = new llvm::ShuffleVectorInst(
+            insertVec, llvm::UndefValue::get(vecType), zeroMask,
+            inst->getName());
+
+        Debug(SourcePos(), "Scalarized uniform %s.",
+              inst->getName().str().c_str());
+        lCopyMetadata(shufValue, inst);
+        llvm::ReplaceInstWithInst(inst, shufValue);
+        modifiedAny = true;
+    }
+
+    DEBUG_END_PASS("ScalarizeUniformPass");
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateScalarizeUniformPass() {
+    return new ScalarizeUniformPass;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // ReplacePseudoMemoryOpsPass
 
@@ -4872,6 +5970,138 @@ CreateDebugPass(char * output) {
     return new DebugPass(output);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// TimeTraceModuleMarkerPass, TimeTraceFunctionMarkerPass,
+// TimeTraceBasicBlockMarkerPass
+
+/** These passes are added immediately before and after each optimization
+    pass when --time-trace is used; they begin and end a trace event for
+    the pass.  A marker has to be of the same kind as the pass it
+    brackets: the pass manager groups consecutive function (or basic
+    block) passes to run them a function (or basic block) at a time, and
+    a marker of another kind would split those groups and change the
+    order in which the code is optimized.  The markers don't change or
+    invalidate anything.
+ */
+class TimeTraceModuleMarkerPass : public llvm::ModulePass {
+public:
+    static char ID;
+    TimeTraceModuleMarkerPass(const std::string &name, bool b)
+        : ModulePass(ID), tracedName(name), begin(b) { }
+
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
+    const char *getPassName() const { return "Time Trace Marker"; }
+#else // LLVM 4.0+
+    llvm::StringRef getPassName() const { return "Time Trace Marker"; }
+#endif
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const {
+        AU.setPreservesAll();
+    }
+    bool runOnModule(llvm::Module &module) {
+        if (begin)
+            TimeTraceBegin(tracedName.c_str());
+        else
+            TimeTraceEnd();
+        return false;
+    }
+
+private:
+    std::string tracedName;
+    bool begin;
+};
+
+char TimeTraceModuleMarkerPass::ID = 0;
+
+
+class TimeTraceFunctionMarkerPass : public llvm::FunctionPass {
+public:
+    static char ID;
+    TimeTraceFunctionMarkerPass(const std::string &name, bool b)
+        : FunctionPass(ID), tracedName(name), begin(b) { }
+
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
+    const char *getPassName() const { return "Time Trace Marker"; }
+#else // LLVM 4.0+
+    llvm::StringRef getPassName() const { return "Time Trace Marker"; }
+#endif
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const {
+        AU.setPreservesAll();
+    }
+    bool runOnFunction(llvm::Function &func) {
+        if (begin)
+            TimeTraceBegin(tracedName.c_str(), func.getName().str().c_str());
+        else
+            TimeTraceEnd();
+        return false;
+    }
+
+private:
+    std::string tracedName;
+    bool begin;
+};
+
+char TimeTraceFunctionMarkerPass::ID = 0;
+
+
+class TimeTraceBasicBlockMarkerPass : public llvm::BasicBlockPass {
+public:
+    static char ID;
+    TimeTraceBasicBlockMarkerPass(const std::string &name, bool b)
+        : BasicBlockPass(ID), tracedName(name), begin(b) { }
+
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
+    const char *getPassName() const { return "Time Trace Marker"; }
+#else // LLVM 4.0+
+    llvm::StringRef getPassName() const { return "Time Trace Marker"; }
+#endif
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const {
+        AU.setPreservesAll();
+    }
+    bool runOnBasicBlock(llvm::BasicBlock &bb) {
+        if (begin)
+            TimeTraceBegin(tracedName.c_str(),
+                           bb.getParent()->getName().str().c_str());
+        else
+            TimeTraceEnd();
+        return false;
+    }
+
+private:
+    std::string tracedName;
+    bool begin;
+};
+
+char TimeTraceBasicBlockMarkerPass::ID = 0;
+
+
+/** Returns a marker pass to go before (if begin is true) or after the
+    given pass, or NULL if the pass can't be traced on its own.  Loop and
+    call graph passes are left alone, since markers between them would
+    split up the pass managers that interleave them and change the order
+    in which the code is optimized. */
+static llvm::Pass *
+CreateTimeTraceMarkerPass(llvm::Pass *tracedPass, bool begin) {
+#if ISPC_LLVM_VERSION <= ISPC_LLVM_3_9
+    std::string name = tracedPass->getPassName();
+#else // LLVM 4.0+
+    std::string name = tracedPass->getPassName().str();
+#endif
+    if (tracedPass->getAsImmutablePass() != NULL)
+        // Nothing to time; these just provide information to other passes.
+        return NULL;
+
+    switch (tracedPass->getPassKind()) {
+    case llvm::PT_Module:
+        return new TimeTraceModuleMarkerPass(name, begin);
+    case llvm::PT_Function:
+        return new TimeTraceFunctionMarkerPass(name, begin);
+    case llvm::PT_BasicBlock:
+        return new TimeTraceBasicBlockMarkerPass(name, begin);
+    default:
+        return NULL;
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // MakeInternalFuncsStaticPass
 
@@ -180,6 +180,16 @@ def run_test(testname):
     filename = add_prefix(testname)
     ispc_exe_rel = add_prefix(ispc_exe)
 
+    # tests can ask for additional ispc options with "// ispc-options: ..."
+    # lines
+    extra_options = ""
+    file = open(filename, 'r')
+    for line in file:
+        options_line = re.match(r'\s*//\s*ispc-options:(.*)', line)
+        if options_line != None:
+            extra_options += " " + options_line.group(1).strip()
+    file.close()
+
     # is this a test to make sure an error is issued?
     want_error = (filename.find("tests_errors") != -1)
     if want_error == True:
@@ -192,6 +202,7 @@ def run_test(testname):
         else:
             ispc_cmd = ispc_exe_rel + " --werror --nowrap %s --arch=%s --target=%s" % \
                 (filename, options.arch, options.target) 
+        ispc_cmd += extra_options
         (return_code, output, timeout) = run_command(ispc_cmd, 10)
         got_error = (return_code != 0) or timeout
 
@@ -341,6 +352,7 @@ def run_test(testname):
                          (filename4ptx, obj_name, options.target)
 
         # compile the ispc code, make the executable, and run it...
+        ispc_cmd += extra_options
         ispc_cmd += " -h " + filename + ".h"
         cc_cmd += " -DTEST_HEADER=<" + filename + ".h>"
         (compile_error, run_error) = run_cmds([ispc_cmd, cc_cmd], 
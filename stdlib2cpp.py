@@ -1,18 +1,164 @@
 #!/usr/bin/python
 
+# Converts the preprocessed stdlib.ispc source into C++ source.  The
+# declarations (types, global variables, function prototypes and the
+# definitions of non-static functions) go into stdlib_<mask>_code[], which
+# is parsed for every compile.  The definitions of the static functions
+# are split out into stdlib_<mask>_functions[], as pairs of function names
+# and source code for all of the overloads with that name, so that the
+# compiler only needs to parse the ones that a program actually calls.
+
 import sys
+import re
 
 t=str(sys.argv[1])
 
-sys.stdout.write("char stdlib_" + t + "_code[] = {\n")
-
 width = 16
+
+def write_bytes(name, data, qualifiers):
+    sys.stdout.write(qualifiers + "char " + name + "[] = {\n")
+    for i in range(0, len(data), 1):
+        sys.stdout.write("0x%0.2X, " % ord(data[i:i+1]))
+
+        if i%width == (width-1):
+            sys.stdout.write("\n")
+
+    sys.stdout.write("0x00 };\n\n")
+
+
+line_marker = re.compile(r'#(?:line)? *([0-9]+) +"([^"]*)"')
+identifier = re.compile(r'([A-Za-z_][A-Za-z_0-9]*)\s*$')
+
+# Splits the source into top-level items: declarations that end with a
+# ';' and function definitions that end with the '}' that closes their
+# body.  Each item is returned as (text, line, filename, isFunction,
+# bodyStart), where line and filename give the source position of the
+# first character of the text.
+def split_items(data):
+    items = []
+    line = 1
+    filename = ""
+    start = None
+    startLine = 0
+    startFilename = ""
+    braceDepth = 0
+    parenDepth = 0
+    bodyStart = -1
+    i = 0
+    atLineStart = True
+    while i < len(data):
+        c = data[i]
+        if atLineStart and c == '#':
+            # Line markers from the preprocessor; these may appear in the
+            # middle of an item as well.
+            end = data.find('\n', i)
+            if end == -1:
+                end = len(data)
+            m = line_marker.match(data[i:end])
+            if m:
+                line = int(m.group(1)) - 1
+                filename = m.group(2)
+            if start is None:
+                i = end
+                continue
+            i = end
+            continue
+        if c == '\n':
+            line += 1
+            atLineStart = True
+            i += 1
+            continue
+        atLineStart = False
+        if c.isspace():
+            i += 1
+            continue
+        if start is None:
+            start = i
+            startLine = line
+            startFilename = filename
+            bodyStart = -1
+        if c == '"' or c == '\'':
+            # Skip over string and character literals.
+            j = i + 1
+            while j < len(data) and data[j] != c:
+                if data[j] == '\\':
+                    j += 1
+                j += 1
+            i = j + 1
+            continue
+        if c == '(':
+            parenDepth += 1
+        elif c == ')':
+            parenDepth -= 1
+        elif c == '{':
+            if braceDepth == 0 and parenDepth == 0:
+                header = data[start:i]
+                if (header.rstrip().endswith(')') and '=' not in header and
+                    re.match(r'\s*(struct|enum|typedef)\b', header) is None):
+                    bodyStart = i
+            braceDepth += 1
+        elif c == '}':
+            braceDepth -= 1
+            if braceDepth == 0 and bodyStart != -1:
+                items.append((data[start:i+1], startLine, startFilename,
+                              True, bodyStart - start))
+                start = None
+        elif c == ';' and braceDepth == 0 and parenDepth == 0:
+            items.append((data[start:i+1], startLine, startFilename, False, -1))
+            start = None
+        i += 1
+    if start is not None:
+        items.append((data[start:], startLine, startFilename, False, -1))
+    return items
+
+
+# Returns the name of the function whose definition starts with the given
+# header (everything before the body), or None if it can't be determined.
+def function_name(header):
+    header = header.rstrip()
+    depth = 0
+    for i in range(len(header) - 1, -1, -1):
+        if header[i] == ')':
+            depth += 1
+        elif header[i] == '(':
+            depth -= 1
+            if depth == 0:
+                m = identifier.search(header[:i])
+                if m is None or m.group(1) == "operator":
+                    return None
+                return m.group(1)
+    return None
+
+
 data = sys.stdin.read()
-for i in range(0, len(data), 1):
-    sys.stdout.write("0x%0.2X, " % ord(data[i:i+1]))
 
-    if i%width == (width-1):
-        sys.stdout.write("\n")
+declarations = ""
+functions = []
+functionCode = {}
+for (text, line, filename, isFunction, bodyStart) in split_items(data):
+    marker = "# %d \"%s\"\n" % (line, filename)
+    if isFunction:
+        header = text[:bodyStart]
+        name = function_name(header)
+        if name is not None and re.search(r'\bstatic\b', header) and \
+           not re.search(r'\b(export|task)\b', header):
+            # Declare the function here, but leave its definition to be
+            # parsed if it turns out to be needed.
+            declarations += marker + header.rstrip() + ";\n"
+            if name not in functionCode:
+                functions.append(name)
+                functionCode[name] = ""
+            functionCode[name] += marker + text + "\n"
+            continue
+    declarations += marker + text + "\n"
+
+write_bytes("stdlib_" + t + "_code", declarations, "")
+
+for i in range(len(functions)):
+    write_bytes("stdlib_" + t + "_function%d" % i, functionCode[functions[i]],
+                "static ")
 
-sys.stdout.write("0x00 };\n\n")
-                                    
+sys.stdout.write("const char *stdlib_" + t + "_functions[] = {\n")
+for i in range(len(functions)):
+    sys.stdout.write("    \"%s\", stdlib_%s_function%d,\n" % (functions[i], t, i))
+sys.stdout.write("    0, 0 };\n")
@@ -53,6 +53,7 @@ Symbol::Symbol(const std::string &n, SourcePos p, const Type *t,
     storageClass = sc;
     varyingCFDepth = 0;
     parentFunction = NULL;
+    isStdlib = false;
 }
 
 
@@ -105,6 +105,9 @@ public:
                               /*!< For symbols that are parameters to functions or are
                                    variables declared inside functions, this gives the
                                    function they're in. */
+    bool isStdlib;            /*!< For symbols that represent functions, this is true if
+                                   the function was declared by the stdlib.ispc code that
+                                   DefineStdlib() parses. */
 };
 
 
@@ -59,10 +59,15 @@
 #include <windows.h>
 #else
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #endif // ISPC_IS_WINDOWS
 #include <set>
+#include <map>
 #include <algorithm>
 
 #if ISPC_LLVM_VERSION == ISPC_LLVM_3_2
@@ -321,6 +326,11 @@ asprintf(char **sptr, const char *fmt, ...)
 #endif
 
 
+/** When non-NULL, each message that lPrint() prints is also appended
+    here; see DiagnosticsRecordBegin(). */
+static std::string *lRecordedDiagnostics = NULL;
+
+
 /** Helper function for Error(), Warning(), etc.
 
     @param type   The type of message being printed (e.g. "Warning")
@@ -373,6 +383,22 @@ lPrint(const char *type, bool isError, SourcePos p, const char *fmt,
         return;
     printed.insert(formattedBuf);
 
+    if (lRecordedDiagnostics != NULL) {
+        // One record per message: a header line with the message type, the
+        // source position and the lengths of the file name and message
+        // text, followed by the text of the two of them.
+        char header[128];
+        snprintf(header, sizeof(header), "%d %d %d %d %d %d %d\n",
+                 isError ? 1 : 0, p.first_line, p.first_column, p.last_line,
+                 p.last_column, (int)strlen(p.name), (int)strlen(errorBuf));
+        *lRecordedDiagnostics += type;
+        *lRecordedDiagnostics += "\n";
+        *lRecordedDiagnostics += header;
+        *lRecordedDiagnostics += p.name;
+        *lRecordedDiagnostics += errorBuf;
+        *lRecordedDiagnostics += "\n";
+    }
+
     PrintWithWordBreaks(formattedBuf, indent, TerminalWidth(), stderr);
     lPrintFileLineContext(p);
 
@@ -435,6 +461,74 @@ PerformanceWarning(SourcePos p, const char *fmt, ...) {
 }
 
 
+void
+DiagnosticsRecordBegin() {
+    delete lRecordedDiagnostics;
+    lRecordedDiagnostics = new std::string;
+}
+
+
+std::string
+DiagnosticsRecordEnd() {
+    if (lRecordedDiagnostics == NULL)
+        return "";
+    std::string recorded = *lRecordedDiagnostics;
+    delete lRecordedDiagnostics;
+    lRecordedDiagnostics = NULL;
+    return recorded;
+}
+
+
+/** Calls lPrint() with the given arguments; lPrint() takes a va_list. */
+static void
+lPrintRecorded(const char *type, bool isError, SourcePos p,
+               const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    lPrint(type, isError, p, fmt, args);
+    va_end(args);
+}
+
+
+void
+DiagnosticsReplay(const std::string &recorded) {
+    if (g->quiet)
+        return;
+
+    size_t pos = 0;
+    while (pos < recorded.size()) {
+        size_t typeEnd = recorded.find('\n', pos);
+        if (typeEnd == std::string::npos)
+            return;
+        size_t headerEnd = recorded.find('\n', typeEnd + 1);
+        if (headerEnd == std::string::npos)
+            return;
+        std::string type = recorded.substr(pos, typeEnd - pos);
+        std::string header = recorded.substr(typeEnd + 1,
+                                             headerEnd - typeEnd - 1);
+        int isError, firstLine, firstColumn, lastLine, lastColumn;
+        int nameLength, messageLength;
+        if (sscanf(header.c_str(), "%d %d %d %d %d %d %d", &isError,
+                   &firstLine, &firstColumn, &lastLine, &lastColumn,
+                   &nameLength, &messageLength) != 7 ||
+            nameLength < 0 || messageLength < 0 ||
+            headerEnd + 1 + nameLength + messageLength + 1 > recorded.size())
+            return;
+
+        // SourcePos only holds on to the file name's pointer, so make a
+        // copy that stays around.
+        std::string name = recorded.substr(headerEnd + 1, nameLength);
+        std::string message = recorded.substr(headerEnd + 1 + nameLength,
+                                              messageLength);
+        SourcePos p(strdup(name.c_str()), firstLine, firstColumn, lastLine,
+                    lastColumn);
+        lPrintRecorded(type.c_str(), isError != 0, p, "%s", message.c_str());
+
+        pos = headerEnd + 1 + nameLength + messageLength + 1;
+    }
+}
+
+
 static void
 lPrintBugText() {
     static bool printed = false;
@@ -657,3 +751,311 @@ VerifyDataLayoutCompatibility(const std::string &module_dl,
     return true;
 }
 
+
+
+///////////////////////////////////////////////////////////////////////////
+// Compile-time tracing
+
+struct TimeTraceEvent {
+    std::string name, detail;
+    int64_t start, duration;  // microseconds since tracing started
+    int pid;                  // 0 for events from this process
+};
+
+static bool lTimeTraceEnabled = false;
+static int64_t lTimeTraceGranularity;
+static int64_t lTimeTraceStartTime;
+static std::vector<TimeTraceEvent> lTimeTraceStack;
+static std::vector<TimeTraceEvent> lTimeTraceEvents;
+// Number of occurrences and total duration of events, by name.
+static std::map<std::string, std::pair<int, int64_t> > lTimeTraceTotals;
+// Child processes whose events have been merged into ours.
+static std::set<int> lTimeTraceChildren;
+
+
+/** Returns the current time in microseconds, from an arbitrary base.  The
+    clock doesn't jump when the system time is set, and child processes
+    share it with their parent. */
+static int64_t
+lTimeTraceClock() {
+#ifdef ISPC_IS_WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (int64_t)(count.QuadPart * (1000000.0 / frequency.QuadPart));
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    // Older systems without clock_gettime().
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+static int64_t
+lTimeTraceNow() {
+    return lTimeTraceClock() - lTimeTraceStartTime;
+}
+
+
+void
+TimeTraceInitialize(int granularityUs) {
+    lTimeTraceEnabled = true;
+    lTimeTraceGranularity = granularityUs;
+    lTimeTraceStartTime = lTimeTraceClock();
+}
+
+
+bool
+TimeTraceEnabled() {
+    return lTimeTraceEnabled;
+}
+
+
+void
+TimeTraceBegin(const char *name, const char *detail) {
+    if (!lTimeTraceEnabled)
+        return;
+    TimeTraceEvent event;
+    event.name = name;
+    if (detail != NULL)
+        event.detail = detail;
+    event.start = lTimeTraceNow();
+    event.duration = 0;
+    event.pid = 0;
+    lTimeTraceStack.push_back(event);
+}
+
+
+void
+TimeTraceEnd() {
+    if (!lTimeTraceEnabled)
+        return;
+    Assert(!lTimeTraceStack.empty());
+    TimeTraceEvent event = lTimeTraceStack.back();
+    lTimeTraceStack.pop_back();
+    event.duration = lTimeTraceNow() - event.start;
+
+    // Only count the outermost event if ones with the same name are
+    // nested, so that the totals don't include any time twice.
+    bool nested = false;
+    for (unsigned int i = 0; i < lTimeTraceStack.size(); ++i)
+        if (lTimeTraceStack[i].name == event.name)
+            nested = true;
+    if (!nested) {
+        std::pair<int, int64_t> &total = lTimeTraceTotals[event.name];
+        ++total.first;
+        total.second += event.duration;
+    }
+
+    if (event.duration >= lTimeTraceGranularity)
+        lTimeTraceEvents.push_back(event);
+}
+
+
+#ifndef ISPC_IS_WINDOWS
+/** Returns the name of the file in which the child process with the
+    given pid leaves its trace events for the parent with the given pid. */
+static std::string
+lTimeTraceChildFileName(int parentPid, int childPid) {
+    const char *tmpdir = getenv("TMPDIR");
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/ispc-time-trace-%d-%d", parentPid, childPid);
+    return std::string(tmpdir != NULL ? tmpdir : "/tmp") + buf;
+}
+
+
+void
+TimeTraceChildBegin() {
+    if (!lTimeTraceEnabled)
+        return;
+    // The events inherited from the parent are its to report; the ones
+    // that are still open are ended by the parent, too.
+    lTimeTraceEvents.clear();
+    lTimeTraceTotals.clear();
+    lTimeTraceChildren.clear();
+}
+
+
+void
+TimeTraceChildEnd() {
+    if (!lTimeTraceEnabled)
+        return;
+    std::string fileName = lTimeTraceChildFileName((int)getppid(), (int)getpid());
+    // The name is predictable, so create the file exclusively (and only
+    // readable by us) rather than writing through whatever is there
+    // already, e.g. a symlink that someone else has put in its place.
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+        return;
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        remove(fileName.c_str());
+        return;
+    }
+    // Each event and total is written as a line with its numbers and the
+    // lengths of its strings, followed by the strings themselves.
+    for (unsigned int i = 0; i < lTimeTraceEvents.size(); ++i) {
+        const TimeTraceEvent &event = lTimeTraceEvents[i];
+        fprintf(f, "E %lld %lld %d %d\n%s%s\n", (long long)event.start,
+                (long long)event.duration, (int)event.name.size(),
+                (int)event.detail.size(), event.name.c_str(),
+                event.detail.c_str());
+    }
+    for (std::map<std::string, std::pair<int, int64_t> >::const_iterator
+             iter = lTimeTraceTotals.begin();
+         iter != lTimeTraceTotals.end(); ++iter)
+        fprintf(f, "T %d %lld %d\n%s\n", iter->second.first,
+                (long long)iter->second.second, (int)iter->first.size(),
+                iter->first.c_str());
+    fclose(f);
+}
+
+
+/** Reads a string of the given length, followed by a newline if
+    lastInLine is true. */
+static bool
+lTimeTraceReadString(FILE *f, int length, bool lastInLine, std::string *str) {
+    if (length < 0)
+        return false;
+    str->resize(length);
+    if (length > 0 && fread(&(*str)[0], 1, length, f) != (size_t)length)
+        return false;
+    return !lastInLine || fgetc(f) == '\n';
+}
+
+
+void
+TimeTraceMergeChild(int pid) {
+    if (!lTimeTraceEnabled)
+        return;
+    std::string fileName = lTimeTraceChildFileName((int)getpid(), pid);
+    int fd = open(fileName.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (fd == -1)
+        // The child may have failed before it got to write its events.
+        return;
+    // Only take events from a file that the child created.
+    struct stat st;
+    FILE *f = NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        (f = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return;
+    }
+
+    lTimeTraceChildren.insert(pid);
+    char kind;
+    while (fscanf(f, " %c", &kind) == 1) {
+        long long a, b;
+        int nameLength, detailLength;
+        std::string name, detail;
+        if (kind == 'E') {
+            if (fscanf(f, "%lld %lld %d %d", &a, &b, &nameLength,
+                       &detailLength) != 4 || fgetc(f) != '\n' ||
+                !lTimeTraceReadString(f, nameLength, false, &name) ||
+                !lTimeTraceReadString(f, detailLength, true, &detail))
+                break;
+            TimeTraceEvent event;
+            event.name = name;
+            event.detail = detail;
+            event.start = a;
+            event.duration = b;
+            event.pid = pid;
+            lTimeTraceEvents.push_back(event);
+        }
+        else if (kind == 'T') {
+            int count;
+            if (fscanf(f, "%d %lld %d", &count, &b, &nameLength) != 3 ||
+                fgetc(f) != '\n' ||
+                !lTimeTraceReadString(f, nameLength, true, &name))
+                break;
+            std::pair<int, int64_t> &total = lTimeTraceTotals[name];
+            total.first += count;
+            total.second += b;
+        }
+        else
+            break;
+    }
+    fclose(f);
+    remove(fileName.c_str());
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+static std::string
+lJSONEscape(const std::string &str) {
+    std::string result;
+    for (unsigned int i = 0; i < str.size(); ++i) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        }
+        else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            result += buf;
+        }
+        else
+            result += c;
+    }
+    return result;
+}
+
+
+bool
+TimeTraceWrite(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return false;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (unsigned int i = 0; i < lTimeTraceEvents.size(); ++i) {
+        const TimeTraceEvent &event = lTimeTraceEvents[i];
+        // Events from child processes (for --jobs and the partitioned
+        // compiles) go under the pids of the children.
+        fprintf(f, "{\"pid\":%d,\"tid\":0,\"ph\":\"X\",\"ts\":%lld,"
+                "\"dur\":%lld,\"name\":\"%s\"", event.pid != 0 ? event.pid : 1,
+                (long long)event.start, (long long)event.duration,
+                lJSONEscape(event.name).c_str());
+        if (!event.detail.empty())
+            fprintf(f, ",\"args\":{\"detail\":\"%s\"}",
+                    lJSONEscape(event.detail).c_str());
+        fprintf(f, "},\n");
+    }
+
+    // Emit the totals for each kind of event on threads of their own, so
+    // that they show up as separate tracks.
+    int tid = 1;
+    for (std::map<std::string, std::pair<int, int64_t> >::const_iterator
+             iter = lTimeTraceTotals.begin();
+         iter != lTimeTraceTotals.end(); ++iter, ++tid) {
+        int count = iter->second.first;
+        int64_t total = iter->second.second;
+        fprintf(f, "{\"pid\":1,\"tid\":%d,\"ph\":\"X\",\"ts\":0,"
+                "\"dur\":%lld,\"name\":\"Total %s\",\"args\":{\"count\":%d,"
+                "\"avg ms\":%.3f}},\n", tid, (long long)total,
+                lJSONEscape(iter->first).c_str(), count,
+                total / (1000.0 * count));
+    }
+
+    for (std::set<int>::const_iterator iter = lTimeTraceChildren.begin();
+         iter != lTimeTraceChildren.end(); ++iter)
+        fprintf(f, "{\"pid\":%d,\"tid\":0,\"ph\":\"M\",\"name\":\"process_name\","
+                "\"args\":{\"name\":\"ispc (child %d)\"}},\n", *iter, *iter);
+    fprintf(f, "{\"pid\":1,\"tid\":0,\"ph\":\"M\",\"name\":\"process_name\","
+            "\"args\":{\"name\":\"ispc\"}}\n");
+    fprintf(f, "]}\n");
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
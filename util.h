@@ -106,6 +106,20 @@ void Error(SourcePos p, const char *format, ...) PRINTF_FUNC;
 */
 void PerformanceWarning(SourcePos p, const char *format, ...) PRINTF_FUNC;
 
+/** Starts recording the messages that Error(), Warning(), etc. print, so
+    that the compilation cache can store them along with the outputs of a
+    compilation. */
+void DiagnosticsRecordBegin();
+
+/** Stops recording messages and returns the ones printed since the
+    corresponding DiagnosticsRecordBegin() call, in a form that can be
+    passed to DiagnosticsReplay(). */
+std::string DiagnosticsRecordEnd();
+
+/** Prints the messages that were previously recorded with
+    DiagnosticsRecordBegin() and DiagnosticsRecordEnd() again. */
+void DiagnosticsReplay(const std::string &recorded);
+
 /** Reports a fatal error that causes the program to terminate.  This
     should only be used for cases where there is an internal error in the
     compiler.
@@ -170,4 +184,58 @@ void PrintWithWordBreaks(const char *buf, int indent, int columnWidth,
  */
 int TerminalWidth();
 
+/** Enables recording of compile-time trace events for the --time-trace
+    option.  Events shorter than granularityUs microseconds are dropped
+    from the trace, though they still count toward the per-name totals. */
+void TimeTraceInitialize(int granularityUs);
+
+/** Returns true if compile-time trace events are being recorded. */
+bool TimeTraceEnabled();
+
+/** Starts a trace event with the given name; detail optionally gives
+    more information about it (e.g. the function being processed) and may
+    be NULL.  Events must be ended in the reverse of the order they were
+    begun. */
+void TimeTraceBegin(const char *name, const char *detail = NULL);
+
+/** Ends the most recently begun trace event. */
+void TimeTraceEnd();
+
+#ifndef ISPC_IS_WINDOWS
+/** Must be called in a child process that the compiler forks while
+    tracing, before it records any events of its own. */
+void TimeTraceChildBegin();
+
+/** Must be called in a forked child process before it exits; saves the
+    events that it recorded for the parent to merge. */
+void TimeTraceChildEnd();
+
+/** Adds the events recorded by the child process with the given pid,
+    which has exited, to this process's trace. */
+void TimeTraceMergeChild(int pid);
+#endif // !ISPC_IS_WINDOWS
+
+/** Writes the recorded trace events to the given file in the Chrome
+    trace event format, which can be loaded in chrome://tracing or in
+    Perfetto.  Returns false if the file couldn't be written. */
+bool TimeTraceWrite(const char *filename);
+
+/** Records a trace event covering the lifetime of the object, if
+    --time-trace is in effect. */
+class TimeTraceScope {
+public:
+    TimeTraceScope(const char *name, const char *detail = NULL) {
+        active = TimeTraceEnabled();
+        if (active)
+            TimeTraceBegin(name, detail);
+    }
+    ~TimeTraceScope() {
+        if (active)
+            TimeTraceEnd();
+    }
+
+private:
+    bool active;
+};
+
 #endif // ISPC_UTIL_H